@@ -0,0 +1,299 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "core/Geometry.h"
+#include "core/RayPacket.h"
+#include "core/TriangleMesh.h"
+#include "core/TrianglePacket.h"
+
+/// @brief Parameters of the BVH builders.
+/// They can be set in the scene file with `<default name="accel_..." value="..."/>`, e.g. `accel_bins`.
+struct BVHBuildConfig {
+    /// number of bins per axis used for evaluating the SAH
+    int n_bins = 16;
+    /// nodes with more geometries than this are always split
+    int max_leaf_size = 4;
+    /// cost of traversing an interior node, relative to intersection_cost
+    Float traversal_cost = 1.0;
+    /// cost of a single ray-geometry intersection test
+    Float intersection_cost = 1.0;
+    /// SBVH: spatial splits are only tried where the children of the best object split overlap by more than
+    /// this fraction of the root's surface area (`accel_sbvh_alpha`). 0 tries them everywhere, 1 never.
+    Float sbvh_alpha = 1e-5;
+    /// SBVH: memory budget, as the maximum number of primitive references relative to the number of geometries
+    /// (`accel_sbvh_budget`). e.g. 1.5 allows 50% of duplicated references; 1 disables spatial splits.
+    Float sbvh_budget = 2.0;
+    /// traversal: visit the child on the near side of the split plane first (`accel_near_first`).
+    /// Disabling it always visits the left child first, which is only useful for comparison.
+    bool near_first = true;
+    /// traversal: test triangles with the watertight algorithm instead of Möller–Trumbore (`accel_watertight`).
+    /// It needs no epsilon and never lets a ray slip between neighbouring triangles, for a slightly more expensive test.
+    bool watertight = false;
+    /// leaves test this many triangles at once (see TrianglePacket), so the SAH counts the intersection cost of a leaf per packet.
+    /// Set to TRIANGLE_PACKET_WIDTH for mesh-only scenes, where every lane can be filled; 1 counts every geometry.
+    int leaf_packet_width = 1;
+
+    /// SAH cost of intersecting a leaf with n geometries
+    Float leaf_cost(size_t n) const {
+        return intersection_cost * static_cast<Float>((n + leaf_packet_width - 1) / leaf_packet_width);
+    }
+};
+
+/// @brief Read the `accel_*` properties of the scene into a BVHBuildConfig. Missing properties keep their default value.
+BVHBuildConfig parse_bvh_config(const std::unordered_map<std::string, std::string> &props);
+
+/// @brief Node of the pointer-based tree produced by the builders. It's only used during construction;
+/// the tree is flattened into a BVH afterwards.
+class BVHNode {
+public:
+    BVHNode *left, *right;
+    AABB bbox;
+    /// axis along which the geometries were partitioned; left holds the lower side
+    int split_axis = 0;
+    std::vector<Geometry *> geoms{};
+
+    BVHNode() = default;
+    BVHNode(BVHNode *left_, BVHNode *right_, AABB bbox_) : left(left_), right(right_), bbox(bbox_) {}
+};
+
+/// @brief Free a tree produced by a builder
+void delete_bvh_tree(BVHNode *root);
+/// @brief Append the geometries of all the leaves below the node, in depth-first order
+void collect_bvh_geoms(const BVHNode *node, std::vector<Geometry *> &geoms);
+
+/// @brief Bounding box and centroid of a geometry, computed once before the build
+/// so the builder doesn't have to call the virtual get_bbox() at every level.
+struct BVHPrimitive {
+    AABB bbox;
+    Vec3f centroid;
+    Geometry *geom;
+};
+
+/// @brief Build a BVH over the given geometries using the binned surface area heuristic.
+/// Large subtrees are built as parallel tasks, and the top levels also compute their bounds, bins and partitions in parallel.
+/// @param n_threads number of build threads (0 for auto detect)
+/// @return the root node, or nullptr if there are no geometries
+BVHNode *build_bvh_sah(const std::vector<Geometry *> &geoms, const BVHBuildConfig &config, uint32_t n_threads = 0);
+
+/// @brief Build a BVH using spatial splits (SBVH, Stich et al. 2009): besides the binned object splits,
+/// nodes may be split by a plane that clips the geometries crossing it, with a reference in both children.
+/// This reduces the overlap of the children, mostly for long or large geometries. The build is single threaded and
+/// slower than build_bvh_sah(), and the number of references is capped by BVHBuildConfig::sbvh_budget.
+/// @return the root node, or nullptr if there are no geometries. A geometry may appear in more than one leaf.
+BVHNode *build_bvh_sbvh(const std::vector<Geometry *> &geoms, const BVHBuildConfig &config);
+
+/// @brief Build a linear BVH (HLBVH, Pantaleoni & Luebke 2010): the centroids are sorted along a Morton curve with a
+/// parallel radix sort, and the tree follows the bits of the codes. The primitives sharing the 12 highest bits form
+/// treelets that are built in parallel, and the treelets are joined with a binned SAH build.
+/// Much faster to build than build_bvh_sah(), for a somewhat lower tree quality.
+/// @param n_threads number of build threads (0 for auto detect)
+/// @return the root node, or nullptr if there are no geometries
+BVHNode *build_bvh_lbvh(const std::vector<Geometry *> &geoms, const BVHBuildConfig &config, uint32_t n_threads = 0);
+
+/// @brief A node of the flattened BVH, in depth-first order. The left child of an interior node
+/// is the node right after it, and the right child is at `second_child_offset`.
+/// A leaf references `n_primitives` consecutive entries of BVH::primitives starting at `primitives_offset`.
+struct alignas(32) LinearBVHNode {
+    AABB bbox;
+    union {
+        uint32_t primitives_offset;    // leaf
+        uint32_t second_child_offset;  // interior
+    };
+    /// 0 for interior nodes
+    uint16_t n_primitives;
+    /// split axis of an interior node, used to visit the near child first
+    uint8_t axis;
+    uint8_t pad;
+};
+static_assert(sizeof(Float) != 4 || sizeof(LinearBVHNode) == 32, "LinearBVHNode should fit in 32 bytes");
+
+#ifdef BVH_STATS
+/// @brief Counters of the closest-hit traversals (BVH::intersect and WideBVH::intersect), enabled with the BVH_STATS build option.
+/// Every ray adds its totals once, so the overhead is a few atomic additions per ray.
+struct BVHTraversalStats {
+    std::atomic<uint64_t> rays{0};
+    std::atomic<uint64_t> nodes_visited{0};
+    std::atomic<uint64_t> primitive_tests{0};
+
+    void add_ray(uint64_t n_nodes, uint64_t n_tests) {
+        rays.fetch_add(1, std::memory_order_relaxed);
+        nodes_visited.fetch_add(n_nodes, std::memory_order_relaxed);
+        primitive_tests.fetch_add(n_tests, std::memory_order_relaxed);
+    }
+    std::string to_string() const;
+};
+extern BVHTraversalStats bvh_traversal_stats;
+#endif
+
+/// @brief Closest-hit test of the leaf primitives [begin, end) of an accelerator. ray.tmax shrinks to every closer hit.
+/// Triangles are tested a packet at a time, with the watertight test if wr is given (the packets must have been built for it;
+/// compact leaves gather them for it), quads as their two halves in the same packet, spheres and disks with their records, and other
+/// geometries with Geometry::intersect().
+/// Only the hit is recorded in isc (distance, geometry and barycentrics); the shading data is left to Scene::compute_surface_interaction().
+/// @return whether anything was hit
+inline bool intersect_leaf(const std::vector<Geometry *> &primitives, const LeafPrimitives &leaf, uint32_t begin, uint32_t end,
+                           Ray &ray, const WatertightRay *wr, Intersection &isc) {
+    bool is_hit = false;
+    for (uint32_t base = begin - begin % TRIANGLE_PACKET_WIDTH; base < end; base += TRIANGLE_PACKET_WIDTH) {
+        const uint32_t lanes = packet_lanes(base, begin, end);
+        TrianglePacket gathered;
+        const TrianglePacket &packet = leaf_packet(leaf, base / TRIANGLE_PACKET_WIDTH, lanes, wr != nullptr, gathered);
+        if (lanes & packet.triangle_mask) {
+            PacketHits hits;
+            uint32_t hit_lanes = wr != nullptr ? intersect_triangle_packet_watertight(packet, lanes & packet.triangle_mask, ray, *wr, hits)
+                                               : intersect_triangle_packet(packet, lanes & packet.triangle_mask, ray, hits);
+            for (; hit_lanes != 0; hit_lanes &= hit_lanes - 1) {
+                int lane = std::countr_zero(hit_lanes);
+                if (hits.t[lane] < ray.tmax) {
+                    ray.tmax = hits.t[lane];
+                    set_triangle_hit(primitives[base + lane], hits.t[lane], Vec2f{hits.b1[lane], hits.b2[lane]}, isc);
+                    is_hit = true;
+                }
+            }
+        }
+        if (lanes & packet.quad_mask) {
+            QuadPacket gathered_quads;
+            const QuadPacket &quads = leaf_quad_packet(leaf, base / TRIANGLE_PACKET_WIDTH, lanes, wr != nullptr, gathered_quads);
+            PacketHits hits;
+            for (uint32_t hit_lanes = intersect_quad_halves_packet(packet, quads, lanes & packet.quad_mask, ray, wr, hits); hit_lanes != 0;
+                 hit_lanes &= hit_lanes - 1) {
+                int lane = std::countr_zero(hit_lanes);
+                if (hits.t[lane] < ray.tmax) {
+                    ray.tmax = hits.t[lane];
+                    set_quad_hit(primitives[base + lane], hits.t[lane], Vec2f{hits.b1[lane], hits.b2[lane]}, true, isc);
+                    is_hit = true;
+                }
+            }
+        }
+        for (uint32_t others = lanes & ~packet.triangle_mask; others != 0; others &= others - 1) {
+            const int lane = std::countr_zero(others);
+            const uint32_t ref = base + lane;
+            Float t;
+            if (packet.sphere_mask & (1u << lane)) {
+                if (!intersect_sphere(leaf.spheres[leaf.record_index[ref]], ray, t) || t >= ray.tmax)
+                    continue;
+                ray.tmax = t;
+                set_primitive_hit(primitives[ref], t, isc);
+                is_hit = true;
+            } else if (packet.disk_mask & (1u << lane)) {
+                if (!intersect_disk(leaf.disks[leaf.record_index[ref]], ray, t) || t >= ray.tmax)
+                    continue;
+                ray.tmax = t;
+                set_primitive_hit(primitives[ref], t, isc);
+                is_hit = true;
+            } else {
+                Intersection isc_tmp{};
+                if (!primitives[ref]->intersect(ray, isc_tmp))
+                    continue;
+                if (isc_tmp.distance >= ray.tmin && isc_tmp.distance < ray.tmax) {
+                    ray.tmax = isc_tmp.distance;
+                    isc = isc_tmp;
+                    is_hit = true;
+                }
+            }
+        }
+    }
+    return is_hit;
+}
+
+/// @brief intersect_leaf() for the rays `lanes` of a packet, one at a time. The tmax of each ray in the packet shrinks to its closest hit,
+/// which is recorded in iscs[lane]
+/// @return the rays that hit something in the leaf
+inline uint32_t intersect_leaf_packet(const std::vector<Geometry *> &primitives, const LeafPrimitives &leaf, uint32_t begin, uint32_t end,
+                                      const Ray *rays, RayPacket &packet, uint32_t lanes, bool watertight, Intersection *iscs) {
+    uint32_t hit_lanes = 0;
+    for (; lanes != 0; lanes &= lanes - 1) {
+        const int lane = std::countr_zero(lanes);
+        Ray r{rays[lane].o, rays[lane].d, packet.tmin[lane], packet.tmax[lane]};
+        const WatertightRay wr{r};
+        if (intersect_leaf(primitives, leaf, begin, end, r, watertight ? &wr : nullptr, iscs[lane])) {
+            packet.tmax[lane] = r.tmax;
+            hit_lanes |= 1u << lane;
+        }
+    }
+    if (hit_lanes != 0)
+        packet.update_tmax_hi();
+    return hit_lanes;
+}
+
+/// @brief Any-hit test of the leaf primitives [begin, end) of an accelerator. See intersect_leaf() for wr
+inline bool occluded_leaf(const std::vector<Geometry *> &primitives, const LeafPrimitives &leaf, uint32_t begin, uint32_t end,
+                          const Ray &ray, const WatertightRay *wr) {
+    for (uint32_t base = begin - begin % TRIANGLE_PACKET_WIDTH; base < end; base += TRIANGLE_PACKET_WIDTH) {
+        const uint32_t lanes = packet_lanes(base, begin, end);
+        TrianglePacket gathered;
+        const TrianglePacket &packet = leaf_packet(leaf, base / TRIANGLE_PACKET_WIDTH, lanes, wr != nullptr, gathered);
+        PacketHits hits;
+        const uint32_t triangle_lanes = lanes & packet.triangle_mask;
+        if (triangle_lanes != 0 && (wr != nullptr ? intersect_triangle_packet_watertight(packet, triangle_lanes, ray, *wr, hits)
+                                                  : intersect_triangle_packet(packet, triangle_lanes, ray, hits)))
+            return true;
+        if (lanes & packet.quad_mask) {
+            QuadPacket gathered_quads;
+            const QuadPacket &quads = leaf_quad_packet(leaf, base / TRIANGLE_PACKET_WIDTH, lanes, wr != nullptr, gathered_quads);
+            if (intersect_quad_halves_packet(packet, quads, lanes & packet.quad_mask, ray, wr, hits))
+                return true;
+        }
+        for (uint32_t others = lanes & ~packet.triangle_mask; others != 0; others &= others - 1) {
+            const int lane = std::countr_zero(others);
+            const uint32_t ref = base + lane;
+            Float t;
+            if (packet.sphere_mask & (1u << lane)) {
+                if (intersect_sphere(leaf.spheres[leaf.record_index[ref]], ray, t))
+                    return true;
+            } else if (packet.disk_mask & (1u << lane)) {
+                if (intersect_disk(leaf.disks[leaf.record_index[ref]], ray, t))
+                    return true;
+            } else if (primitives[ref]->occluded(ray)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/// @brief Flattened BVH with an iterative traversal
+class BVH {
+public:
+    /// deeper subtrees are collapsed into leaves while flattening, which bounds the traversal stack
+    static constexpr int MAX_DEPTH = 64;
+
+    std::vector<LinearBVHNode> nodes{};
+    /// the geometries referenced by the leaves, reordered so that each leaf's geometries are contiguous
+    std::vector<Geometry *> primitives{};
+    /// intersection data of the primitives, TRIANGLE_PACKET_WIDTH references per packet. Leaves test triangles, spheres and disks
+    /// with these and only call into the other geometries. Leaves are padded so they straddle as few packets as possible (see pad_for_leaf())
+    LeafPrimitives leaf_primitives{};
+    /// see BVHBuildConfig::near_first
+    bool near_first = true;
+    /// see BVHBuildConfig::watertight. Change it with set_watertight(), which rebuilds the packets
+    bool watertight = false;
+
+    BVH() = default;
+    /// @brief Flatten the tree produced by a builder. The tree is deleted afterwards.
+    explicit BVH(BVHNode *root);
+
+    /// @brief Closest-hit query. Only the hit is recorded in isc; see Geometry::compute_surface_interaction()
+    bool intersect(const Ray &ray, Intersection &isc) const;
+    /// @brief Closest-hit query of n (1 to RAY_PACKET_SIZE) coherent rays, traversed together (see RayPacket).
+    /// The hit of rays[i] is recorded in iscs[i] like with intersect()
+    /// @return bit i is set if rays[i] hits something
+    uint32_t intersect_packet(const Ray *rays, int n, Intersection *iscs) const;
+    /// @brief Whether anything is hit within [ray.tmin, ray.tmax]. Stops at the first hit.
+    bool occluded(const Ray &ray) const;
+    /// @brief Select the watertight triangle test or the Möller–Trumbore one
+    void set_watertight(bool watertight);
+    /// @brief Switch to compact leaves, which gather the triangles from the vertex buffers of their meshes instead of keeping a copy
+    /// of their vertices (see LeafPrimitives::compact). The nodes are kept in full precision; see WideBVH::compress()
+    void compress();
+    /// @brief Expected cost of tracing a ray through the tree, according to the SAH.
+    /// Lower is better; only comparable between trees built over the same scene.
+    Float sah_cost(const BVHBuildConfig &config) const;
+    /// memory used by the nodes, the primitive references and their packets, in bytes
+    size_t memory_footprint() const;
+};
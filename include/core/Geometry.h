@@ -17,21 +17,22 @@
 
 class Shape;
 class Geometry;
-
-bool load_mesh_from_file(const std::string &file_path, const Shape *parent_shape, std::vector<Geometry *> &output_mesh, std::vector<Vec3f *> &vertices, std::vector<Vec3f *> &normals, std::vector<Vec2f *> &texcoords, const std::unordered_map<std::string, std::string> &properties);
-
+class ShapeGroup;
+struct TriangleRecord;
+struct SphereRecord;
+struct DiskRecord;
+class TriangleMesh;
 
 /// @brief A ray in 3D space, defined by an origin and a direction
 /// d must be normalized. tmin and tmax define the valid interval along the ray.
-/// shadow_ray indicates whether this ray is a shadow ray (for optimization purposes)
+/// Shadow rays are traced with Scene::occluded() instead of Scene::ray_intersect().
 struct Ray {
     Vec3f o;
     Vec3f d;
     Float tmin, tmax;
-    bool shadow_ray;
 
-    Ray(const Vec3f &o, const Vec3f &d, Float tmin, Float tmax, bool shadow_ray = false)
-        : o(o), d(d), tmin(tmin), tmax(tmax), shadow_ray(shadow_ray) {}
+    Ray(const Vec3f &o, const Vec3f &d, Float tmin, Float tmax)
+        : o(o), d(d), tmin(tmin), tmax(tmax) {}
 
     /// return the position of the point with distance t along the ray
     Vec3f operator()(Float t) const { return o + t * d; }
@@ -53,26 +54,57 @@ struct AABB {
                           std::max(max_corner.y, other.max_corner.y),
                           std::max(max_corner.z, other.max_corner.z)}};
     }
+
+    /// the overlapping part of the two boxes. is_empty() if they don't overlap
+    AABB intersection(const AABB &other) const {
+        return AABB{Vec3f{std::max(min_corner.x, other.min_corner.x),
+                          std::max(min_corner.y, other.min_corner.y),
+                          std::max(min_corner.z, other.min_corner.z)},
+                    Vec3f{std::min(max_corner.x, other.max_corner.x),
+                          std::min(max_corner.y, other.max_corner.y),
+                          std::min(max_corner.z, other.max_corner.z)}};
+    }
+
+    /// an inverted box, which is the identity element of the union operator
+    static AABB empty() {
+        return AABB{Vec3f{INFINITY}, Vec3f{-INFINITY}};
+    }
+
+    bool is_empty() const {
+        return min_corner.x > max_corner.x || min_corner.y > max_corner.y || min_corner.z > max_corner.z;
+    }
+
+    Vec3f centroid() const { return (min_corner + max_corner) * Float(0.5); }
+
+    Float surface_area() const {
+        Vec3f d = max_corner - min_corner;
+        if (d.x < 0.0 || d.y < 0.0 || d.z < 0.0)
+            return 0.0;
+        return 2.0 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
 };
 
+/// @brief A ray hit. The traversal only records distance, shape, geom, bary and instance; the rest is the shading data,
+/// filled by Scene::compute_surface_interaction() for the closest hit (Scene::ray_intersect() does it).
 struct Intersection {
     Float distance;
+    /// barycentric coordinates of the second and third vertices, for triangle hits. Quad hits store their half too (see set_quad_hit())
+    Vec2f bary;
     Vec3f position, normal;
+    /// uv coordinates of the hit point
+    Vec2f uv;
     /// Normalized direction, from the hit position to the ray origin
     Vec3f dirn;
     const Shape *shape = nullptr;
     const Geometry *geom;
+    /// the instance through which geom was hit, if any. geom then lives in instance space, while position, normal, etc. are in world space
+    const Geometry *instance = nullptr;
 };
 
-// Context for creating a geometry from a mesh file
+// Context for creating a geometry, besides its properties
 struct GeometryCreationContext {
-    std::array<const Vec3f *, 3> vp = {nullptr, nullptr, nullptr};
-    std::array<const Vec3f *, 3> vn = {nullptr, nullptr, nullptr};
-    std::array<const Vec2f *, 3> vt = {nullptr, nullptr, nullptr};
-
-    GeometryCreationContext() = default;
-    GeometryCreationContext(const Vec3f *v0, const Vec3f *v1, const Vec3f *v2, const Vec3f *n0 = nullptr, const Vec3f *n1 = nullptr, const Vec3f *n2 = nullptr, const Vec2f *t0 = nullptr, const Vec2f *t1 = nullptr, const Vec2f *t2 = nullptr)
-        : vp{v0, v1, v2}, vn{n0, n1, n2}, vt{t0, t1, t2} {}
+    /// the referenced shape group, for creating an instance
+    const ShapeGroup *shape_group = nullptr;
 };
 
 class Geometry {
@@ -80,7 +112,46 @@ public:
     const Shape *parent_shape;
 
     virtual AABB get_bbox() const = 0;
+    /// @brief Bounding box of the part of the geometry inside `clip`. Used by the spatial splits of the SBVH builder.
+    /// The default is conservative; geometries that can clip themselves exactly should override it.
+    virtual AABB get_clipped_bbox(const AABB &clip) const {
+        return get_bbox().intersection(clip);
+    }
+    /// @brief Closest-hit test. Only records distance, shape, geom and, for triangles, bary in isc.
     virtual bool intersect(const Ray &ray, Intersection &isc) const = 0;
+    /// @brief Fill position, normal and uv of a hit recorded by intersect() with the same ray
+    virtual void compute_surface_interaction(const Ray &ray, Intersection &isc) const = 0;
+    /// @brief Any-hit test: whether the ray hits the geometry within [ray.tmin, ray.tmax].
+    /// No intersection record is filled, so implementations can skip the shading computations.
+    virtual bool occluded(const Ray &ray) const {
+        Intersection isc{};
+        return intersect(ray, isc);
+    }
+    /// @brief Precomputed intersection data, used by the accelerators' leaf tests instead of intersect().
+    /// @return false if the geometry isn't a triangle
+    virtual bool get_triangle_record(TriangleRecord &record) const {
+        return false;
+    }
+    /// @brief World-space intersection data of a sphere, tested by the accelerators' leaves instead of intersect().
+    /// @return false if the geometry isn't a sphere, or its transform isn't a similarity
+    virtual bool get_sphere_record(SphereRecord &record) const {
+        return false;
+    }
+    /// @brief World-space intersection data of a disk, like get_sphere_record()
+    virtual bool get_disk_record(DiskRecord &record) const {
+        return false;
+    }
+    /// @brief The mesh and the index of a triangle, for the compact leaves that gather its vertices from the mesh (see LeafPrimitives)
+    /// @return false if the geometry isn't a triangle of a mesh
+    virtual bool get_mesh_triangle(const TriangleMesh *&mesh, uint32_t &index) const {
+        return false;
+    }
+    /// @brief The mesh and the first triangle of a quad (see TriangleMesh::quads), which the accelerators' leaves test in their packets
+    /// like triangles, with the fourth vertex alongside
+    /// @return false if the geometry isn't a quad of a mesh
+    virtual bool get_mesh_quad(const TriangleMesh *&mesh, uint32_t &first_triangle) const {
+        return false;
+    }
     virtual Vec3f get_normal(const Vec3f &position) const = 0;
     virtual Float area() const = 0;
     /// @brief Samples a point on the surface of the geometry.
@@ -95,21 +166,18 @@ public:
 
 enum class AccelerationType {
     NONE,
+    /// BVH split at the spatial midpoint of the longest axis
     BVH,
-};
-
-class BVHNode {
-public:
-    BVHNode *left, *right;
-    AABB bbox;
-    std::vector<Geometry *> geoms{};
-
-    BVHNode() = default;
-    BVHNode(BVHNode *left_, BVHNode *right_, AABB bbox_) : left(left_), right(right_), bbox(bbox_) {}
-
-    bool intersect(const Ray &ray, Intersection &isc);
-    
-    bool intersect_optimized(Ray &ray, Intersection &isc);
+    /// BVH built with the binned surface area heuristic
+    BVH_SAH,
+    /// SAH BVH with spatial splits (reference duplication)
+    SBVH,
+    /// linear BVH over sorted Morton codes, with a SAH build of the top levels
+    LBVH,
+    /// SAH BVH collapsed to 4 children per node, traversed with SSE
+    BVH4,
+    /// SAH BVH collapsed to 8 children per node, traversed with AVX (or two SSE halves)
+    BVH8,
 };
 
 // offset the position of a ray a little bit toward the normal, for avoiding self-intersections while ray tracing.
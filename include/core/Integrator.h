@@ -16,6 +16,13 @@ public:
     virtual void render(const Scene *scene, Sensor *sensor, uint32_t n_threads, bool show_progress) override;
     /// @brief Sample the Radiance along the given ray
     virtual Vec3f sample_radiance(const Scene *scene, Sampler *sampler, const Ray &ray, int row, int col) const = 0;
+    /// @brief Whether render() traces the camera rays of neighbouring pixels together (see Scene::ray_intersect_packet()) and shades
+    /// their hits with sample_radiance_primary(). For integrators that start by finding the closest hit of the camera ray
+    virtual bool trace_primary_packets() const { return false; }
+    /// @brief sample_radiance() for a camera ray whose closest hit was already found. isc is only valid if is_hit
+    virtual Vec3f sample_radiance_primary(const Scene *scene, Sampler *sampler, const Ray &ray, bool is_hit, const Intersection &isc, int row, int col) const {
+        return sample_radiance(scene, sampler, ray, row, col);
+    }
 
     /// @brief finds the MIS weight for the NEE
     virtual Float get_mis_weight_nee(const Intersection &isc, const EmitterSample &emitter_sample, uint32_t n_bsdf_samples) const;
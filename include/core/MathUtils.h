@@ -1,5 +1,8 @@
 #pragma once
 
+#include <bit>
+#include <cstdint>
+#include <limits>
 #include <sstream>
 
 #include <glm/gtc/matrix_transform.hpp>
@@ -18,6 +21,13 @@ inline const Float PiOver2 = 1.57079632679489661923;
 inline const Float PiOver4 = 0.78539816339744830961;
 inline const Float Sqrt2 = 1.41421356237309504880;
 
+/// @brief Bound on the relative rounding error of n floating point operations, (1 + eps)^n - 1 <= gamma(n) (pbrt's gamma)
+template <class T = Float>
+constexpr T rounding_gamma(int n) {
+    constexpr T machine_epsilon = std::numeric_limits<T>::epsilon() * T(0.5);
+    return (n * machine_epsilon) / (1 - n * machine_epsilon);
+}
+
 using Vec2f = glm::vec<2, Float>;
 using Vec3f = glm::vec<3, Float>;
 using Vec4f = glm::vec<4, Float>;
@@ -114,6 +124,42 @@ Float lerp(Float t, Float a, Float b);
 
 // angle is in degrees
 Mat4f get_rotation_matrix(const Vec3f &axis, Float angle);
+/// @brief Whether the affine transform is a similarity: a rotation or reflection, a uniform scale and a translation, without
+/// shear or projection. Its scale factor is returned in `scale`. The test is relative, so it tolerates the rounding of parsed matrices
+bool is_similarity(const Mat4f &transform, Float &scale);
+
+/// @brief Octahedral encoding of a unit vector in 32 bits, 16 per coordinate (Cigolle et al. 2014). Of the roundings of the
+/// projected point to the grid, the one that decodes closest to v is kept, so the angular error stays below about 0.005 degrees.
+/// The zero vector is encoded as +z
+uint32_t encode_octahedral(const Vec3f &v);
+/// @brief The unit vector of an encode_octahedral() value
+inline Vec3f decode_octahedral(uint32_t packed) {
+    const Float x = Float(packed & 0xFFFF) * Float(2.0 / 65535.0) - 1;
+    const Float y = Float(packed >> 16) * Float(2.0 / 65535.0) - 1;
+    Vec3f v{x, y, 1 - std::abs(x) - std::abs(y)};
+    // the lower hemisphere is folded over the diagonals of the square
+    if (v.z < 0.0) {
+        v.x = (1 - std::abs(y)) * (x >= 0.0 ? 1 : -1);
+        v.y = (1 - std::abs(x)) * (y >= 0.0 ? 1 : -1);
+    }
+    return glm::normalize(v);
+}
+
+/// @brief IEEE half precision value of f, rounded to nearest even. Values beyond the half range become infinite
+uint16_t float_to_half(float f);
+inline float half_to_float(uint16_t h) {
+    const uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    const uint32_t exponent = (h >> 10) & 0x1F;
+    const uint32_t mantissa = h & 0x3FF;
+    if (exponent == 0x1F)
+        return std::bit_cast<float>(sign | 0x7F800000 | (mantissa << 13));
+    if (exponent == 0) {
+        // subnormal, in units of 2^-24
+        const float value = static_cast<float>(mantissa) * 0x1p-24f;
+        return sign != 0 ? -value : value;
+    }
+    return std::bit_cast<float>(sign | ((exponent + 112) << 23) | (mantissa << 13));
+}
 
 inline Float cos_theta(const Vec3f &w) {
     return w.z;
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string>
+
+#include "core/TriangleMesh.h"
+
+class TaskPool;
+
+/// @brief Read an OBJ file into a mesh, in object space.
+/// The file is memory-mapped and split into line-aligned chunks, one per thread of the pool, which are parsed concurrently into
+/// per-chunk buffers; the buffers are then concatenated and the face indices of every chunk resolved against the global vertex counts.
+/// All the objects and groups of the file end up in the one mesh, and faces with more than three vertices are triangulated as fans,
+/// whose triangles are paired into quads (see TriangleMesh::quads).
+/// The mesh gets normals only if every face corner has one, and texture coordinates if any corner has one ((0, 0) for the others).
+/// Every distinct (position, texcoord, normal) combination of the corners becomes a vertex; when every corner uses the same index for
+/// the three, the OBJ vertices are taken as they are, without the (serial) deduplication.
+/// Throws std::runtime_error on malformed lines and out-of-range indices.
+TriangleMesh *read_obj(const std::string &filepath, TaskPool &pool);
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cmath>
+#include <utility>
+
+#include "core/Geometry.h"
+
+/// @brief Intersection data of a sphere in world space, for spheres whose transform is a similarity.
+/// The accelerators keep one per sphere reference (see LeafPrimitives), so a leaf tests it with intersect_sphere() instead of
+/// calling into the geometry.
+struct SphereRecord {
+    Vec3f center;
+    Float radius;
+};
+
+/// @brief Intersection data of a disk in world space, for disks whose transform is a similarity (see SphereRecord)
+struct DiskRecord {
+    Vec3f center;
+    Float radius;
+    Vec3f normal;
+};
+
+/// @brief Distances along the ray to the two points where its line crosses the sphere, t0 <= t1. false if it misses.
+/// The discriminant is taken from the distance between the center and the closest point of the line, which keeps its precision
+/// for small spheres far from the ray origin, and the near root is derived from the far one to avoid cancellation.
+inline bool intersect_sphere(const SphereRecord &sphere, const Ray &ray, Float &t0, Float &t1) {
+    Vec3f f = ray.o - sphere.center;
+    Float b = -glm::dot(f, ray.d);
+    Vec3f l = f + b * ray.d;
+    Float discriminant = Sqr(sphere.radius) - glm::dot(l, l);
+    if (discriminant <= 0.0)
+        return false;
+    Float q = b + std::copysign(std::sqrt(discriminant), b);
+    t0 = (glm::dot(f, f) - Sqr(sphere.radius)) / q;
+    t1 = q;
+    if (t0 > t1)
+        std::swap(t0, t1);
+    return true;
+}
+
+/// @brief The nearest hit of the sphere within [ray.tmin, ray.tmax], in t
+inline bool intersect_sphere(const SphereRecord &sphere, const Ray &ray, Float &t) {
+    Float t0, t1;
+    if (!intersect_sphere(sphere, ray, t0, t1))
+        return false;
+    if (t0 >= ray.tmin && t0 <= ray.tmax)
+        t = t0;
+    else if (t1 >= ray.tmin && t1 <= ray.tmax)
+        t = t1;
+    else
+        return false;
+    return true;
+}
+
+/// @brief Hit of the disk within [ray.tmin, ray.tmax], in t. Rays nearly parallel to its plane miss it
+inline bool intersect_disk(const DiskRecord &disk, const Ray &ray, Float &t) {
+    Float cos_theta = glm::dot(disk.normal, ray.d);
+    if (std::abs(cos_theta) < Epsilon)
+        return false;
+    Vec3f o_minus_c = ray.o - disk.center;
+    t = -glm::dot(o_minus_c, disk.normal) / cos_theta;
+    if (t <= 0.0 || t < ray.tmin || t > ray.tmax)
+        return false;
+    Vec3f offset = o_minus_c + t * ray.d;
+    return glm::dot(offset, offset) <= Sqr(disk.radius);
+}
+
+/// @brief Record a hit at distance t of a geometry tested with its record.
+/// The shading data is filled later by Scene::compute_surface_interaction(), once the closest hit is known.
+inline void set_primitive_hit(const Geometry *geom, Float t, Intersection &isc) {
+    isc.distance = t;
+    isc.shape = geom->parent_shape;
+    isc.geom = geom;
+    isc.instance = nullptr;
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+
+#include "core/Geometry.h"
+#include "core/TrianglePacket.h"
+
+/// Number of rays traced together by the packet traversals (see Scene::ray_intersect_packet())
+constexpr int RAY_PACKET_SIZE = 8;
+
+/// the exit distances of the slab tests are enlarged by their rounding error, so the boxes are conservative (see BVH.cpp)
+constexpr Float PACKET_EXIT_SCALE = 1 + 2 * rounding_gamma(3);
+
+/// @brief Up to RAY_PACKET_SIZE rays in SoA layout, in the form used by the slab tests of the packet traversals.
+/// Meant for coherent rays, like the camera rays of neighbouring pixels: the traversal visits a node once for all the rays that
+/// hit it, rejects it for the whole packet with the interval test of packet_misses_box() where it can, and tests it against
+/// the remaining rays at once with intersect_box_packet(). Lanes past the last ray repeat it and are never active.
+struct alignas(32) RayPacket {
+    Float org[3][RAY_PACKET_SIZE];
+    /// 1/d, kept finite like in the slab test of WideBVH: inf * 0 would produce a NaN when the origin lies on a slab plane
+    Float inv_d[3][RAY_PACKET_SIZE];
+    Float tmin[RAY_PACKET_SIZE];
+    /// shrinks to the closest hit of each ray
+    Float tmax[RAY_PACKET_SIZE];
+    /// bit i is set for the rays of the packet
+    uint32_t valid;
+    /// whether the directions of all the rays have the same sign on every axis, which the interval test needs
+    bool same_signs;
+    /// bounds of the origins, of 1/d and of [tmin, tmax] over the rays, for the interval test
+    Float org_lo[3], org_hi[3];
+    Float inv_d_lo[3], inv_d_hi[3];
+    Float tmin_lo, tmax_hi;
+
+    /// the first n (1 to RAY_PACKET_SIZE) rays
+    RayPacket(const Ray *rays, int n) : valid((1u << n) - 1) {
+        for (int lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+            const Ray &ray = rays[std::min(lane, n - 1)];
+            for (int axis = 0; axis < 3; axis++) {
+                org[axis][lane] = ray.o[axis];
+                Float d = ray.d[axis];
+                if (std::abs(d) < Float(1e-20))
+                    d = std::copysign(Float(1e-20), d);
+                inv_d[axis][lane] = Float(1.0) / d;
+            }
+            tmin[lane] = ray.tmin;
+            tmax[lane] = ray.tmax;
+        }
+        same_signs = true;
+        tmin_lo = tmin[0];
+        for (int axis = 0; axis < 3; axis++) {
+            org_lo[axis] = org_hi[axis] = org[axis][0];
+            inv_d_lo[axis] = inv_d_hi[axis] = inv_d[axis][0];
+            for (int lane = 1; lane < n; lane++) {
+                org_lo[axis] = std::min(org_lo[axis], org[axis][lane]);
+                org_hi[axis] = std::max(org_hi[axis], org[axis][lane]);
+                inv_d_lo[axis] = std::min(inv_d_lo[axis], inv_d[axis][lane]);
+                inv_d_hi[axis] = std::max(inv_d_hi[axis], inv_d[axis][lane]);
+            }
+            if ((inv_d_lo[axis] < 0.0) != (inv_d_hi[axis] < 0.0))
+                same_signs = false;
+        }
+        for (int lane = 1; lane < n; lane++)
+            tmin_lo = std::min(tmin_lo, tmin[lane]);
+        update_tmax_hi();
+    }
+
+    /// recompute tmax_hi after the tmax of some rays shrank
+    void update_tmax_hi() {
+        tmax_hi = tmax[0];
+        for (int lane = 1; lane < RAY_PACKET_SIZE; lane++)
+            if (valid & (1u << lane))
+                tmax_hi = std::max(tmax_hi, tmax[lane]);
+    }
+
+    /// whether the direction of the ray in the given lane is negative along the axis
+    bool dir_is_neg(int lane, int axis) const {
+        return inv_d[axis][lane] < 0.0;
+    }
+};
+
+/// @brief Interval test of a box against the whole packet (Boulos et al. 2007): true if every ray misses it, false if some may hit it.
+/// The entry and exit distances of all the rays on each axis are bounded with interval arithmetic over their origins and 1/d,
+/// so a single scalar slab test rejects the box for all of them. Rounding is monotonic, so the bounds also hold for the distances
+/// computed by intersect_box_packet(), and the test never rejects a box that one of the rays hits.
+/// Packets whose directions differ in sign on some axis enter the box through different planes, and are never rejected.
+inline bool packet_misses_box(const RayPacket &packet, const Vec3f &min_corner, const Vec3f &max_corner) {
+    if (!packet.same_signs)
+        return false;
+    Float t_near = packet.tmin_lo;
+    Float t_far = packet.tmax_hi;
+    for (int axis = 0; axis < 3; axis++) {
+        const Float lo = packet.inv_d_lo[axis], hi = packet.inv_d_hi[axis];
+        if (hi >= 0.0) {
+            // every ray enters through the min plane and exits through the max plane
+            const Float enter = min_corner[axis] - packet.org_hi[axis];
+            const Float exit = max_corner[axis] - packet.org_lo[axis];
+            t_near = std::max(t_near, enter >= 0.0 ? enter * lo : enter * hi);
+            t_far = std::min(t_far, exit >= 0.0 ? exit * hi : exit * lo);
+        } else {
+            const Float enter = max_corner[axis] - packet.org_lo[axis];
+            const Float exit = min_corner[axis] - packet.org_hi[axis];
+            t_near = std::max(t_near, enter >= 0.0 ? enter * lo : enter * hi);
+            t_far = std::min(t_far, exit >= 0.0 ? exit * hi : exit * lo);
+        }
+    }
+    return t_near > t_far * PACKET_EXIT_SCALE;
+}
+
+/// @brief Slab test of a box against the rays `lanes` of the packet, each within its [tmin, tmax], several rays at a time with SSE/AVX.
+/// Conservative like the single-ray tests of the accelerators.
+/// @param t_near receives the entry distance of each ray, 32-byte aligned
+/// @return the rays of `lanes` that hit the box
+inline uint32_t intersect_box_packet(const RayPacket &packet, const Vec3f &min_corner, const Vec3f &max_corner, uint32_t lanes, Float *t_near) {
+#if defined(TRIANGLE_PACKET_SIMD)
+    using namespace packet_simd;
+    uint32_t mask = 0;
+    for (int g = 0; g < RAY_PACKET_SIZE; g += TRIANGLE_PACKET_WIDTH) {
+        vfloat tn = load(packet.tmin + g);
+        vfloat tf = load(packet.tmax + g);
+        for (int axis = 0; axis < 3; axis++) {
+            const vfloat o = load(packet.org[axis] + g);
+            const vfloat inv_d = load(packet.inv_d[axis] + g);
+            const vfloat t0 = mul(sub(set1(min_corner[axis]), o), inv_d);
+            const vfloat t1 = mul(sub(set1(max_corner[axis]), o), inv_d);
+            tn = maximum(tn, minimum(t0, t1));
+            tf = minimum(tf, maximum(t0, t1));
+        }
+        store(t_near + g, tn);
+        mask |= movemask(le(tn, mul(tf, set1(PACKET_EXIT_SCALE)))) << g;
+    }
+    return mask & lanes;
+#else
+    uint32_t mask = 0;
+    for (uint32_t remaining = lanes; remaining != 0; remaining &= remaining - 1) {
+        const int i = std::countr_zero(remaining);
+        Float tn = packet.tmin[i], tf = packet.tmax[i];
+        for (int axis = 0; axis < 3; axis++) {
+            const Float t0 = (min_corner[axis] - packet.org[axis][i]) * packet.inv_d[axis][i];
+            const Float t1 = (max_corner[axis] - packet.org[axis][i]) * packet.inv_d[axis][i];
+            tn = std::max(tn, std::min(t0, t1));
+            tf = std::min(tf, std::max(t0, t1));
+        }
+        t_near[i] = tn;
+        if (tn <= tf * PACKET_EXIT_SCALE)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
@@ -5,6 +5,8 @@
 #include <vector>
 #include <filesystem>
 
+#include "core/BVH.h"
+#include "core/WideBVH.h"
 #include "core/Emitter.h"
 #include "core/Sensor.h"
 #include "core/Shape.h"
@@ -12,26 +14,67 @@
 
 extern std::filesystem::path scene_file_path;
 
+class TaskPool;
+
 class Scene {
 private:
     std::vector<Shape*> shapes{};
-    BVHNode *bvh_root = nullptr;
+    /// shapes that are only referenced by instances. Their geometries are not in shapes
+    std::vector<ShapeGroup*> shape_groups{};
+    BVH *bvh = nullptr;
+    WideBVH<4> *bvh4 = nullptr;
+    WideBVH<8> *bvh8 = nullptr;
     std::vector<Emitter*> emitters{};
 
     std::vector<Geometry*> get_all_geoms() const;
     bool ray_intersect_bruteforce(const Ray &ray, Intersection &isc) const;
     bool ray_intersect_bvh(const Ray &ray, Intersection &isc) const;
+    bool occluded_bruteforce(const Ray &ray) const;
+    /// SAH cost of the acceleration structure, 0 if there's none
+    Float accel_sah_cost() const;
+    /// @brief Stress test of the triangle tests: shoot rays through random points of the edges shared by two triangles of a mesh,
+    /// and report how many miss both triangles or hit both, for each test, and how many miss the scene.
+    void report_edge_hits() const;
+    /// @brief Compress the meshes and the acceleration structures, see compress_geometry. Reports the memory saved and the largest errors
+    void compress(TaskPool &pool);
 
 public:
-    AccelerationType accel_type = AccelerationType::BVH;
+    AccelerationType accel_type = AccelerationType::BVH_SAH;
+    BVHBuildConfig bvh_config{};
+    /// number of threads used for loading the meshes and building the acceleration structure (0 for auto detect)
+    uint32_t n_build_threads = 0;
+    /// path of the cache file for the meshes and the acceleration structure (see SceneCache). Empty to disable caching
+    std::filesystem::path cache_path{};
+    /// ignore an existing cache file and overwrite it
+    bool rebuild_cache = false;
+    /// before building the acceleration structure, build it with each builder and report their build time and SAH cost
+    bool compare_builders = false;
+    /// after loading, run the edge stress test of report_edge_hits()
+    bool test_edges = false;
+    /// keep the geometry compressed, for scenes that don't fit in memory otherwise (the `compress_geometry` property of the scene):
+    /// octahedral normals and half precision texture coordinates (see TriangleMesh::compress()), leaves that share the vertices
+    /// of the meshes, and 16-bit child bounds in the nodes of bvh4/bvh8 (see WideBVH::compress()). The scene cache keeps the exact data
+    bool compress_geometry = false;
     Sensor *sensor = nullptr;
     Emitter *env_map = nullptr;
 
     void load_scene(const SceneDesc &scene_desc);
-    std::string get_bvh_str(BVHNode *node = nullptr, int idt = 0) const;
-    /// Get statistics about the BVH. Number of nodes, leaf nodes, max depth, average number of geometries per leaf, max number of geometries in a leaf.
+    std::string get_bvh_str(uint32_t node_idx = 0, int idt = 0) const;
+    /// Get statistics about the BVH. Number of nodes, leaf nodes, max depth, average number of geometries per leaf, max number of geometries in a leaf, SAH cost, memory footprint.
+    /// For the wide BVHs only the node counts, SAH cost and memory footprint are reported.
     std::string get_bvh_statistics() const;
+    /// @brief Closest-hit query. The traversal only records the candidate hits (see Intersection); the shading data is
+    /// computed with compute_surface_interaction() once, for the closest one.
     bool ray_intersect(const Ray &ray, Intersection &isc) const;
+    /// @brief Closest-hit query of n (1 to RAY_PACKET_SIZE) coherent rays, like the camera rays of neighbouring pixels, which the
+    /// BVHs traverse together (see RayPacket). The result for rays[i] is the same as ray_intersect(rays[i], iscs[i])
+    /// @return bit i is set if rays[i] hits something
+    uint32_t ray_intersect_packet(const Ray *rays, int n, Intersection *iscs) const;
+    /// @brief Fill position, normal, uv and dirn of a hit recorded by the accelerators or Geometry::intersect() with the same ray
+    void compute_surface_interaction(const Ray &ray, Intersection &isc) const;
+    /// @brief Visibility test for shadow rays: whether anything is hit within [ray.tmin, ray.tmax].
+    /// Terminates on the first hit found and doesn't compute an intersection record, so it's cheaper than ray_intersect().
+    bool occluded(const Ray &ray) const;
     /// @brief Sample an emitter in the scene, given a surface intersection point
     /// @param isc The surface intersection point
     /// @param sample1 Uniform sample on [0,1) to sample the emitter index
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <filesystem>
+#include <vector>
+
+#include "core/BVH.h"
+#include "core/Shape.h"
+#include "core/WideBVH.h"
+#include "utils/MappedFile.h"
+#include "utils/SceneParser.h"
+
+class ShapeGroup;
+class TaskPool;
+
+/// @brief Binary cache of the triangle meshes (in world space) and the acceleration structure of a scene.
+/// The cache file is memory-mapped on load, and the mesh buffers and nodes are copied out of it in bulk.
+/// It's keyed by a hash of the shapes (types, properties, and the contents of the mesh files), the
+/// acceleration type and its build settings. Cameras, materials and emitters don't affect it.
+/// The shape groups are reloaded and their BVHs rebuilt on every run; only their bounds, which the instances of the
+/// top-level acceleration structure depend on, are part of the key.
+/// The cache also records a stamp of the mesh files (their sizes and modification times), so the files are only hashed when it changes.
+class SceneCache {
+public:
+    /// @brief Key of the cached data of a scene. A cache written with a different key is stale.
+    /// Every mesh file is read once, however many shapes reference it. With file_contents false, the files only contribute their size
+    /// and modification time: this gives the stamp, which is cheap to compute.
+    /// `shape_groups` are the loaded shape groups of the scene.
+    static uint64_t compute_key(const SceneDesc &scene_desc, const std::vector<ShapeGroup *> &shape_groups, AccelerationType accel_type,
+                                const BVHBuildConfig &config, bool file_contents = true);
+    /// @brief Map the cache file. Without a key, the cache is used if it was written with the same stamp; with one, if it was
+    /// written with the same key, and its stamp is then updated. Returns nullptr if it doesn't exist, is stale, or is invalid.
+    static SceneCache *open(const std::filesystem::path &path, uint64_t stamp, const uint64_t *key, size_t n_shapes);
+    /// @brief Write the meshes of the shapes loaded from mesh files and the acceleration structure (any of bvh, bvh4, bvh8 may be nullptr).
+    /// The file is written to a temporary name and renamed, so a concurrent run never sees a partial cache.
+    static void write(const std::filesystem::path &path, uint64_t key, uint64_t stamp, AccelerationType accel_type, const std::vector<ShapeDesc *> &shapes_desc, const std::vector<Shape *> &shapes,
+                      const BVH *bvh, const WideBVH<4> *bvh4, const WideBVH<8> *bvh8);
+
+    /// @brief Create the mesh and the triangles of the shape at `shape_idx` from the cached mesh, computing its geometric normals on the pool.
+    /// Generated vertex normals are cached with the mesh.
+    /// @return false if the mesh of this shape isn't in the cache
+    bool load_mesh(size_t shape_idx, const ShapeDesc *shape_desc, Shape *shape, TaskPool &pool) const;
+    /// @brief Restore the acceleration structure. `geoms` are the geometries of all shapes, in the scene order.
+    /// @return false if the cache has no acceleration structure for this scene
+    bool load_accel(const std::vector<Geometry *> &geoms, BVH *&bvh, WideBVH<4> *&bvh4, WideBVH<8> *&bvh8) const;
+
+private:
+    MappedFile file;
+
+    explicit SceneCache(const std::filesystem::path &path) : file(path) {}
+    bool validate(uint64_t stamp, const uint64_t *key, size_t n_shapes) const;
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "core/TriangleMesh.h"
+#include "utils/MappedFile.h"
+
+/// @brief A Mitsuba .serialized file, which holds a zlib stream per mesh and an offset table in its footer.
+/// The file is memory-mapped and the table read once, so all the shapes referencing the file share them.
+class SerializedFile {
+public:
+    /// @brief Map the file and read its offset table. Throws std::runtime_error if it isn't a valid serialized file
+    explicit SerializedFile(const std::filesystem::path &path);
+
+    size_t n_meshes() const {
+        return offsets.size() - 1;
+    }
+
+    /// @brief Inflate mesh `index` of the file, in object space. The stream is inflated straight into the buffers of the mesh,
+    /// which are sized exactly from the counts of its header; only values that need converting go through a small buffer.
+    TriangleMesh *read_mesh(size_t index) const;
+
+private:
+    MappedFile file;
+    std::string filepath;
+    uint16_t version;
+    /// start of the data of every mesh, followed by the end of the last one
+    std::vector<uint64_t> offsets{};
+};
+
+/// @brief The serialized files opened while loading the shapes of a scene, by path. Safe to use from concurrent loading tasks.
+class SerializedFileCache {
+public:
+    std::shared_ptr<const SerializedFile> get(const std::filesystem::path &path);
+
+private:
+    std::mutex mutex;
+    std::unordered_map<std::string, std::shared_ptr<const SerializedFile>> files{};
+};
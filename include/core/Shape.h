@@ -8,16 +8,21 @@
 #include "core/Emitter.h"
 
 class Geometry;
+class TriangleMesh;
 
 class Shape {
 public:
     enum class Type {
         Mesh,
         Sphere,
-        Disk
+        Disk,
+        /// a single Instance geometry, referencing a ShapeGroup
+        Instance
     };
 
     std::vector<Geometry *> geometries{};
+    /// the vertex and index buffers of a Type::Mesh shape, referenced by its triangles
+    TriangleMesh *mesh = nullptr;
     BSDF *bsdf = nullptr;
     // if AreaLight
     Emitter *emitter = nullptr;
@@ -26,8 +31,9 @@ public:
     /// @brief Samples a point on the surface of the shape.
     /// @param sample1 A 1D sample point in [0, 1].
     /// @param sample2 A 2D sample point in [0, 1]^2.
+    /// @param sampled_geom If given, receives the geometry the point lies on, e.g. for evaluating a texture there.
     /// @return A tuple containing the position, normal, and PDF of the sampled point.
-    std::tuple<Vec3f, Vec3f, Float> sample_point_on_surface(Float sample1, const Vec2f &sample2) const;
+    std::tuple<Vec3f, Vec3f, Float> sample_point_on_surface(Float sample1, const Vec2f &sample2, const Geometry **sampled_geom = nullptr) const;
 
     std::string to_string() {
         std::ostringstream oss;
@@ -36,10 +42,13 @@ public:
             oss << "(OBJ)";
         else if (type == Type::Sphere)
             oss << "(Sphere)";
+        else if (type == Type::Instance)
+            oss << "(Instance)";
         if (emitter)
             oss << "(Emitter)";
         oss << ":\n";
-        oss << "  " << bsdf->to_string() << "\n";
+        if (bsdf)
+            oss << "  " << bsdf->to_string() << "\n";
         oss << "  Geometries" << "(" << geometries.size() << "):";
         if (geometries.size() == 0)
             oss << " None\n";
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "core/BVH.h"
+#include "core/Shape.h"
+
+/// @brief Shapes declared once in a `shapegroup` and placed in the scene by `instance` shapes.
+/// The geometries are in the group's local space and aren't part of the scene's top-level BVH;
+/// the group has its own BVH instead, which all of its instances share.
+class ShapeGroup {
+public:
+    std::string id;
+    std::vector<Shape *> shapes{};
+    /// bottom-level acceleration structure over the geometries of all the shapes
+    BVH *bvh = nullptr;
+    /// bounds of the geometries, in the group's local space
+    AABB bbox = AABB::empty();
+};
@@ -1,5 +1,9 @@
+#pragma once
+
 #include "core/Sampler.h"
 
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <future>
@@ -112,3 +116,112 @@ public:
         }
     }
 };
+
+/// @brief A general-purpose pool for fork-join style work (e.g. building acceleration structures).
+/// Unlike ThreadPool, tasks take no arguments, and a thread waiting on a task keeps executing
+/// queued tasks in the meantime, so tasks can safely submit and wait for sub-tasks.
+class TaskPool {
+private:
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> tasks;
+
+    std::mutex queue_mutex;
+    std::condition_variable condition;
+    bool stop;
+
+public:
+    // If num_threads is 0, uses hardware concurrency. The calling thread also runs tasks while waiting,
+    // so num_threads - 1 workers are spawned.
+    explicit TaskPool(size_t num_threads = 0) : stop(false) {
+        if (num_threads == 0)
+            num_threads = std::thread::hardware_concurrency();
+        if (num_threads == 0)
+            num_threads = 1;
+
+        workers.reserve(num_threads - 1);
+        for (size_t i = 0; i + 1 < num_threads; ++i) {
+            workers.emplace_back([this] {
+                while (true) {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(queue_mutex);
+                        condition.wait(lock, [this] { return stop || !tasks.empty(); });
+                        if (stop && tasks.empty())
+                            return;
+                        task = std::move(tasks.front());
+                        tasks.pop();
+                    }
+                    task();
+                }
+            });
+        }
+    }
+
+    /// number of threads executing tasks, including the waiting thread
+    size_t size() const { return workers.size() + 1; }
+
+    template <class F>
+    std::future<void> submit(F&& f) {
+        auto task = std::make_shared<std::packaged_task<void()>>(std::forward<F>(f));
+        std::future<void> res = task->get_future();
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            if (stop)
+                throw std::runtime_error("submit on stopped TaskPool");
+            tasks.emplace([task] { (*task)(); });
+        }
+        condition.notify_one();
+        return res;
+    }
+
+    /// @brief Run one queued task on the calling thread
+    /// @return false if there was nothing to run
+    bool run_pending_task() {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            if (tasks.empty())
+                return false;
+            task = std::move(tasks.front());
+            tasks.pop();
+        }
+        task();
+        return true;
+    }
+
+    /// @brief Wait for the result of submit(), executing other queued tasks in the meantime. Rethrows exceptions of the task.
+    void wait(std::future<void>& result) {
+        while (result.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+            if (!run_pending_task())
+                result.wait_for(std::chrono::microseconds(50));
+        result.get();
+    }
+
+    /// @brief Split [begin, end) into one contiguous chunk per thread and call func(chunk_begin, chunk_end, chunk_index) on each of them in parallel
+    /// @return the number of chunks
+    template <class F>
+    size_t parallel_for_chunks(size_t begin, size_t end, F&& func) {
+        size_t n_chunks = std::max<size_t>(1, std::min(size(), end - begin));
+        size_t chunk_size = (end - begin + n_chunks - 1) / n_chunks;
+        std::vector<std::future<void>> results;
+        results.reserve(n_chunks);
+        for (size_t i = 0; i < n_chunks; i++) {
+            size_t chunk_begin = std::min(end, begin + i * chunk_size);
+            size_t chunk_end = std::min(end, chunk_begin + chunk_size);
+            results.emplace_back(submit([&func, chunk_begin, chunk_end, i] { func(chunk_begin, chunk_end, i); }));
+        }
+        for (auto& result : results)
+            wait(result);
+        return n_chunks;
+    }
+
+    ~TaskPool() {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            stop = true;
+        }
+        condition.notify_all();
+        for (std::thread& worker : workers)
+            worker.join();
+    }
+};
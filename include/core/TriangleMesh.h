@@ -0,0 +1,237 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "core/Geometry.h"
+
+class TaskPool;
+
+/// @brief Largest errors introduced by TriangleMesh::compress()
+struct MeshCompressionError {
+    /// angle between a normal and its decoded value, in degrees
+    Float normal_degrees = 0.0;
+    /// difference between a texture coordinate and its decoded value
+    Float texcoord = 0.0;
+};
+
+/// @brief Vertex and index buffers of a triangle mesh, in world space.
+/// The triangles are addressed by (mesh, triangle index); triangle i uses the vertices indices[3i], indices[3i+1], indices[3i+2].
+/// All attributes of a vertex share its index, and normals/texcoords are either given for every vertex or not at all.
+/// Quads (and the fans of larger polygons, two triangles at a time) are stored as two consecutive triangles sharing a diagonal,
+/// (v0, v1, v2) and (v0, v2, v3), and listed in quads; they become one Quad geometry instead of two Triangles (see create_mesh_triangles()).
+/// After compress() the normals and texture coordinates are only kept in their packed forms; read them with normal(),
+/// texcoord() and geometric_normal(), which work in both cases.
+class TriangleMesh {
+public:
+    std::vector<Vec3f> positions{};
+    /// empty if the mesh has no vertex normals, or they are compressed
+    std::vector<Vec3f> normals{};
+    /// empty if the mesh has no texture coordinates, or they are compressed
+    std::vector<Vec2f> texcoords{};
+    std::vector<uint32_t> indices{};
+    /// the first triangle of every quad, in ascending order. The next triangle is the other half of the quad, and belongs to no other quad
+    std::vector<uint32_t> quads{};
+    /// unit geometric normal of every triangle, in the winding order of its vertices and not flipped. (0, 0, 0) for degenerate triangles
+    std::vector<Vec3f> geometric_normals{};
+    /// the vertex normals of a compressed mesh, octahedral-encoded (see encode_octahedral())
+    std::vector<uint32_t> packed_normals{};
+    /// the texture coordinates of a compressed mesh, u in the low and v in the high 16 bits as half floats
+    std::vector<uint32_t> packed_texcoords{};
+    /// the geometric normals of a compressed mesh, octahedral-encoded. Degenerate triangles decode to an arbitrary unit vector
+    std::vector<uint32_t> packed_geometric_normals{};
+    /// shade with the geometric normal, even if there are vertex normals
+    bool face_normals = false;
+    bool flip_normals = false;
+
+    size_t n_triangles() const {
+        return indices.size() / 3;
+    }
+    /// the vertex indices of the quad whose first triangle is t: the vertices of triangle t, and the third vertex of triangle t + 1
+    std::array<uint32_t, 4> quad_indices(size_t t) const {
+        return {indices[3 * t], indices[3 * t + 1], indices[3 * t + 2], indices[3 * t + 5]};
+    }
+
+    bool has_normals() const {
+        return !normals.empty() || !packed_normals.empty();
+    }
+    bool has_texcoords() const {
+        return !texcoords.empty() || !packed_texcoords.empty();
+    }
+    /// the normal of vertex v, decoded if the mesh is compressed
+    Vec3f normal(uint32_t v) const {
+        return packed_normals.empty() ? normals[v] : decode_octahedral(packed_normals[v]);
+    }
+    /// the texture coordinates of vertex v, decoded if the mesh is compressed
+    Vec2f texcoord(uint32_t v) const {
+        if (packed_texcoords.empty())
+            return texcoords[v];
+        return Vec2f{half_to_float(packed_texcoords[v] & 0xFFFF), half_to_float(packed_texcoords[v] >> 16)};
+    }
+    /// the geometric normal of triangle i, decoded if the mesh is compressed
+    Vec3f geometric_normal(size_t i) const {
+        return packed_geometric_normals.empty() ? geometric_normals[i] : decode_octahedral(packed_geometric_normals[i]);
+    }
+
+    /// @brief Transform the positions and normals from object to world space, in parallel on the pool if one is given
+    void transform(const Mat4f &to_world, const Mat4f &inv_to_world, TaskPool *pool = nullptr);
+
+    /// @brief Fill geometric_normals from the positions, in parallel on the pool if one is given
+    void compute_geometric_normals(TaskPool *pool = nullptr);
+
+    /// @brief Generate smooth vertex normals from geometric_normals: the normal of a vertex is the average of the normals of
+    /// its triangles, weighted by the angle of the triangle at the vertex, so it doesn't depend on how a surface is tessellated.
+    /// Triangles whose normals are more than crease_angle degrees apart aren't averaged together; a vertex on such a crease is
+    /// split into one vertex per side, with the same position and texture coordinates. A crease angle of 180 or more smooths everything.
+    void compute_vertex_normals(Float crease_angle = 180.0, TaskPool *pool = nullptr);
+
+    /// @brief Replace the vertex normals, the texture coordinates and the geometric normals with their packed forms, in parallel on
+    /// the pool if one is given: 4 bytes per normal and per pair of texture coordinates instead of 12 and 8 (24 and 16 under
+    /// DOUBLE_FLOAT). The positions are kept exact, since they're shared by the triangles through the index buffer and the
+    /// intersection tests need them. Compressing a compressed mesh does nothing.
+    /// @return the largest errors of the decoded values
+    MeshCompressionError compress(TaskPool *pool = nullptr);
+
+    /// @brief Memory used by the buffers and the triangle and quad geometries, in bytes
+    size_t memory_footprint() const;
+};
+
+/// @brief Intersection data of a triangle: its three vertices, gathered from the index buffer.
+/// The accelerators keep them per primitive reference in leaf order, packed into TrianglePackets, so a leaf test reads
+/// contiguous data instead of calling into the geometry.
+struct TriangleRecord {
+    Vec3f v0, v1, v2;
+    /// false for the entries of other geometries, which are tested with Geometry::intersect()
+    bool is_triangle;
+};
+
+/// @brief Möller–Trumbore test of the triangle given by a vertex and the two edges leaving it.
+/// Returns the distance along the ray in t if it hits within [ray.tmin, ray.tmax], and the barycentric coordinates of the
+/// two other vertices in bary.
+inline bool intersect_triangle(const Vec3f &v0, const Vec3f &e1, const Vec3f &e2, const Ray &ray, Float &t, Vec2f &bary) {
+    Vec3f h = glm::cross(ray.d, e2);
+    Float a = glm::dot(e1, h);
+    if (a > -Epsilon && a < Epsilon)
+        return false;  // parallel to triangle
+    Float f = 1.0 / a;
+    Vec3f s = ray.o - v0;
+    Float u = f * glm::dot(s, h);
+    if (u < 0.0 || u > 1.0)
+        return false;
+    Vec3f q = glm::cross(s, e1);
+    Float v = f * glm::dot(ray.d, q);
+    if (v < -Epsilon || u + v > 1.0 + Epsilon)
+        return false;
+    t = f * glm::dot(e2, q);
+    bary = Vec2f{u, v};
+    // false if the isc point is behind the ray, or outside the valid interval
+    return t >= ray.tmin && t <= ray.tmax;
+}
+
+inline bool intersect_triangle(const TriangleRecord &tri, const Ray &ray, Float &t, Vec2f &bary) {
+    return intersect_triangle(tri.v0, tri.v1 - tri.v0, tri.v2 - tri.v0, ray, t, bary);
+}
+
+/// @brief The barycentric coordinates of a quad hit, in the form of set_quad_hit(): the weights of v1 and v2 for a hit of the
+/// first half, and (-weight of v3, weight of v2) for the second one
+inline Vec2f quad_hit_bary(const Vec2f &bary, bool second_half) {
+    // the tolerance of the triangle tests may give v3 a slightly negative weight, right on the diagonal
+    return second_half ? Vec2f{-std::max(bary.y, Float(0.0)), bary.x} : bary;
+}
+
+/// @brief Möller–Trumbore test of the quad (v0, v1, v2, v3), as its two halves (v0, v1, v2) and (v0, v2, v3) sharing the edges leaving v0.
+/// Returns the distance of the nearest hit within [ray.tmin, ray.tmax] in t, and its barycentric coordinates in the form of quad_hit_bary().
+/// A planar quad is hit once; the halves of a non-planar one are the triangles it's split into.
+inline bool intersect_quad(const Vec3f &v0, const Vec3f &v1, const Vec3f &v2, const Vec3f &v3, const Ray &ray, Float &t, Vec2f &bary) {
+    const Vec3f e2 = v2 - v0;
+    Float t_half;
+    Vec2f bary_half;
+    bool is_hit = false;
+    if (intersect_triangle(v0, v1 - v0, e2, ray, t_half, bary_half)) {
+        t = t_half;
+        bary = quad_hit_bary(bary_half, false);
+        is_hit = true;
+    }
+    if (intersect_triangle(v0, e2, v3 - v0, ray, t_half, bary_half) && (!is_hit || t_half < t)) {
+        t = t_half;
+        bary = quad_hit_bary(bary_half, true);
+        is_hit = true;
+    }
+    return is_hit;
+}
+
+/// @brief The per-ray data of the watertight test: the ray is turned into +z by permuting the axes (kz is the
+/// dominant axis of the direction) and shearing x and y by (sx, sy). sz scales z so the distances stay in ray units.
+struct WatertightRay {
+    int kx, ky, kz;
+    Float sx, sy, sz;
+
+    explicit WatertightRay(const Ray &ray) {
+        Vec3f abs_d = glm::abs(ray.d);
+        kz = abs_d.x > abs_d.y ? (abs_d.x > abs_d.z ? 0 : 2) : (abs_d.y > abs_d.z ? 1 : 2);
+        kx = (kz + 1) % 3;
+        ky = (kx + 1) % 3;
+        // keep the winding of the triangles
+        if (ray.d[kz] < 0.0)
+            std::swap(kx, ky);
+        sx = -ray.d[kx] / ray.d[kz];
+        sy = -ray.d[ky] / ray.d[kz];
+        sz = Float(1.0) / ray.d[kz];
+    }
+};
+
+/// @brief Watertight test (Woop, Benthin & Wald 2013). The edge functions are evaluated in the sheared space of the ray
+/// from the exact vertices, so a ray through an edge or a vertex shared by neighbouring triangles always hits at least one
+/// of them, without any epsilon. Returns the distance along the ray in t if it hits within [ray.tmin, ray.tmax], and the
+/// barycentric coordinates of v1 and v2 in bary.
+inline bool intersect_triangle_watertight(const Vec3f &v0, const Vec3f &v1, const Vec3f &v2, const Ray &ray, const WatertightRay &wr, Float &t, Vec2f &bary) {
+    const Vec3f a = v0 - ray.o, b = v1 - ray.o, c = v2 - ray.o;
+    const Float ax = a[wr.kx] + wr.sx * a[wr.kz], ay = a[wr.ky] + wr.sy * a[wr.kz];
+    const Float bx = b[wr.kx] + wr.sx * b[wr.kz], by = b[wr.ky] + wr.sy * b[wr.kz];
+    const Float cx = c[wr.kx] + wr.sx * c[wr.kz], cy = c[wr.ky] + wr.sy * c[wr.kz];
+    // edge functions; the ray passes inside if they all have the same sign. 0 is on the edge, which counts for both sides
+    const Float u = cx * by - cy * bx;
+    const Float v = ax * cy - ay * cx;
+    const Float w = bx * ay - by * ax;
+    if ((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0))
+        return false;
+    const Float det = u + v + w;
+    if (det == 0.0)
+        return false;  // the ray lies in the plane of the triangle
+    t = wr.sz * (u * a[wr.kz] + v * b[wr.kz] + w * c[wr.kz]) / det;
+    // u, v, w weigh v0, v1, v2
+    bary = Vec2f{v / det, w / det};
+    return t >= ray.tmin && t <= ray.tmax;
+}
+
+inline bool intersect_triangle_watertight(const TriangleRecord &tri, const Ray &ray, const WatertightRay &wr, Float &t, Vec2f &bary) {
+    return intersect_triangle_watertight(tri.v0, tri.v1, tri.v2, ray, wr, t, bary);
+}
+
+/// @brief Record a triangle hit at distance t with the barycentric coordinates bary, found with its TriangleRecord or TrianglePacket.
+/// The shading data is filled later by Scene::compute_surface_interaction(), once the closest hit is known.
+inline void set_triangle_hit(const Geometry *geom, Float t, const Vec2f &bary, Intersection &isc) {
+    isc.distance = t;
+    isc.bary = bary;
+    isc.shape = geom->parent_shape;
+    isc.geom = geom;
+    isc.instance = nullptr;
+}
+
+/// @brief Record a hit of a quad of a mesh at distance t. Both halves fit in isc.bary (see quad_hit_bary()): the weight of v1 is
+/// never negative in the first half, so a negative first coordinate marks the second half, and the diagonal, where both are 0,
+/// is the same point in either
+inline void set_quad_hit(const Geometry *geom, Float t, const Vec2f &bary, bool second_half, Intersection &isc) {
+    set_triangle_hit(geom, t, quad_hit_bary(bary, second_half), isc);
+}
+
+/// @brief Create the triangle and quad geometries of a mesh, allocated in one block each, and append them to `geometries`.
+/// Every quad of TriangleMesh::quads becomes one Quad, and the other triangles a Triangle each.
+/// The `face_normals` and `flip_normals` properties of the shape are stored in the mesh, and the geometric normals are computed.
+/// A mesh without normals gets smooth vertex normals (see TriangleMesh::compute_vertex_normals(), with the `crease_angle` property
+/// of the shape in degrees) unless it uses face normals. The normals are computed in parallel on the pool if one is given.
+void create_mesh_triangles(TriangleMesh *mesh, const std::unordered_map<std::string, std::string> &properties, const Shape *parent_shape, std::vector<Geometry *> &geometries,
+                           TaskPool *pool = nullptr);
@@ -0,0 +1,364 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+#include "core/Geometry.h"
+#include "core/PrimitiveRecords.h"
+#include "core/TriangleMesh.h"
+
+#if !defined(DOUBLE_FLOAT) && (defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64))
+#include <immintrin.h>
+#define TRIANGLE_PACKET_SIMD
+#endif
+
+/// Number of triangles tested at once by a leaf: 8 with AVX, 4 otherwise.
+/// Without SSE, or under DOUBLE_FLOAT, the lanes of a packet are tested one by one.
+#if defined(TRIANGLE_PACKET_SIMD) && defined(__AVX__)
+constexpr int TRIANGLE_PACKET_WIDTH = 8;
+#else
+constexpr int TRIANGLE_PACKET_WIDTH = 4;
+#endif
+
+/// @brief TriangleRecords of TRIANGLE_PACKET_WIDTH consecutive primitive references, in SoA layout.
+/// Packet k of an accelerator holds the references [k * WIDTH, (k + 1) * WIDTH); lanes of other geometries are zeroed
+/// and left out of triangle_mask. The masks tag the type of every lane: spheres and disks are tested with their records
+/// (see LeafPrimitives), and the lanes in none of the masks with Geometry::intersect().
+/// p0 is the first vertex. For the Möller–Trumbore test p1 and p2 hold the precomputed edges e1 = v1 - v0 and e2 = v2 - v0;
+/// the watertight test needs the exact vertices, which neighbouring triangles share, so they hold v1 and v2 instead.
+/// A quad takes one lane: it holds the first half (v0, v1, v2) and is in triangle_mask too, and the second half (v0, v2, v3) is
+/// tested from p0, p2 and the fourth vertex in a QuadPacket (see intersect_quad_halves_packet()).
+struct alignas(32) TrianglePacket {
+    Float p0[3][TRIANGLE_PACKET_WIDTH];
+    Float p1[3][TRIANGLE_PACKET_WIDTH];
+    Float p2[3][TRIANGLE_PACKET_WIDTH];
+    /// bit i is set if lane i is a triangle
+    uint32_t triangle_mask;
+    /// bit i is set if lane i is a sphere with a SphereRecord
+    uint32_t sphere_mask;
+    /// bit i is set if lane i is a disk with a DiskRecord
+    uint32_t disk_mask;
+    /// bit i is set if lane i is a quad
+    uint32_t quad_mask;
+};
+
+/// @brief The fourth vertices of the quads of a TrianglePacket: v3 - v0 for the Möller–Trumbore test, v3 for the watertight one.
+/// The lanes of other geometries are zeroed
+struct alignas(32) QuadPacket {
+    Float p3[3][TRIANGLE_PACKET_WIDTH];
+};
+
+/// @brief The type masks of a packet without its vertices, for the compact leaves (see LeafPrimitives::compact)
+struct PacketMasks {
+    uint32_t triangle_mask;
+    uint32_t sphere_mask;
+    uint32_t disk_mask;
+    uint32_t quad_mask;
+};
+
+/// @brief A triangle referenced by a compact leaf: its mesh in LeafPrimitives::meshes, and its index in the mesh (the first triangle of a quad)
+struct MeshTriangleRef {
+    uint32_t mesh;
+    uint32_t index;
+};
+
+/// @brief Per-lane output of the packet tests: the hit distance, and the barycentric coordinates of the second and third vertices
+struct alignas(32) PacketHits {
+    Float t[TRIANGLE_PACKET_WIDTH];
+    Float b1[TRIANGLE_PACKET_WIDTH];
+    Float b2[TRIANGLE_PACKET_WIDTH];
+};
+
+/// @brief The packets of the primitives of an accelerator, for the watertight test or the Möller–Trumbore one
+std::vector<TrianglePacket> make_triangle_packets(const std::vector<Geometry *> &primitives, bool watertight);
+/// @brief The fourth vertices of the quads among the primitives of an accelerator, one QuadPacket per TrianglePacket. Empty if there are no quads
+std::vector<QuadPacket> make_quad_packets(const std::vector<Geometry *> &primitives, bool watertight);
+
+/// @brief Intersection data of the primitive references of an accelerator, so its leaves dispatch on the type tags of the
+/// packets instead of calling into the geometries: triangles are tested a packet at a time, spheres and disks with the
+/// closed-form kernels of PrimitiveRecords.h, and only the other geometries (instances, non-similarity transforms, geometries
+/// added through the GeometryRegistry) through the virtual Geometry::intersect().
+struct LeafPrimitives {
+    std::vector<TrianglePacket> packets{};
+    /// the fourth vertices of the quads, one per packet (see QuadPacket). Empty if there are no quads, and for compact leaves
+    std::vector<QuadPacket> quad_packets{};
+    /// index of the record of every reference in spheres or disks. Empty if there are neither
+    std::vector<uint32_t> record_index{};
+    std::vector<SphereRecord> spheres{};
+    std::vector<DiskRecord> disks{};
+    /// compact leaves keep no copy of the vertices: packets is empty and masks holds the type masks of every packet instead.
+    /// The triangles are gathered from the vertex buffers of their meshes, which they share, when a leaf is tested (see leaf_packet()).
+    /// That takes about 10 bytes per triangle reference instead of 40 (80 under DOUBLE_FLOAT), for a slower leaf test
+    bool compact = false;
+    std::vector<PacketMasks> masks{};
+    /// the mesh triangle of every reference of a compact leaf. The entries of other geometries are unused
+    std::vector<MeshTriangleRef> triangles{};
+    std::vector<const TriangleMesh *> meshes{};
+
+    /// bytes of leaf data per triangle reference
+    size_t reference_size() const {
+        if (compact)
+            return sizeof(MeshTriangleRef) + sizeof(PacketMasks) / TRIANGLE_PACKET_WIDTH;
+        return (sizeof(TrianglePacket) + (quad_packets.empty() ? 0 : sizeof(QuadPacket))) / TRIANGLE_PACKET_WIDTH;
+    }
+
+    size_t memory_footprint() const {
+        return packets.capacity() * sizeof(TrianglePacket) + quad_packets.capacity() * sizeof(QuadPacket) + record_index.capacity() * sizeof(uint32_t) + spheres.capacity() * sizeof(SphereRecord) +
+               disks.capacity() * sizeof(DiskRecord) + masks.capacity() * sizeof(PacketMasks) + triangles.capacity() * sizeof(MeshTriangleRef) +
+               meshes.capacity() * sizeof(const TriangleMesh *);
+    }
+};
+
+/// @brief The packets and records of the primitives of an accelerator. See make_triangle_packets() for watertight, and
+/// LeafPrimitives::compact for compact
+LeafPrimitives make_leaf_primitives(const std::vector<Geometry *> &primitives, bool watertight, bool compact = false);
+
+/// @brief Packet k of the primitives of an accelerator, the references [k * WIDTH, (k + 1) * WIDTH).
+/// Compact leaves have no stored packets: the triangles of the given lanes are gathered from their meshes into `gathered`, in the form
+/// of the watertight test if watertight is set (like make_triangle_packets()), and the other lanes are zeroed.
+inline const TrianglePacket &leaf_packet(const LeafPrimitives &leaf, uint32_t k, uint32_t lanes, bool watertight, TrianglePacket &gathered) {
+    if (!leaf.compact)
+        return leaf.packets[k];
+    const PacketMasks &masks = leaf.masks[k];
+    gathered.triangle_mask = masks.triangle_mask;
+    gathered.sphere_mask = masks.sphere_mask;
+    gathered.disk_mask = masks.disk_mask;
+    gathered.quad_mask = masks.quad_mask;
+    for (int lane = 0; lane < TRIANGLE_PACKET_WIDTH; lane++) {
+        Vec3f v0{0.0}, p1{0.0}, p2{0.0};
+        if (lanes & masks.triangle_mask & (1u << lane)) {
+            const MeshTriangleRef &ref = leaf.triangles[k * TRIANGLE_PACKET_WIDTH + lane];
+            const TriangleMesh &mesh = *leaf.meshes[ref.mesh];
+            const uint32_t *index = &mesh.indices[3 * static_cast<size_t>(ref.index)];
+            v0 = mesh.positions[index[0]];
+            const Vec3f &v1 = mesh.positions[index[1]], &v2 = mesh.positions[index[2]];
+            p1 = watertight ? v1 : v1 - v0;
+            p2 = watertight ? v2 : v2 - v0;
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            gathered.p0[axis][lane] = v0[axis];
+            gathered.p1[axis][lane] = p1[axis];
+            gathered.p2[axis][lane] = p2[axis];
+        }
+    }
+    return gathered;
+}
+
+/// @brief The fourth vertices of the quads of packet k, the references [k * WIDTH, (k + 1) * WIDTH). Like leaf_packet(), compact leaves
+/// gather those of the given lanes into `gathered`
+inline const QuadPacket &leaf_quad_packet(const LeafPrimitives &leaf, uint32_t k, uint32_t lanes, bool watertight, QuadPacket &gathered) {
+    if (!leaf.compact)
+        return leaf.quad_packets[k];
+    const uint32_t quad_mask = leaf.masks[k].quad_mask;
+    for (int lane = 0; lane < TRIANGLE_PACKET_WIDTH; lane++) {
+        Vec3f p3{0.0};
+        if (lanes & quad_mask & (1u << lane)) {
+            const MeshTriangleRef &ref = leaf.triangles[k * TRIANGLE_PACKET_WIDTH + lane];
+            const TriangleMesh &mesh = *leaf.meshes[ref.mesh];
+            const std::array<uint32_t, 4> quad = mesh.quad_indices(ref.index);
+            p3 = watertight ? mesh.positions[quad[3]] : mesh.positions[quad[3]] - mesh.positions[quad[0]];
+        }
+        for (int axis = 0; axis < 3; axis++)
+            gathered.p3[axis][lane] = p3[axis];
+    }
+    return gathered;
+}
+
+/// @brief Pad the primitive references before a leaf of n primitives is appended, so it's tested with as few packets as possible:
+/// a leaf that fits in one packet doesn't straddle two, and larger leaves start on a packet boundary.
+/// The padding repeats the last reference, and is never tested since it's outside of every leaf.
+inline void pad_for_leaf(std::vector<Geometry *> &primitives, size_t n) {
+    size_t lane = primitives.size() % TRIANGLE_PACKET_WIDTH;
+    if (lane == 0 || lane + n <= TRIANGLE_PACKET_WIDTH)
+        return;
+    primitives.resize(primitives.size() + TRIANGLE_PACKET_WIDTH - lane, primitives.back());
+}
+
+/// @brief Lanes of the packet starting at primitive `base` that belong to the leaf [begin, end)
+inline uint32_t packet_lanes(uint32_t base, uint32_t begin, uint32_t end) {
+    uint32_t lo = begin > base ? begin - base : 0;
+    uint32_t hi = std::min<uint32_t>(end - base, TRIANGLE_PACKET_WIDTH);
+    return ((1u << hi) - 1) & ~((1u << lo) - 1);
+}
+
+#if defined(TRIANGLE_PACKET_SIMD)
+namespace packet_simd {
+#if defined(__AVX__)
+using vfloat = __m256;
+inline vfloat set1(float v) { return _mm256_set1_ps(v); }
+inline vfloat load(const float *p) { return _mm256_load_ps(p); }
+inline vfloat add(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+inline vfloat sub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+inline vfloat mul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+inline vfloat divide(vfloat a, vfloat b) { return _mm256_div_ps(a, b); }
+inline vfloat absolute(vfloat a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+inline vfloat minimum(vfloat a, vfloat b) { return _mm256_min_ps(a, b); }
+inline vfloat maximum(vfloat a, vfloat b) { return _mm256_max_ps(a, b); }
+inline vfloat ge(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+inline vfloat le(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+inline vfloat neq(vfloat a, vfloat b) { return _mm256_cmp_ps(a, b, _CMP_NEQ_OQ); }
+inline vfloat logical_and(vfloat a, vfloat b) { return _mm256_and_ps(a, b); }
+inline vfloat logical_or(vfloat a, vfloat b) { return _mm256_or_ps(a, b); }
+inline uint32_t movemask(vfloat a) { return static_cast<uint32_t>(_mm256_movemask_ps(a)); }
+inline void store(float *p, vfloat a) { _mm256_store_ps(p, a); }
+#else
+using vfloat = __m128;
+inline vfloat set1(float v) { return _mm_set1_ps(v); }
+inline vfloat load(const float *p) { return _mm_load_ps(p); }
+inline vfloat add(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+inline vfloat sub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+inline vfloat mul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+inline vfloat divide(vfloat a, vfloat b) { return _mm_div_ps(a, b); }
+inline vfloat absolute(vfloat a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+inline vfloat minimum(vfloat a, vfloat b) { return _mm_min_ps(a, b); }
+inline vfloat maximum(vfloat a, vfloat b) { return _mm_max_ps(a, b); }
+inline vfloat ge(vfloat a, vfloat b) { return _mm_cmpge_ps(a, b); }
+inline vfloat le(vfloat a, vfloat b) { return _mm_cmple_ps(a, b); }
+inline vfloat neq(vfloat a, vfloat b) { return _mm_cmpneq_ps(a, b); }
+inline vfloat logical_and(vfloat a, vfloat b) { return _mm_and_ps(a, b); }
+inline vfloat logical_or(vfloat a, vfloat b) { return _mm_or_ps(a, b); }
+inline uint32_t movemask(vfloat a) { return static_cast<uint32_t>(_mm_movemask_ps(a)); }
+inline void store(float *p, vfloat a) { _mm_store_ps(p, a); }
+#endif
+}  // namespace packet_simd
+#endif
+
+/// one of the vertex arrays of a packet
+using PacketVertices = Float[3][TRIANGLE_PACKET_WIDTH];
+
+/// a lane of one of the vertex arrays of a packet
+inline Vec3f packet_vertex(const PacketVertices &p, int lane) {
+    return Vec3f{p[0][lane], p[1][lane], p[2][lane]};
+}
+
+/// @brief Möller–Trumbore test of the given lanes of the triangles (p0, p0 + e1, p0 + e2), with the same tolerances as intersect_triangle().
+/// @param hits receives the hit distance and barycentric coordinates of each lane
+/// @return the lanes that are hit within [ray.tmin, ray.tmax]
+inline uint32_t intersect_triangle_lanes(const PacketVertices &p0, const PacketVertices &p1, const PacketVertices &p2, uint32_t lanes,
+                                         const Ray &ray, PacketHits &hits) {
+#if defined(TRIANGLE_PACKET_SIMD)
+    using namespace packet_simd;
+    const vfloat dx = set1(ray.d.x), dy = set1(ray.d.y), dz = set1(ray.d.z);
+    const vfloat e1x = load(p1[0]), e1y = load(p1[1]), e1z = load(p1[2]);
+    const vfloat e2x = load(p2[0]), e2y = load(p2[1]), e2z = load(p2[2]);
+
+    // h = d x e2, a = e1 . h
+    const vfloat hx = sub(mul(dy, e2z), mul(dz, e2y));
+    const vfloat hy = sub(mul(dz, e2x), mul(dx, e2z));
+    const vfloat hz = sub(mul(dx, e2y), mul(dy, e2x));
+    const vfloat a = add(add(mul(e1x, hx), mul(e1y, hy)), mul(e1z, hz));
+    const vfloat f = divide(set1(1.0f), a);
+
+    // s = o - v0, u = f * (s . h)
+    const vfloat sx = sub(set1(ray.o.x), load(p0[0]));
+    const vfloat sy = sub(set1(ray.o.y), load(p0[1]));
+    const vfloat sz = sub(set1(ray.o.z), load(p0[2]));
+    const vfloat u = mul(f, add(add(mul(sx, hx), mul(sy, hy)), mul(sz, hz)));
+
+    // q = s x e1, v = f * (d . q), t = f * (e2 . q)
+    const vfloat qx = sub(mul(sy, e1z), mul(sz, e1y));
+    const vfloat qy = sub(mul(sz, e1x), mul(sx, e1z));
+    const vfloat qz = sub(mul(sx, e1y), mul(sy, e1x));
+    const vfloat v = mul(f, add(add(mul(dx, qx), mul(dy, qy)), mul(dz, qz)));
+    const vfloat t_hit = mul(f, add(add(mul(e2x, qx), mul(e2y, qy)), mul(e2z, qz)));
+
+    // NaNs of the parallel lanes fail every (ordered) comparison
+    const vfloat eps = set1(Epsilon);
+    vfloat valid = ge(absolute(a), eps);
+    valid = logical_and(valid, logical_and(ge(u, set1(0.0f)), le(u, set1(1.0f))));
+    valid = logical_and(valid, logical_and(ge(v, sub(set1(0.0f), eps)), le(add(u, v), add(set1(1.0f), eps))));
+    valid = logical_and(valid, logical_and(ge(t_hit, set1(ray.tmin)), le(t_hit, set1(ray.tmax))));
+    store(hits.t, t_hit);
+    store(hits.b1, u);
+    store(hits.b2, v);
+    return movemask(valid) & lanes;
+#else
+    uint32_t hit_lanes = 0;
+    for (uint32_t remaining = lanes; remaining != 0; remaining &= remaining - 1) {
+        int i = std::countr_zero(remaining);
+        Vec2f bary;
+        if (intersect_triangle(packet_vertex(p0, i), packet_vertex(p1, i), packet_vertex(p2, i), ray, hits.t[i], bary)) {
+            hits.b1[i] = bary.x;
+            hits.b2[i] = bary.y;
+            hit_lanes |= 1u << i;
+        }
+    }
+    return hit_lanes;
+#endif
+}
+
+/// @brief Watertight test of the given lanes of the triangles (p0, p1, p2), like intersect_triangle_watertight()
+/// @param hits receives the hit distance and barycentric coordinates of each lane
+/// @return the lanes that are hit within [ray.tmin, ray.tmax]
+inline uint32_t intersect_triangle_lanes_watertight(const PacketVertices &p0, const PacketVertices &p1, const PacketVertices &p2, uint32_t lanes,
+                                                    const Ray &ray, const WatertightRay &wr, PacketHits &hits) {
+#if defined(TRIANGLE_PACKET_SIMD)
+    using namespace packet_simd;
+    const vfloat sx = set1(wr.sx), sy = set1(wr.sy);
+    const vfloat ox = set1(ray.o[wr.kx]), oy = set1(ray.o[wr.ky]), oz = set1(ray.o[wr.kz]);
+
+    // translate the vertices to the ray origin, permute the axes and shear
+    const vfloat az = sub(load(p0[wr.kz]), oz), bz = sub(load(p1[wr.kz]), oz), cz = sub(load(p2[wr.kz]), oz);
+    const vfloat ax = add(sub(load(p0[wr.kx]), ox), mul(sx, az)), ay = add(sub(load(p0[wr.ky]), oy), mul(sy, az));
+    const vfloat bx = add(sub(load(p1[wr.kx]), ox), mul(sx, bz)), by = add(sub(load(p1[wr.ky]), oy), mul(sy, bz));
+    const vfloat cx = add(sub(load(p2[wr.kx]), ox), mul(sx, cz)), cy = add(sub(load(p2[wr.ky]), oy), mul(sy, cz));
+
+    const vfloat u = sub(mul(cx, by), mul(cy, bx));
+    const vfloat v = sub(mul(ax, cy), mul(ay, cx));
+    const vfloat w = sub(mul(bx, ay), mul(by, ax));
+    const vfloat zero = set1(0.0f);
+    vfloat valid = logical_or(logical_and(logical_and(ge(u, zero), ge(v, zero)), ge(w, zero)),
+                              logical_and(logical_and(le(u, zero), le(v, zero)), le(w, zero)));
+    const vfloat det = add(add(u, v), w);
+    valid = logical_and(valid, neq(det, zero));
+
+    const vfloat t_scaled = mul(set1(wr.sz), add(add(mul(u, az), mul(v, bz)), mul(w, cz)));
+    const vfloat t_hit = divide(t_scaled, det);
+    valid = logical_and(valid, logical_and(ge(t_hit, set1(ray.tmin)), le(t_hit, set1(ray.tmax))));
+    store(hits.t, t_hit);
+    store(hits.b1, divide(v, det));
+    store(hits.b2, divide(w, det));
+    return movemask(valid) & lanes;
+#else
+    uint32_t hit_lanes = 0;
+    for (uint32_t remaining = lanes; remaining != 0; remaining &= remaining - 1) {
+        int i = std::countr_zero(remaining);
+        Vec2f bary;
+        if (intersect_triangle_watertight(packet_vertex(p0, i), packet_vertex(p1, i), packet_vertex(p2, i), ray, wr, hits.t[i], bary)) {
+            hits.b1[i] = bary.x;
+            hits.b2[i] = bary.y;
+            hit_lanes |= 1u << i;
+        }
+    }
+    return hit_lanes;
+#endif
+}
+
+/// @brief Möller–Trumbore test of the given lanes of a packet built for it, with the same tolerances as intersect_triangle().
+/// Quads are tested on their first half
+/// @param hits receives the hit distance and barycentric coordinates of each lane
+/// @return the lanes that are hit within [ray.tmin, ray.tmax]
+inline uint32_t intersect_triangle_packet(const TrianglePacket &packet, uint32_t lanes, const Ray &ray, PacketHits &hits) {
+    return intersect_triangle_lanes(packet.p0, packet.p1, packet.p2, lanes, ray, hits);
+}
+
+/// @brief Watertight test of the given lanes of a packet built for it, like intersect_triangle_watertight().
+/// Quads are tested on their first half
+/// @param hits receives the hit distance and barycentric coordinates of each lane
+/// @return the lanes that are hit within [ray.tmin, ray.tmax]
+inline uint32_t intersect_triangle_packet_watertight(const TrianglePacket &packet, uint32_t lanes, const Ray &ray, const WatertightRay &wr, PacketHits &hits) {
+    return intersect_triangle_lanes_watertight(packet.p0, packet.p1, packet.p2, lanes, ray, wr, hits);
+}
+
+/// @brief Test of the second halves (v0, v2, v3) of the quads `lanes` of a packet and their QuadPacket, with the watertight test if wr
+/// is given and the Möller–Trumbore one otherwise, like the packets were built for. The barycentric coordinates are the weights of v2
+/// and v3 (see set_quad_hit())
+/// @return the lanes that are hit within [ray.tmin, ray.tmax]
+inline uint32_t intersect_quad_halves_packet(const TrianglePacket &packet, const QuadPacket &quads, uint32_t lanes, const Ray &ray,
+                                             const WatertightRay *wr, PacketHits &hits) {
+    // the edge v2 - v0 of the first half is the first edge of the second one
+    return wr != nullptr ? intersect_triangle_lanes_watertight(packet.p0, packet.p2, quads.p3, lanes, ray, *wr, hits)
+                         : intersect_triangle_lanes(packet.p0, packet.p2, quads.p3, lanes, ray, hits);
+}
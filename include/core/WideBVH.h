@@ -0,0 +1,95 @@
+#pragma once
+
+#include <vector>
+
+#include "core/BVH.h"
+
+/// @brief A node of an N-wide BVH. The bounds of all children are stored in SoA layout,
+/// so a single SIMD slab test handles all of them at once. Bounds are always single precision
+/// (rounded outward under DOUBLE_FLOAT).
+template <int N>
+struct alignas(32) WideBVHNode {
+    /// min_x, min_y, min_z, max_x, max_y, max_z of each child. Unused slots hold an inverted box, which never passes the slab test
+    float bounds[6][N];
+    /// index of the child node, or the offset into WideBVH::primitives for a leaf child
+    uint32_t child[N];
+    /// number of primitives of a leaf child, 0 for interior children
+    uint32_t n_primitives[N];
+};
+
+/// @brief A WideBVHNode with the bounds of its children quantized to 16 bits relative to the box of the node, for compressed scenes
+/// (see WideBVH::compress()). Child i spans origin + bounds[row][i] * scale on each axis. The quantized boxes are rounded outward,
+/// so they contain the exact ones and the traversal finds the same hits, at the cost of visiting a few more nodes.
+template <int N>
+struct QuantizedWideBVHNode {
+    /// the min corner of the node's box
+    float origin[3];
+    /// the size of a quantization step on each axis
+    float scale[3];
+    /// quantized min_x, min_y, min_z, max_x, max_y, max_z of each child. The min of an unused slot is 0xFFFF, which the
+    /// children never use, and decodes to an infinite box that is never hit
+    uint16_t bounds[6][N];
+    /// see WideBVHNode
+    uint32_t child[N];
+    uint32_t n_primitives[N];
+};
+
+/// @brief BVH with N (4 or 8) children per node, collapsed from a binary tree.
+/// Traversal tests all children of a node with one SSE/AVX slab test and visits the hit ones front to back.
+template <int N>
+class WideBVH {
+public:
+    static_assert(N == 4 || N == 8, "WideBVH supports 4 or 8 children per node");
+    /// deeper subtrees are collapsed into leaves, which bounds the traversal stack
+    static constexpr int MAX_DEPTH = 32;
+
+    /// empty once the tree is compressed
+    std::vector<WideBVHNode<N>> nodes{};
+    /// the nodes of a compressed tree, empty otherwise
+    std::vector<QuantizedWideBVHNode<N>> quantized_nodes{};
+    /// the geometries referenced by the leaves, reordered so that each leaf's geometries are contiguous
+    std::vector<Geometry *> primitives{};
+    /// intersection data of the primitives, TRIANGLE_PACKET_WIDTH references per packet (see BVH::leaf_primitives)
+    LeafPrimitives leaf_primitives{};
+    /// see BVH::watertight
+    bool watertight = false;
+
+    WideBVH() = default;
+    /// @brief Collapse the binary tree produced by a builder. The tree is deleted afterwards.
+    explicit WideBVH(BVHNode *root);
+
+    /// @brief Closest-hit query. Only the hit is recorded in isc; see Geometry::compute_surface_interaction()
+    bool intersect(const Ray &ray, Intersection &isc) const;
+    /// @brief Closest-hit query of n (1 to RAY_PACKET_SIZE) coherent rays, traversed together (see BVH::intersect_packet())
+    uint32_t intersect_packet(const Ray *rays, int n, Intersection *iscs) const;
+    /// @brief Whether anything is hit within [ray.tmin, ray.tmax]. Stops at the first hit.
+    bool occluded(const Ray &ray) const;
+    /// @brief Select the watertight triangle test or the Möller–Trumbore one
+    void set_watertight(bool watertight);
+    /// @brief Replace the nodes with quantized ones, and switch to compact leaves (see BVH::compress()).
+    /// The nodes take 104 (N = 4) or 184 (N = 8) bytes instead of 128 or 256
+    void compress();
+    /// @brief Expected cost of tracing a ray through the tree, according to the SAH (see BVH::sah_cost)
+    Float sah_cost(const BVHBuildConfig &config) const;
+    /// memory used by the nodes, the primitive references and their packets, in bytes
+    size_t memory_footprint() const;
+
+    size_t n_nodes() const {
+        return quantized_nodes.empty() ? nodes.size() : quantized_nodes.size();
+    }
+    /// size of a node in bytes, quantized or not
+    size_t node_size() const {
+        return quantized_nodes.empty() ? sizeof(WideBVHNode<N>) : sizeof(QuantizedWideBVHNode<N>);
+    }
+
+private:
+    template <typename Node>
+    bool intersect_nodes(const std::vector<Node> &tree, const Ray &ray, Intersection &isc) const;
+    template <typename Node>
+    uint32_t intersect_packet_nodes(const std::vector<Node> &tree, const Ray *rays, int n, Intersection *iscs) const;
+    template <typename Node>
+    bool occluded_nodes(const std::vector<Node> &tree, const Ray &ray) const;
+};
+
+extern template class WideBVH<4>;
+extern template class WideBVH<8>;
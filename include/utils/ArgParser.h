@@ -11,6 +11,12 @@ public:
         bool zip = false;
         bool show_progress = false;
         int n_threads = 1;
+        int n_build_threads = 0;
+        std::string cache_dir;
+        bool no_cache = false;
+        bool rebuild_cache = false;
+        bool compare_builders = false;
+        bool test_edges = false;
 
         // parse arguments
         CLI::App cli_app;
@@ -30,6 +36,12 @@ public:
         cli_app.add_flag("-z, --zip", zip, "Zip the output file");
         cli_app.add_flag("-p, --progress", show_progress, "Show render progress");
         cli_app.add_option("-t, --threads", n_threads, "Number of running threads (0 for auto detect)")->check(CLI::Range(0, 64));
+        cli_app.add_option("--build-threads", n_build_threads, "Number of threads for loading the meshes and building the acceleration structure (0 for auto detect)")->check(CLI::Range(0, 256));
+        cli_app.add_option("--cache-dir", cache_dir, "Directory of the scene cache (meshes and acceleration structure). Defaults to the directory of the scene file")->check(CLI::ExistingDirectory);
+        cli_app.add_flag("--no-cache", no_cache, "Don't read or write the scene cache");
+        cli_app.add_flag("--rebuild-cache", rebuild_cache, "Ignore the scene cache and overwrite it");
+        cli_app.add_flag("--compare-builders", compare_builders, "Report the build time and SAH cost of each BVH builder on the scene");
+        cli_app.add_flag("--test-edges", test_edges, "Shoot rays through the shared edges of the meshes and report the misses and double hits of the triangle tests");
 
         // parse the arguments
         try {
@@ -44,6 +56,12 @@ public:
         props["zip"] = zip ? "true" : "false";
         props["show_progress"] = show_progress ? "true" : "false";
         props["n_threads"] = std::to_string(n_threads);
+        props["n_build_threads"] = std::to_string(n_build_threads);
+        props["cache_dir"] = cache_dir;
+        props["no_cache"] = no_cache ? "true" : "false";
+        props["rebuild_cache"] = rebuild_cache ? "true" : "false";
+        props["compare_builders"] = compare_builders ? "true" : "false";
+        props["test_edges"] = test_edges ? "true" : "false";
 
         return props;
     }
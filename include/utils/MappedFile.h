@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/// @brief Read-only memory mapping of a whole file. The mapping lives as long as the object.
+class MappedFile {
+public:
+    MappedFile() = default;
+    /// @brief Map the file. Throws std::runtime_error if it can't be opened or mapped.
+    explicit MappedFile(const std::filesystem::path &path) {
+#ifdef _WIN32
+        file_handle = CreateFileW(path.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file_handle == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Failed to open file: " + path.string());
+        LARGE_INTEGER file_size;
+        if (!GetFileSizeEx(file_handle, &file_size)) {
+            close();
+            throw std::runtime_error("Failed to get the size of file: " + path.string());
+        }
+        n_bytes = static_cast<size_t>(file_size.QuadPart);
+        if (n_bytes == 0)
+            return;
+        mapping_handle = CreateFileMappingW(file_handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping_handle == nullptr) {
+            close();
+            throw std::runtime_error("Failed to map file: " + path.string());
+        }
+        bytes = static_cast<const uint8_t *>(MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, 0));
+        if (bytes == nullptr) {
+            close();
+            throw std::runtime_error("Failed to map file: " + path.string());
+        }
+#else
+        fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Failed to open file: " + path.string());
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            close();
+            throw std::runtime_error("Failed to get the size of file: " + path.string());
+        }
+        n_bytes = static_cast<size_t>(st.st_size);
+        if (n_bytes == 0)
+            return;
+        void *ptr = mmap(nullptr, n_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) {
+            close();
+            throw std::runtime_error("Failed to map file: " + path.string());
+        }
+        bytes = static_cast<const uint8_t *>(ptr);
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+        close();
+    }
+
+    /// nullptr for an empty file
+    const uint8_t *data() const {
+        return bytes;
+    }
+
+    size_t size() const {
+        return n_bytes;
+    }
+
+private:
+    const uint8_t *bytes = nullptr;
+    size_t n_bytes = 0;
+#ifdef _WIN32
+    HANDLE file_handle = INVALID_HANDLE_VALUE;
+    HANDLE mapping_handle = nullptr;
+#else
+    int fd = -1;
+#endif
+
+    void close() {
+#ifdef _WIN32
+        if (bytes != nullptr)
+            UnmapViewOfFile(bytes);
+        if (mapping_handle != nullptr)
+            CloseHandle(mapping_handle);
+        if (file_handle != INVALID_HANDLE_VALUE)
+            CloseHandle(file_handle);
+        mapping_handle = nullptr;
+        file_handle = INVALID_HANDLE_VALUE;
+#else
+        if (bytes != nullptr)
+            munmap(const_cast<uint8_t *>(bytes), n_bytes);
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+#endif
+        bytes = nullptr;
+    }
+};
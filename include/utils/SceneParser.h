@@ -179,9 +179,13 @@ struct SensorDesc : public SceneObjectDesc {
     }
 };
 
+struct ShapeGroupDesc;
+
 struct ShapeDesc : public SceneObjectDesc {
     BSDFDesc* bsdf = nullptr;
     EmitterDesc* emitter = nullptr;
+    /// the referenced shape group, for an `instance`
+    const ShapeGroupDesc* shape_group = nullptr;
 
     ShapeDesc() {
         properties["to_world"] = mat4fToStr(Mat4f{1.0});
@@ -204,10 +208,32 @@ struct ShapeDesc : public SceneObjectDesc {
     }
 };
 
+/// A `shapegroup`: shapes that are only rendered through `instance` shapes referencing the group's id
+struct ShapeGroupDesc {
+    std::string id;
+    std::vector<ShapeDesc*> shapes;
+
+    std::string to_string() {
+        std::ostringstream oss;
+        oss << "(ShapeGroupDesc)\n";
+        oss << "id: " << id << "\n";
+        oss << "Shapes(" << shapes.size() << "):\n";
+        for (const auto& shape : shapes)
+            oss << shape->to_string() << "\n";
+        return oss.str();
+    }
+
+    ~ShapeGroupDesc() {
+        for (auto shape : shapes)
+            delete shape;
+    }
+};
+
 struct SceneDesc {
     IntegratorDesc* integrator;
     SensorDesc* sensor;
     std::vector<ShapeDesc*> shapes;
+    std::vector<ShapeGroupDesc*> shape_groups;
     std::vector<BSDFDesc*> bsdfs;
     std::vector<const TextureDesc*> textures;
     std::vector<EmitterDesc*> emitters;
@@ -221,6 +247,9 @@ struct SceneDesc {
         oss << "Shapes(" << shapes.size() << "):\n";
         for (const auto& shape : shapes)
             oss << shape->to_string() << "\n\n";
+        oss << "Shape groups(" << shape_groups.size() << "):\n";
+        for (const auto& shape_group : shape_groups)
+            oss << shape_group->to_string() << "\n\n";
         oss << "\nGlobal BSDFs(" << bsdfs.size() << "):\n";
         for (const auto& bsdf : bsdfs)
             oss << bsdf->to_string() << "\n\n";
@@ -237,6 +266,8 @@ struct SceneDesc {
         delete sensor;
         for (auto shape : shapes)
             delete shape;
+        for (auto shape_group : shape_groups)
+            delete shape_group;
         for (auto bsdf : bsdfs)
             delete bsdf;
         for (auto emitter : emitters)
@@ -274,6 +305,7 @@ private:
     std::unordered_map<std::string, std::string> defaults;
     std::unordered_map<std::string, BSDFDesc*> shared_bsdfs;
     std::unordered_map<std::string, TextureDesc*> shared_textures;
+    std::unordered_map<std::string, ShapeGroupDesc*> shared_shape_groups;
     bool has_envmap = false;
 
     /// @brief utility function for parsing a node containing a vector type(point, rgb, vector, etc.) `value` or `x`, `r`, etc.
@@ -327,6 +359,12 @@ private:
                 scene.integrator = parseIntegrator(child);
             } else if (node_name == "sensor") {
                 scene.sensor = parseSensor(child);
+            } else if (node_name == "shape" && std::string(child.attribute("type").value()) == "shapegroup") {
+                ShapeGroupDesc* shape_group = parseShapeGroup(child);
+                scene.shape_groups.push_back(shape_group);
+                for (const auto& shape_desc : shape_group->shapes)
+                    if (shape_desc->bsdf != nullptr && std::find(scene.bsdfs.begin(), scene.bsdfs.end(), shape_desc->bsdf) == scene.bsdfs.end())
+                        scene.bsdfs.push_back(shape_desc->bsdf);
             } else if (node_name == "shape") {
                 ShapeDesc* shape_desc = parseShape(child);
                 scene.shapes.push_back(shape_desc);
@@ -352,7 +390,8 @@ private:
                     scene.has_envmap = true;
             } else if (node_name == "default") {
                 auto [name, value] = this->add_default(child);
-                if (name == "accel_type")
+                // acceleration structure settings (accel_type, accel_bins, ...)
+                if (name.starts_with("accel_"))
                     scene.props[name] = value;
             } else {
                 throw std::runtime_error(std::string("Unknown scene object: ") + node_name);
@@ -404,6 +443,11 @@ private:
 
             if (child_name == "bsdf") {
                 shape->bsdf = parseBSDF(child);
+            } else if (child_name == "ref" && shape->type == "instance") {
+                std::string id = child.attribute("id").value();
+                if (!shared_shape_groups.contains(id))
+                    throw std::runtime_error("Instance references an unknown shapegroup: " + id);
+                shape->shape_group = shared_shape_groups[id];
             } else if (child_name == "ref") {
                 // Handle references to other objects
                 // Store reference for later resolution
@@ -414,9 +458,37 @@ private:
             }
         }
 
+        if (shape->type == "instance" && shape->shape_group == nullptr)
+            throw std::runtime_error("Instance doesn't reference a shapegroup.");
+
         return shape;
     }
 
+    ShapeGroupDesc* parseShapeGroup(const pugi::xml_node& node) {
+        auto shape_group = new ShapeGroupDesc{};
+        if (!node.attribute("id"))
+            throw std::runtime_error("A shapegroup must have an id.");
+        shape_group->id = node.attribute("id").value();
+        if (shared_shape_groups.contains(shape_group->id))
+            throw std::runtime_error("Duplicate shapegroup id: " + shape_group->id);
+
+        for (pugi::xml_node child : node.children()) {
+            std::string child_name = child.name();
+            if (child_name != "shape")
+                throw std::runtime_error("A shapegroup can only contain shapes, found: " + child_name);
+            std::string type = get_default(child.attribute("type").value());
+            if (type == "shapegroup" || type == "instance")
+                throw std::runtime_error("Nested shapegroups and instances are not supported.");
+            ShapeDesc* shape_desc = parseShape(child);
+            if (shape_desc->emitter != nullptr)
+                throw std::runtime_error("Emitters inside a shapegroup are not supported.");
+            shape_group->shapes.push_back(shape_desc);
+        }
+
+        shared_shape_groups[shape_group->id] = shape_group;
+        return shape_group;
+    }
+
     TextureDesc* parseTexture(const pugi::xml_node& node) {
         auto texture = new TextureDesc{};
         texture->type = get_default(node.attribute("type").value());
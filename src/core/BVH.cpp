@@ -0,0 +1,1032 @@
+#include "core/BVH.h"
+
+#include <algorithm>
+#include <format>
+#include <functional>
+
+#include "core/Thread.h"
+
+BVHBuildConfig parse_bvh_config(const std::unordered_map<std::string, std::string> &props) {
+    BVHBuildConfig config{};
+    if (props.contains("accel_bins"))
+        config.n_bins = std::stoi(props.at("accel_bins"));
+    if (props.contains("accel_max_leaf_size"))
+        config.max_leaf_size = std::stoi(props.at("accel_max_leaf_size"));
+    if (props.contains("accel_traversal_cost"))
+        config.traversal_cost = static_cast<Float>(std::stod(props.at("accel_traversal_cost")));
+    if (props.contains("accel_intersection_cost"))
+        config.intersection_cost = static_cast<Float>(std::stod(props.at("accel_intersection_cost")));
+    if (props.contains("accel_sbvh_alpha"))
+        config.sbvh_alpha = static_cast<Float>(std::stod(props.at("accel_sbvh_alpha")));
+    if (props.contains("accel_sbvh_budget"))
+        config.sbvh_budget = static_cast<Float>(std::stod(props.at("accel_sbvh_budget")));
+    if (props.contains("accel_near_first"))
+        config.near_first = props.at("accel_near_first") == "true" || props.at("accel_near_first") == "1";
+    if (props.contains("accel_watertight"))
+        config.watertight = props.at("accel_watertight") == "true" || props.at("accel_watertight") == "1";
+
+    if (config.n_bins < 2)
+        throw std::runtime_error("accel_bins must be at least 2");
+    if (config.max_leaf_size < 1)
+        throw std::runtime_error("accel_max_leaf_size must be at least 1");
+    if (config.traversal_cost < 0.0 || config.intersection_cost <= 0.0)
+        throw std::runtime_error("accel_traversal_cost must be non-negative and accel_intersection_cost must be positive");
+    if (config.sbvh_alpha < 0.0 || config.sbvh_budget < 1.0)
+        throw std::runtime_error("accel_sbvh_alpha must be non-negative and accel_sbvh_budget must be at least 1");
+    return config;
+}
+
+namespace {
+// ranges with at least this many primitives compute bounds, bins and partitions in parallel
+constexpr size_t PARALLEL_RANGE_THRESHOLD = 64 * 1024;
+// subtrees with at least this many primitives are built as separate tasks
+constexpr size_t FORK_THRESHOLD = 4 * 1024;
+
+struct SAHBin {
+    AABB bbox = AABB::empty();
+    int count = 0;
+};
+
+struct SAHSplit {
+    int axis = -1;
+    int bin = -1;
+    Float cost = INFINITY;
+};
+
+struct SAHBuildContext {
+    std::vector<BVHPrimitive> &prims;
+    const BVHBuildConfig &config;
+    /// nullptr for a single threaded build
+    TaskPool *pool;
+};
+
+inline int bin_index(Float centroid, Float min, Float scale, int n_bins) {
+    int b = static_cast<int>((centroid - min) * scale);
+    return std::clamp(b, 0, n_bins - 1);
+}
+
+inline bool run_parallel(const SAHBuildContext &ctx, size_t begin, size_t end) {
+    return ctx.pool != nullptr && ctx.pool->size() > 1 && end - begin >= PARALLEL_RANGE_THRESHOLD;
+}
+
+void compute_bounds(const SAHBuildContext &ctx, size_t begin, size_t end, AABB &bbox, AABB &centroid_bbox) {
+    auto reduce = [&ctx](size_t chunk_begin, size_t chunk_end, AABB &chunk_bbox, AABB &chunk_centroid_bbox) {
+        chunk_bbox = AABB::empty();
+        chunk_centroid_bbox = AABB::empty();
+        for (size_t i = chunk_begin; i < chunk_end; i++) {
+            chunk_bbox = chunk_bbox + ctx.prims[i].bbox;
+            chunk_centroid_bbox = chunk_centroid_bbox + AABB{ctx.prims[i].centroid, ctx.prims[i].centroid};
+        }
+    };
+
+    if (!run_parallel(ctx, begin, end)) {
+        reduce(begin, end, bbox, centroid_bbox);
+        return;
+    }
+    std::vector<AABB> chunk_bboxes(ctx.pool->size()), chunk_centroid_bboxes(ctx.pool->size());
+    size_t n_chunks = ctx.pool->parallel_for_chunks(begin, end, [&](size_t chunk_begin, size_t chunk_end, size_t chunk) {
+        reduce(chunk_begin, chunk_end, chunk_bboxes[chunk], chunk_centroid_bboxes[chunk]);
+    });
+    bbox = AABB::empty();
+    centroid_bbox = AABB::empty();
+    for (size_t chunk = 0; chunk < n_chunks; chunk++) {
+        bbox = bbox + chunk_bboxes[chunk];
+        centroid_bbox = centroid_bbox + chunk_centroid_bboxes[chunk];
+    }
+}
+
+/// find the cheapest bin boundary over all three axes. `cost` of the result is relative to the cost of a leaf
+SAHSplit find_sah_split(const SAHBuildContext &ctx, size_t begin, size_t end, const AABB &bbox, const AABB &centroid_bbox) {
+    const int n_bins = ctx.config.n_bins;
+    Vec3f scale{0.0};
+    for (int axis = 0; axis < 3; axis++) {
+        Float extent = centroid_bbox.max_corner[axis] - centroid_bbox.min_corner[axis];
+        scale[axis] = extent > 0.0 ? n_bins / extent : 0.0;
+    }
+
+    // bins of all three axes, stored as [axis * n_bins + bin]
+    auto fill_bins = [&](size_t chunk_begin, size_t chunk_end, std::vector<SAHBin> &bins) {
+        bins.assign(3 * n_bins, SAHBin{});
+        for (size_t i = chunk_begin; i < chunk_end; i++) {
+            const BVHPrimitive &prim = ctx.prims[i];
+            for (int axis = 0; axis < 3; axis++) {
+                auto &bin = bins[axis * n_bins + bin_index(prim.centroid[axis], centroid_bbox.min_corner[axis], scale[axis], n_bins)];
+                bin.count++;
+                bin.bbox = bin.bbox + prim.bbox;
+            }
+        }
+    };
+
+    std::vector<SAHBin> bins;
+    if (!run_parallel(ctx, begin, end)) {
+        fill_bins(begin, end, bins);
+    } else {
+        std::vector<std::vector<SAHBin>> chunk_bins(ctx.pool->size());
+        size_t n_chunks = ctx.pool->parallel_for_chunks(begin, end, [&](size_t chunk_begin, size_t chunk_end, size_t chunk) {
+            fill_bins(chunk_begin, chunk_end, chunk_bins[chunk]);
+        });
+        bins = std::move(chunk_bins[0]);
+        for (size_t chunk = 1; chunk < n_chunks; chunk++)
+            for (size_t b = 0; b < bins.size(); b++) {
+                bins[b].count += chunk_bins[chunk][b].count;
+                bins[b].bbox = bins[b].bbox + chunk_bins[chunk][b].bbox;
+            }
+    }
+
+    SAHSplit best{};
+    Float area = bbox.surface_area();
+    Float inv_area = area > 0.0 ? 1.0 / area : 0.0;
+    std::vector<Float> right_area(n_bins);
+    std::vector<int> right_count(n_bins);
+    for (int axis = 0; axis < 3; axis++) {
+        if (scale[axis] == 0.0)
+            continue;
+        const SAHBin *axis_bins = &bins[axis * n_bins];
+
+        // sweep from the right to get the area & count of everything right of each boundary
+        AABB acc = AABB::empty();
+        int count = 0;
+        for (int b = n_bins - 1; b > 0; b--) {
+            acc = acc + axis_bins[b].bbox;
+            count += axis_bins[b].count;
+            right_area[b - 1] = acc.surface_area();
+            right_count[b - 1] = count;
+        }
+        // sweep from the left and evaluate the SAH at each boundary
+        acc = AABB::empty();
+        count = 0;
+        for (int b = 0; b < n_bins - 1; b++) {
+            acc = acc + axis_bins[b].bbox;
+            count += axis_bins[b].count;
+            if (count == 0 || right_count[b] == 0)
+                continue;
+            Float cost = ctx.config.traversal_cost + (ctx.config.leaf_cost(count) * acc.surface_area() + ctx.config.leaf_cost(right_count[b]) * right_area[b]) * inv_area;
+            if (cost < best.cost) {
+                best.axis = axis;
+                best.bin = b;
+                best.cost = cost;
+            }
+        }
+    }
+
+    return best;
+}
+
+/// reorder prims[begin, end) so that the ones for which `goes_left` is true come first. Returns the first index of the right part.
+template <class Pred>
+size_t partition_prims(const SAHBuildContext &ctx, size_t begin, size_t end, const Pred &goes_left) {
+    if (!run_parallel(ctx, begin, end))
+        return std::partition(ctx.prims.begin() + begin, ctx.prims.begin() + end, goes_left) - ctx.prims.begin();
+
+    // count per chunk, then scatter every chunk into its slot of a temporary buffer
+    std::vector<size_t> left_counts(ctx.pool->size(), 0), right_counts(ctx.pool->size(), 0);
+    size_t n_chunks = ctx.pool->parallel_for_chunks(begin, end, [&](size_t chunk_begin, size_t chunk_end, size_t chunk) {
+        for (size_t i = chunk_begin; i < chunk_end; i++)
+            (goes_left(ctx.prims[i]) ? left_counts[chunk] : right_counts[chunk])++;
+    });
+    std::vector<size_t> left_offsets(n_chunks), right_offsets(n_chunks);
+    size_t n_left = 0;
+    for (size_t chunk = 0; chunk < n_chunks; chunk++)
+        n_left += left_counts[chunk];
+    size_t left_acc = 0, right_acc = n_left;
+    for (size_t chunk = 0; chunk < n_chunks; chunk++) {
+        left_offsets[chunk] = left_acc;
+        right_offsets[chunk] = right_acc;
+        left_acc += left_counts[chunk];
+        right_acc += right_counts[chunk];
+    }
+
+    std::vector<BVHPrimitive> tmp(end - begin);
+    ctx.pool->parallel_for_chunks(begin, end, [&](size_t chunk_begin, size_t chunk_end, size_t chunk) {
+        size_t left = left_offsets[chunk], right = right_offsets[chunk];
+        for (size_t i = chunk_begin; i < chunk_end; i++)
+            tmp[goes_left(ctx.prims[i]) ? left++ : right++] = ctx.prims[i];
+    });
+    ctx.pool->parallel_for_chunks(0, tmp.size(), [&](size_t chunk_begin, size_t chunk_end, size_t) {
+        std::copy(tmp.begin() + chunk_begin, tmp.begin() + chunk_end, ctx.prims.begin() + begin + chunk_begin);
+    });
+    return begin + n_left;
+}
+
+BVHNode *build_sah_recursive(const SAHBuildContext &ctx, size_t begin, size_t end) {
+    auto node = new BVHNode{};
+    AABB centroid_bbox;
+    compute_bounds(ctx, begin, end, node->bbox, centroid_bbox);
+
+    size_t n_prims = end - begin;
+    SAHSplit split{};
+    if (n_prims > 1)
+        split = find_sah_split(ctx, begin, end, node->bbox, centroid_bbox);
+
+    Float leaf_cost = ctx.config.leaf_cost(n_prims);
+    bool make_leaf = split.axis == -1 || (n_prims <= static_cast<size_t>(ctx.config.max_leaf_size) && leaf_cost <= split.cost);
+    if (make_leaf) {
+        // either the SAH prefers a leaf, or all centroids coincide and there's nothing to split
+        node->geoms.reserve(n_prims);
+        for (size_t i = begin; i < end; i++)
+            node->geoms.push_back(ctx.prims[i].geom);
+        return node;
+    }
+
+    Float min = centroid_bbox.min_corner[split.axis];
+    Float scale = ctx.config.n_bins / (centroid_bbox.max_corner[split.axis] - min);
+    size_t mid = partition_prims(ctx, begin, end, [&](const BVHPrimitive &prim) {
+        return bin_index(prim.centroid[split.axis], min, scale, ctx.config.n_bins) <= split.bin;
+    });
+    node->split_axis = split.axis;
+
+    if (ctx.pool != nullptr && ctx.pool->size() > 1 && n_prims >= FORK_THRESHOLD) {
+        auto left_result = ctx.pool->submit([&ctx, node, begin, mid] { node->left = build_sah_recursive(ctx, begin, mid); });
+        node->right = build_sah_recursive(ctx, mid, end);
+        ctx.pool->wait(left_result);
+    } else {
+        node->left = build_sah_recursive(ctx, begin, mid);
+        node->right = build_sah_recursive(ctx, mid, end);
+    }
+    return node;
+}
+}  // namespace
+
+BVHNode *build_bvh_sah(const std::vector<Geometry *> &geoms, const BVHBuildConfig &config, uint32_t n_threads) {
+    if (geoms.empty())
+        return nullptr;
+
+    TaskPool pool{n_threads};
+    std::vector<BVHPrimitive> prims(geoms.size());
+    auto init_prims = [&](size_t chunk_begin, size_t chunk_end, size_t) {
+        for (size_t i = chunk_begin; i < chunk_end; i++) {
+            prims[i].bbox = geoms[i]->get_bbox();
+            prims[i].centroid = prims[i].bbox.centroid();
+            prims[i].geom = geoms[i];
+        }
+    };
+    pool.parallel_for_chunks(0, prims.size(), init_prims);
+
+    SAHBuildContext ctx{prims, config, &pool};
+    return build_sah_recursive(ctx, 0, prims.size());
+}
+
+namespace {
+struct SpatialBin {
+    AABB bbox = AABB::empty();
+    /// number of references starting / ending in this bin
+    int entries = 0;
+    int exits = 0;
+};
+
+struct SpatialSplit {
+    int axis = -1;
+    Float position = 0.0;
+    Float cost = INFINITY;
+    /// bounds and reference counts of the two sides, as estimated by the binning
+    AABB left_bbox, right_bbox;
+    int n_left = 0, n_right = 0;
+};
+
+struct SBVHBuildContext {
+    const BVHBuildConfig &config;
+    Float root_area;
+    /// how many more references can be created by spatial splits before hitting the memory budget
+    size_t refs_budget;
+};
+
+inline BVHPrimitive make_ref(const AABB &bbox, Geometry *geom) {
+    return BVHPrimitive{bbox, bbox.centroid(), geom};
+}
+
+/// the part of the reference on the left (below `position`) or right side of the plane
+inline AABB clip_ref(const BVHPrimitive &ref, int axis, Float position, bool left) {
+    AABB clip = ref.bbox;
+    (left ? clip.max_corner : clip.min_corner)[axis] = position;
+    return ref.geom->get_clipped_bbox(clip);
+}
+
+/// find the cheapest split plane at the bin boundaries of the node's bounds. `cost` is comparable with find_sah_split()
+SpatialSplit find_spatial_split(const SBVHBuildContext &ctx, const std::vector<BVHPrimitive> &refs, const AABB &bbox) {
+    const int n_bins = ctx.config.n_bins;
+    const int n_refs = static_cast<int>(refs.size());
+    SpatialSplit best{};
+    Float area = bbox.surface_area();
+    Float inv_area = area > 0.0 ? 1.0 / area : 0.0;
+    std::vector<SpatialBin> bins(n_bins);
+    std::vector<AABB> right_bbox(n_bins);
+    std::vector<int> right_count(n_bins);
+    for (int axis = 0; axis < 3; axis++) {
+        Float min = bbox.min_corner[axis];
+        Float extent = bbox.max_corner[axis] - min;
+        if (extent <= 0.0)
+            continue;
+        Float width = extent / n_bins;
+        Float scale = n_bins / extent;
+
+        // chop every reference into the bins it overlaps
+        bins.assign(n_bins, SpatialBin{});
+        for (const auto &ref : refs) {
+            int first = bin_index(ref.bbox.min_corner[axis], min, scale, n_bins);
+            int last = bin_index(ref.bbox.max_corner[axis], min, scale, n_bins);
+            for (int b = first; b <= last; b++) {
+                AABB clip = ref.bbox;
+                if (b > first)
+                    clip.min_corner[axis] = min + b * width;
+                if (b < last)
+                    clip.max_corner[axis] = min + (b + 1) * width;
+                AABB part = first == last ? ref.bbox : ref.geom->get_clipped_bbox(clip);
+                if (!part.is_empty())
+                    bins[b].bbox = bins[b].bbox + part;
+            }
+            bins[first].entries++;
+            bins[last].exits++;
+        }
+
+        AABB acc = AABB::empty();
+        int count = 0;
+        for (int b = n_bins - 1; b > 0; b--) {
+            acc = acc + bins[b].bbox;
+            count += bins[b].exits;
+            right_bbox[b - 1] = acc;
+            right_count[b - 1] = count;
+        }
+        acc = AABB::empty();
+        count = 0;
+        for (int b = 0; b < n_bins - 1; b++) {
+            acc = acc + bins[b].bbox;
+            count += bins[b].entries;
+            // both sides must shrink, otherwise the recursion could keep duplicating the same references
+            if (count == 0 || right_count[b] == 0 || count == n_refs || right_count[b] == n_refs)
+                continue;
+            Float cost = ctx.config.traversal_cost + (ctx.config.leaf_cost(count) * acc.surface_area() + ctx.config.leaf_cost(right_count[b]) * right_bbox[b].surface_area()) * inv_area;
+            if (cost < best.cost) {
+                best.axis = axis;
+                best.position = min + (b + 1) * width;
+                best.cost = cost;
+                best.left_bbox = acc;
+                best.right_bbox = right_bbox[b];
+                best.n_left = count;
+                best.n_right = right_count[b];
+            }
+        }
+    }
+    return best;
+}
+
+/// distribute the references among the two sides of the plane. A reference crossing it is either clipped
+/// and duplicated, or kept whole on one side ("unsplitting") when that's cheaper or the budget is exhausted.
+void partition_spatial(SBVHBuildContext &ctx, const std::vector<BVHPrimitive> &refs, const SpatialSplit &split,
+                       std::vector<BVHPrimitive> &left, std::vector<BVHPrimitive> &right) {
+    const int axis = split.axis;
+    AABB left_bbox = split.left_bbox, right_bbox = split.right_bbox;
+    int n_left = split.n_left, n_right = split.n_right;
+    for (const auto &ref : refs) {
+        if (ref.bbox.max_corner[axis] <= split.position) {
+            left.push_back(ref);
+            continue;
+        }
+        if (ref.bbox.min_corner[axis] >= split.position) {
+            right.push_back(ref);
+            continue;
+        }
+
+        AABB left_part = clip_ref(ref, axis, split.position, true);
+        AABB right_part = clip_ref(ref, axis, split.position, false);
+        // the box crosses the plane, but the geometry itself may not
+        if (left_part.is_empty() || right_part.is_empty()) {
+            if (left_part.is_empty())
+                right.push_back(make_ref(right_part, ref.geom));
+            else
+                left.push_back(make_ref(left_part, ref.geom));
+            continue;
+        }
+
+        Float cost_split = left_bbox.surface_area() * n_left + right_bbox.surface_area() * n_right;
+        Float cost_left = (left_bbox + ref.bbox).surface_area() * n_left + right_bbox.surface_area() * (n_right - 1);
+        Float cost_right = left_bbox.surface_area() * (n_left - 1) + (right_bbox + ref.bbox).surface_area() * n_right;
+        if (ctx.refs_budget > 0 && cost_split < std::min(cost_left, cost_right)) {
+            left.push_back(make_ref(left_part, ref.geom));
+            right.push_back(make_ref(right_part, ref.geom));
+            ctx.refs_budget--;
+        } else if (cost_left <= cost_right) {
+            left.push_back(ref);
+            left_bbox = left_bbox + ref.bbox;
+            n_right--;
+        } else {
+            right.push_back(ref);
+            right_bbox = right_bbox + ref.bbox;
+            n_left--;
+        }
+    }
+}
+
+BVHNode *build_sbvh_recursive(SBVHBuildContext &ctx, std::vector<BVHPrimitive> &refs) {
+    auto node = new BVHNode{};
+    AABB centroid_bbox;
+    SAHBuildContext sah_ctx{refs, ctx.config, nullptr};
+    compute_bounds(sah_ctx, 0, refs.size(), node->bbox, centroid_bbox);
+
+    size_t n_refs = refs.size();
+    SAHSplit object_split{};
+    if (n_refs > 1)
+        object_split = find_sah_split(sah_ctx, 0, n_refs, node->bbox, centroid_bbox);
+    Float object_min = 0.0, object_scale = 0.0;
+    if (object_split.axis != -1) {
+        object_min = centroid_bbox.min_corner[object_split.axis];
+        object_scale = ctx.config.n_bins / (centroid_bbox.max_corner[object_split.axis] - object_min);
+    }
+    auto object_goes_left = [&](const BVHPrimitive &ref) {
+        return bin_index(ref.centroid[object_split.axis], object_min, object_scale, ctx.config.n_bins) <= object_split.bin;
+    };
+
+    SpatialSplit spatial_split{};
+    if (n_refs > 1 && ctx.refs_budget > 0 && ctx.root_area > 0.0) {
+        // spatial splits only pay off where the children of the object split overlap a lot.
+        // coinciding centroids (no object split at all) are the extreme case of that
+        Float overlap = ctx.root_area;
+        if (object_split.axis != -1) {
+            AABB left_bbox = AABB::empty(), right_bbox = AABB::empty();
+            for (const auto &ref : refs) {
+                if (object_goes_left(ref))
+                    left_bbox = left_bbox + ref.bbox;
+                else
+                    right_bbox = right_bbox + ref.bbox;
+            }
+            AABB overlap_bbox = left_bbox.intersection(right_bbox);
+            overlap = overlap_bbox.is_empty() ? 0.0 : overlap_bbox.surface_area();
+        }
+        if (overlap / ctx.root_area > ctx.config.sbvh_alpha)
+            spatial_split = find_spatial_split(ctx, refs, node->bbox);
+    }
+
+    Float leaf_cost = ctx.config.leaf_cost(n_refs);
+    Float split_cost = std::min(object_split.cost, spatial_split.cost);
+    bool make_leaf = split_cost == INFINITY || (n_refs <= static_cast<size_t>(ctx.config.max_leaf_size) && leaf_cost <= split_cost);
+
+    std::vector<BVHPrimitive> left_refs, right_refs;
+    if (!make_leaf && spatial_split.cost < object_split.cost) {
+        partition_spatial(ctx, refs, spatial_split, left_refs, right_refs);
+        node->split_axis = spatial_split.axis;
+        // rounding may send everything to one side; fall back to the object split then
+        if (left_refs.empty() || right_refs.empty()) {
+            left_refs.clear();
+            right_refs.clear();
+            make_leaf = object_split.axis == -1;
+        }
+    }
+    if (!make_leaf && left_refs.empty()) {
+        size_t mid = std::partition(refs.begin(), refs.end(), object_goes_left) - refs.begin();
+        left_refs.assign(refs.begin(), refs.begin() + mid);
+        right_refs.assign(refs.begin() + mid, refs.end());
+        node->split_axis = object_split.axis;
+    }
+    if (make_leaf) {
+        node->geoms.reserve(n_refs);
+        for (const auto &ref : refs)
+            node->geoms.push_back(ref.geom);
+        return node;
+    }
+
+    // the references of this node aren't needed anymore; free them before going deeper
+    std::vector<BVHPrimitive>().swap(refs);
+    node->left = build_sbvh_recursive(ctx, left_refs);
+    node->right = build_sbvh_recursive(ctx, right_refs);
+    return node;
+}
+}  // namespace
+
+BVHNode *build_bvh_sbvh(const std::vector<Geometry *> &geoms, const BVHBuildConfig &config) {
+    if (geoms.empty())
+        return nullptr;
+
+    std::vector<BVHPrimitive> refs(geoms.size());
+    AABB root_bbox = AABB::empty();
+    for (size_t i = 0; i < geoms.size(); i++) {
+        refs[i] = make_ref(geoms[i]->get_bbox(), geoms[i]);
+        root_bbox = root_bbox + refs[i].bbox;
+    }
+    size_t max_refs = static_cast<size_t>(config.sbvh_budget * geoms.size());
+    SBVHBuildContext ctx{config, root_bbox.surface_area(), max_refs > geoms.size() ? max_refs - geoms.size() : 0};
+    return build_sbvh_recursive(ctx, refs);
+}
+
+namespace {
+/// bits per axis of the Morton codes. 3 * 10 bits fit in 32 bits
+constexpr int MORTON_BITS = 10;
+constexpr int MORTON_CODE_BITS = 3 * MORTON_BITS;
+/// the primitives sharing the highest bits of their codes form a treelet, which is built as one task
+constexpr int TREELET_BITS = 12;
+/// bits sorted per radix sort pass
+constexpr int RADIX_BITS = 10;
+
+struct MortonPrimitive {
+    uint32_t code;
+    uint32_t index;
+};
+
+/// spread the lower 10 bits of v so that there are two zero bits between each of them
+inline uint32_t expand_bits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+/// the codes interleave the bits as ...xyzxyz, so bit 0 belongs to z
+inline int axis_of_bit(int bit) {
+    return 2 - bit % 3;
+}
+
+/// Stable LSD radix sort by code. Every pass counts the digits per chunk in parallel and then scatters the
+/// chunks in parallel; the offsets are laid out digit-major and chunk-minor, which keeps the order of equal digits.
+void radix_sort(std::vector<MortonPrimitive> &prims, TaskPool &pool) {
+    constexpr size_t n_buckets = size_t{1} << RADIX_BITS;
+    std::vector<MortonPrimitive> tmp(prims.size());
+    std::vector<std::vector<size_t>> offsets(pool.size());
+    for (int shift = 0; shift < MORTON_CODE_BITS; shift += RADIX_BITS) {
+        size_t n_chunks = pool.parallel_for_chunks(0, prims.size(), [&](size_t chunk_begin, size_t chunk_end, size_t chunk) {
+            offsets[chunk].assign(n_buckets, 0);
+            for (size_t i = chunk_begin; i < chunk_end; i++)
+                offsets[chunk][(prims[i].code >> shift) & (n_buckets - 1)]++;
+        });
+        size_t offset = 0;
+        for (size_t bucket = 0; bucket < n_buckets; bucket++)
+            for (size_t chunk = 0; chunk < n_chunks; chunk++) {
+                size_t count = offsets[chunk][bucket];
+                offsets[chunk][bucket] = offset;
+                offset += count;
+            }
+        // the chunks are the same as in the counting pass, since the range and the pool are
+        pool.parallel_for_chunks(0, prims.size(), [&](size_t chunk_begin, size_t chunk_end, size_t chunk) {
+            for (size_t i = chunk_begin; i < chunk_end; i++)
+                tmp[offsets[chunk][(prims[i].code >> shift) & (n_buckets - 1)]++] = prims[i];
+        });
+        std::swap(prims, tmp);
+    }
+}
+
+struct LBVHBuildContext {
+    /// the primitives in Morton order, and their codes
+    const std::vector<BVHPrimitive> &prims;
+    const std::vector<uint32_t> &codes;
+    const BVHBuildConfig &config;
+};
+
+/// Build the subtree over prims[begin, end), whose codes are equal above `bit`, by splitting where `bit` changes.
+/// The split is found with a binary search, since the codes are sorted.
+BVHNode *build_lbvh_recursive(const LBVHBuildContext &ctx, size_t begin, size_t end, int bit) {
+    size_t n_prims = end - begin;
+    if (n_prims <= static_cast<size_t>(ctx.config.max_leaf_size)) {
+        auto node = new BVHNode{};
+        node->bbox = AABB::empty();
+        node->geoms.reserve(n_prims);
+        for (size_t i = begin; i < end; i++) {
+            node->bbox = node->bbox + ctx.prims[i].bbox;
+            node->geoms.push_back(ctx.prims[i].geom);
+        }
+        return node;
+    }
+
+    size_t mid;
+    int axis;
+    if (bit < 0) {
+        // all codes are equal. Split in the middle to keep the leaves small
+        mid = begin + n_prims / 2;
+        axis = 0;
+    } else {
+        uint32_t mask = uint32_t{1} << bit;
+        // the bit doesn't change in this range, so there's nothing to split on it
+        if ((ctx.codes[begin] & mask) == (ctx.codes[end - 1] & mask))
+            return build_lbvh_recursive(ctx, begin, end, bit - 1);
+        mid = std::partition_point(ctx.codes.begin() + begin, ctx.codes.begin() + end, [mask](uint32_t code) { return (code & mask) == 0; }) - ctx.codes.begin();
+        axis = axis_of_bit(bit);
+    }
+
+    auto node = new BVHNode{};
+    node->split_axis = axis;
+    node->left = build_lbvh_recursive(ctx, begin, mid, bit - 1);
+    node->right = build_lbvh_recursive(ctx, mid, end, bit - 1);
+    node->bbox = node->left->bbox + node->right->bbox;
+    return node;
+}
+
+/// Join the treelets[begin, end) with a binned SAH build over their bounds. There are at most 2^TREELET_BITS treelets, so this is cheap
+BVHNode *build_lbvh_upper(std::vector<BVHNode *> &treelets, size_t begin, size_t end, const BVHBuildConfig &config) {
+    if (end - begin == 1)
+        return treelets[begin];
+
+    AABB bbox = AABB::empty(), centroid_bbox = AABB::empty();
+    for (size_t i = begin; i < end; i++) {
+        bbox = bbox + treelets[i]->bbox;
+        Vec3f centroid = treelets[i]->bbox.centroid();
+        centroid_bbox = centroid_bbox + AABB{centroid, centroid};
+    }
+
+    const int n_bins = config.n_bins;
+    SAHSplit best{};
+    std::vector<SAHBin> bins(n_bins);
+    std::vector<Float> right_area(n_bins);
+    std::vector<int> right_count(n_bins);
+    for (int axis = 0; axis < 3; axis++) {
+        Float extent = centroid_bbox.max_corner[axis] - centroid_bbox.min_corner[axis];
+        if (extent <= 0.0)
+            continue;
+        Float scale = n_bins / extent;
+        bins.assign(n_bins, SAHBin{});
+        for (size_t i = begin; i < end; i++) {
+            auto &bin = bins[bin_index(treelets[i]->bbox.centroid()[axis], centroid_bbox.min_corner[axis], scale, n_bins)];
+            bin.count++;
+            bin.bbox = bin.bbox + treelets[i]->bbox;
+        }
+        AABB acc = AABB::empty();
+        int count = 0;
+        for (int b = n_bins - 1; b > 0; b--) {
+            acc = acc + bins[b].bbox;
+            count += bins[b].count;
+            right_area[b - 1] = acc.surface_area();
+            right_count[b - 1] = count;
+        }
+        acc = AABB::empty();
+        count = 0;
+        for (int b = 0; b < n_bins - 1; b++) {
+            acc = acc + bins[b].bbox;
+            count += bins[b].count;
+            if (count == 0 || right_count[b] == 0)
+                continue;
+            Float cost = count * acc.surface_area() + right_count[b] * right_area[b];
+            if (cost < best.cost) {
+                best.axis = axis;
+                best.bin = b;
+                best.cost = cost;
+            }
+        }
+    }
+
+    size_t mid;
+    if (best.axis == -1) {
+        // all treelet centroids coincide
+        mid = begin + (end - begin) / 2;
+        best.axis = 0;
+    } else {
+        Float min = centroid_bbox.min_corner[best.axis];
+        Float scale = n_bins / (centroid_bbox.max_corner[best.axis] - min);
+        mid = std::partition(treelets.begin() + begin, treelets.begin() + end, [&](const BVHNode *treelet) {
+                  return bin_index(treelet->bbox.centroid()[best.axis], min, scale, n_bins) <= best.bin;
+              }) - treelets.begin();
+    }
+
+    auto node = new BVHNode{};
+    node->split_axis = best.axis;
+    node->left = build_lbvh_upper(treelets, begin, mid, config);
+    node->right = build_lbvh_upper(treelets, mid, end, config);
+    node->bbox = bbox;
+    return node;
+}
+}  // namespace
+
+BVHNode *build_bvh_lbvh(const std::vector<Geometry *> &geoms, const BVHBuildConfig &config, uint32_t n_threads) {
+    if (geoms.empty())
+        return nullptr;
+
+    TaskPool pool{n_threads};
+    std::vector<BVHPrimitive> prims(geoms.size());
+    std::vector<AABB> chunk_centroid_bboxes(pool.size());
+    size_t n_chunks = pool.parallel_for_chunks(0, prims.size(), [&](size_t chunk_begin, size_t chunk_end, size_t chunk) {
+        AABB centroid_bbox = AABB::empty();
+        for (size_t i = chunk_begin; i < chunk_end; i++) {
+            prims[i].bbox = geoms[i]->get_bbox();
+            prims[i].centroid = prims[i].bbox.centroid();
+            prims[i].geom = geoms[i];
+            centroid_bbox = centroid_bbox + AABB{prims[i].centroid, prims[i].centroid};
+        }
+        chunk_centroid_bboxes[chunk] = centroid_bbox;
+    });
+    AABB centroid_bbox = AABB::empty();
+    for (size_t chunk = 0; chunk < n_chunks; chunk++)
+        centroid_bbox = centroid_bbox + chunk_centroid_bboxes[chunk];
+
+    // quantize the centroids to a 2^10 grid over their bounds and sort them along the Z-order curve
+    std::vector<MortonPrimitive> morton_prims(prims.size());
+    Vec3f extent = centroid_bbox.max_corner - centroid_bbox.min_corner;
+    pool.parallel_for_chunks(0, prims.size(), [&](size_t chunk_begin, size_t chunk_end, size_t) {
+        constexpr Float grid_size = 1 << MORTON_BITS;
+        for (size_t i = chunk_begin; i < chunk_end; i++) {
+            uint32_t cell[3];
+            for (int axis = 0; axis < 3; axis++) {
+                Float offset = extent[axis] > 0.0 ? (prims[i].centroid[axis] - centroid_bbox.min_corner[axis]) / extent[axis] : 0.0;
+                cell[axis] = static_cast<uint32_t>(std::clamp(offset * grid_size, Float(0.0), grid_size - 1));
+            }
+            morton_prims[i] = {(expand_bits(cell[0]) << 2) | (expand_bits(cell[1]) << 1) | expand_bits(cell[2]), static_cast<uint32_t>(i)};
+        }
+    });
+    radix_sort(morton_prims, pool);
+
+    std::vector<BVHPrimitive> sorted_prims(prims.size());
+    std::vector<uint32_t> codes(prims.size());
+    pool.parallel_for_chunks(0, prims.size(), [&](size_t chunk_begin, size_t chunk_end, size_t) {
+        for (size_t i = chunk_begin; i < chunk_end; i++) {
+            sorted_prims[i] = prims[morton_prims[i].index];
+            codes[i] = morton_prims[i].code;
+        }
+    });
+    prims.clear();
+    prims.shrink_to_fit();
+
+    // treelets are the runs of equal high bits. Build them in parallel, then join them with the SAH
+    constexpr int treelet_shift = MORTON_CODE_BITS - TREELET_BITS;
+    std::vector<size_t> treelet_begins{0};
+    for (size_t i = 1; i < codes.size(); i++)
+        if ((codes[i] >> treelet_shift) != (codes[i - 1] >> treelet_shift))
+            treelet_begins.push_back(i);
+    treelet_begins.push_back(codes.size());
+
+    LBVHBuildContext ctx{sorted_prims, codes, config};
+    std::vector<BVHNode *> treelets(treelet_begins.size() - 1);
+    std::vector<std::future<void>> results;
+    results.reserve(treelets.size());
+    for (size_t t = 0; t < treelets.size(); t++)
+        results.emplace_back(pool.submit([&ctx, &treelets, &treelet_begins, t] {
+            treelets[t] = build_lbvh_recursive(ctx, treelet_begins[t], treelet_begins[t + 1], treelet_shift - 1);
+        }));
+    for (auto &result : results)
+        pool.wait(result);
+
+    return build_lbvh_upper(treelets, 0, treelets.size(), config);
+}
+
+void delete_bvh_tree(BVHNode *node) {
+    if (node == nullptr)
+        return;
+    delete_bvh_tree(node->left);
+    delete_bvh_tree(node->right);
+    delete node;
+}
+
+void collect_bvh_geoms(const BVHNode *node, std::vector<Geometry *> &geoms) {
+    if (node == nullptr)
+        return;
+    geoms.insert(geoms.end(), node->geoms.begin(), node->geoms.end());
+    collect_bvh_geoms(node->left, geoms);
+    collect_bvh_geoms(node->right, geoms);
+}
+
+namespace {
+AABB bbox_of(const std::vector<Geometry *> &geoms, size_t begin, size_t end) {
+    AABB bbox = AABB::empty();
+    for (size_t i = begin; i < end; i++)
+        bbox = bbox + geoms[i]->get_bbox();
+    return bbox;
+}
+
+/// emit the leaf for geoms[begin, end). Leaves hold at most UINT16_MAX geometries, so larger ones are split by count.
+void flatten_leaf(BVH &bvh, const std::vector<Geometry *> &geoms, size_t begin, size_t end, const AABB &bbox) {
+    size_t node_idx = bvh.nodes.size();
+    bvh.nodes.emplace_back();
+    bvh.nodes[node_idx].bbox = bbox;
+    if (end - begin <= UINT16_MAX) {
+        pad_for_leaf(bvh.primitives, end - begin);
+        bvh.nodes[node_idx].primitives_offset = static_cast<uint32_t>(bvh.primitives.size());
+        bvh.nodes[node_idx].n_primitives = static_cast<uint16_t>(end - begin);
+        bvh.primitives.insert(bvh.primitives.end(), geoms.begin() + begin, geoms.begin() + end);
+        return;
+    }
+    size_t mid = begin + (end - begin) / 2;
+    bvh.nodes[node_idx].n_primitives = 0;
+    bvh.nodes[node_idx].axis = 0;
+    flatten_leaf(bvh, geoms, begin, mid, bbox_of(geoms, begin, mid));
+    bvh.nodes[node_idx].second_child_offset = static_cast<uint32_t>(bvh.nodes.size());
+    flatten_leaf(bvh, geoms, mid, end, bbox_of(geoms, mid, end));
+}
+
+// oversized leaves are split by flatten_leaf into at most this many extra levels (2^16 * UINT16_MAX > UINT32_MAX)
+constexpr int LEAF_SPLIT_DEPTH = 16;
+
+void flatten(BVH &bvh, const BVHNode *node, int depth) {
+    bool is_leaf = node->left == nullptr && node->right == nullptr;
+    if (is_leaf || depth >= BVH::MAX_DEPTH - LEAF_SPLIT_DEPTH) {
+        std::vector<Geometry *> geoms{};
+        collect_bvh_geoms(node, geoms);
+        flatten_leaf(bvh, geoms, 0, geoms.size(), node->bbox);
+        return;
+    }
+    // the builders only create interior nodes with two children, but be tolerant to a missing one
+    if (node->left == nullptr || node->right == nullptr) {
+        flatten(bvh, node->left ? node->left : node->right, depth);
+        return;
+    }
+
+    size_t node_idx = bvh.nodes.size();
+    bvh.nodes.emplace_back();
+    bvh.nodes[node_idx].bbox = node->bbox;
+    bvh.nodes[node_idx].n_primitives = 0;
+    bvh.nodes[node_idx].axis = static_cast<uint8_t>(node->split_axis);
+    flatten(bvh, node->left, depth + 1);
+    bvh.nodes[node_idx].second_child_offset = static_cast<uint32_t>(bvh.nodes.size());
+    flatten(bvh, node->right, depth + 1);
+}
+
+/// the per-ray data of the slab test, computed once per traversal instead of dividing at every node
+struct RayBoxData {
+    Vec3f inv_d;
+    /// whether the direction is negative along each axis, i.e. the ray enters through the max corner
+    bool dir_is_neg[3];
+
+    explicit RayBoxData(const Ray &ray) {
+        // a zero component gives an infinite inverse, which the slab test handles
+        inv_d = Vec3f{Float(1.0) / ray.d.x, Float(1.0) / ray.d.y, Float(1.0) / ray.d.z};
+        for (int axis = 0; axis < 3; axis++)
+            dir_is_neg[axis] = inv_d[axis] < 0.0;
+    }
+};
+
+/// slab test of the box against [ray.tmin, ray.tmax]. The exit distances are enlarged by the rounding error of their computation,
+/// so a box is never missed by a ray that hits a triangle on its boundary (which would leak through a watertight mesh)
+inline bool intersect_bbox(const AABB &bbox, const Ray &ray, const RayBoxData &rb) {
+    constexpr Float exit_scale = 1 + 2 * rounding_gamma(3);
+    Float tmin = ray.tmin;
+    Float tmax = ray.tmax;
+    for (int axis = 0; axis < 3; axis++) {
+        Float t0 = ((rb.dir_is_neg[axis] ? bbox.max_corner : bbox.min_corner)[axis] - ray.o[axis]) * rb.inv_d[axis];
+        Float t1 = ((rb.dir_is_neg[axis] ? bbox.min_corner : bbox.max_corner)[axis] - ray.o[axis]) * rb.inv_d[axis] * exit_scale;
+        // written so that a NaN (0 * inf, the origin lying on a slab of a parallel ray) never rejects the box
+        if (t0 > tmin)
+            tmin = t0;
+        if (t1 < tmax)
+            tmax = t1;
+        if (tmin > tmax)
+            return false;
+    }
+    return true;
+}
+}  // namespace
+
+#ifdef BVH_STATS
+BVHTraversalStats bvh_traversal_stats{};
+
+std::string BVHTraversalStats::to_string() const {
+    uint64_t n_rays = rays.load();
+    if (n_rays == 0)
+        return "BVH traversal: no rays traced";
+    return std::format("BVH traversal: {} rays, {:.2f} nodes visited per ray, {:.2f} primitive tests per ray",
+                       n_rays, double(nodes_visited.load()) / n_rays, double(primitive_tests.load()) / n_rays);
+}
+#endif
+
+BVH::BVH(BVHNode *root) {
+    if (root == nullptr)
+        return;
+    flatten(*this, root, 0);
+    nodes.shrink_to_fit();
+    primitives.shrink_to_fit();
+    leaf_primitives = make_leaf_primitives(primitives, watertight);
+    delete_bvh_tree(root);
+}
+
+void BVH::set_watertight(bool watertight) {
+    if (watertight == this->watertight)
+        return;
+    this->watertight = watertight;
+    leaf_primitives = make_leaf_primitives(primitives, watertight, leaf_primitives.compact);
+}
+
+void BVH::compress() {
+    if (!leaf_primitives.compact)
+        leaf_primitives = make_leaf_primitives(primitives, watertight, true);
+}
+
+bool BVH::intersect(const Ray &ray, Intersection &isc) const {
+    if (nodes.empty())
+        return false;
+
+    // tmax shrinks with every hit, culling the nodes behind the closest hit found so far.
+    // visiting the near child first makes that happen as early as possible
+    Ray r{ray};
+    const RayBoxData rb{ray};
+    const WatertightRay wr{ray};
+    bool is_hit = false;
+    uint32_t stack[MAX_DEPTH];
+    int stack_size = 0;
+    uint32_t current = 0;
+    [[maybe_unused]] uint64_t n_nodes_visited = 0, n_primitive_tests = 0;
+    while (true) {
+        const LinearBVHNode &node = nodes[current];
+        n_nodes_visited++;
+        if (intersect_bbox(node.bbox, r, rb)) {
+            if (node.n_primitives > 0) {
+                n_primitive_tests += node.n_primitives;
+                if (intersect_leaf(primitives, leaf_primitives, node.primitives_offset, node.primitives_offset + node.n_primitives, r, watertight ? &wr : nullptr, isc))
+                    is_hit = true;
+            } else {
+                // the left child holds the lower side of the split, so it's the far one for a ray going in the negative direction
+                if (near_first && rb.dir_is_neg[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.second_child_offset;
+                } else {
+                    stack[stack_size++] = node.second_child_offset;
+                    current++;
+                }
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+#ifdef BVH_STATS
+    bvh_traversal_stats.add_ray(n_nodes_visited, n_primitive_tests);
+#endif
+    return is_hit;
+}
+
+uint32_t BVH::intersect_packet(const Ray *rays, int n, Intersection *iscs) const {
+    if (nodes.empty())
+        return 0;
+
+    // every node is visited once for the rays that hit its parent. The interval test rejects it for the whole packet with one
+    // scalar test, which is enough for most of the nodes the rays miss, before the rays are tested at once
+    RayPacket packet{rays, n};
+    uint32_t hit_rays = 0;
+    struct StackEntry {
+        uint32_t node;
+        uint32_t rays;
+    };
+    StackEntry stack[MAX_DEPTH];
+    int stack_size = 0;
+    uint32_t current = 0;
+    uint32_t active = packet.valid;
+    while (true) {
+        const LinearBVHNode &node = nodes[current];
+        alignas(32) Float t_near[RAY_PACKET_SIZE];
+        if (!packet_misses_box(packet, node.bbox.min_corner, node.bbox.max_corner) &&
+            (active = intersect_box_packet(packet, node.bbox.min_corner, node.bbox.max_corner, active, t_near)) != 0) {
+            if (node.n_primitives > 0) {
+                hit_rays |= intersect_leaf_packet(primitives, leaf_primitives, node.primitives_offset, node.primitives_offset + node.n_primitives,
+                                                  rays, packet, active, watertight, iscs);
+            } else {
+                // the children are ordered for the first active ray, as the rays are coherent
+                if (near_first && packet.dir_is_neg(std::countr_zero(active), node.axis)) {
+                    stack[stack_size++] = {current + 1, active};
+                    current = node.second_child_offset;
+                } else {
+                    stack[stack_size++] = {node.second_child_offset, active};
+                    current++;
+                }
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            break;
+        stack_size--;
+        current = stack[stack_size].node;
+        active = stack[stack_size].rays;
+    }
+    return hit_rays;
+}
+
+bool BVH::occluded(const Ray &ray) const {
+    if (nodes.empty())
+        return false;
+
+    // any hit will do, so there is no need to order the children or shrink tmax
+    const RayBoxData rb{ray};
+    const WatertightRay wr{ray};
+    uint32_t stack[MAX_DEPTH];
+    int stack_size = 0;
+    uint32_t current = 0;
+    while (true) {
+        const LinearBVHNode &node = nodes[current];
+        if (intersect_bbox(node.bbox, ray, rb)) {
+            if (node.n_primitives > 0) {
+                if (occluded_leaf(primitives, leaf_primitives, node.primitives_offset, node.primitives_offset + node.n_primitives, ray, watertight ? &wr : nullptr))
+                    return true;
+            } else {
+                stack[stack_size++] = node.second_child_offset;
+                current++;
+                continue;
+            }
+        }
+        if (stack_size == 0)
+            break;
+        current = stack[--stack_size];
+    }
+    return false;
+}
+
+Float BVH::sah_cost(const BVHBuildConfig &config) const {
+    if (nodes.empty())
+        return 0.0;
+    Float root_area = nodes[0].bbox.surface_area();
+    if (root_area <= 0.0)
+        return 0.0;
+
+    Float cost = 0.0;
+    for (const auto &node : nodes) {
+        Float relative_area = node.bbox.surface_area() / root_area;
+        if (node.n_primitives > 0)
+            cost += relative_area * config.leaf_cost(node.n_primitives);
+        else
+            cost += relative_area * config.traversal_cost;
+    }
+    return cost;
+}
+
+size_t BVH::memory_footprint() const {
+    return nodes.capacity() * sizeof(LinearBVHNode) + primitives.capacity() * sizeof(Geometry *) + leaf_primitives.memory_footprint();
+}
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <vector>
 
 #include "core/Thread.h"
 
@@ -50,9 +51,42 @@ void SamplingIntegrator::render(const Scene *scene, Sensor *sensor, uint32_t n_t
                 tpool.enqueue([this, block_row, block_col, scene, sensor, &print_mutex, &n_rendered_pixels, total_pixels, block_size, width, height, show_progress](Sampler &sampler) {
                     uint32_t row_bound = std::min(block_size, height - block_row * block_size);
                     uint32_t col_bound = std::min(block_size, width - block_col * block_size);
+                    auto commit = [sensor](Vec3f returned_radiance, uint32_t row, uint32_t col, Float px, Float py) {
+                        // check for invalid values
+                        if (!check_valid(returned_radiance)) {
+                            // throw std::runtime_error("Invalid radiance value: " + std::to_string(returned_radiance.x) + ", " + std::to_string(returned_radiance.y) + ", " + std::to_string(returned_radiance.z) + " at pixel (" + std::to_string(row) + ", " + std::to_string(col) + ")");
+                            std::cout << "\ninvalid radiance value. considering it zero: " << returned_radiance << ". (row=" << row << ", col=" << col << ")\n";
+                            returned_radiance = Vec3f{0};
+                        }
+
+                        sensor->film.commit_sample(returned_radiance, row, col, px, py);
+                    };
+                    const bool primary_packets = this->trace_primary_packets();
+                    std::vector<Ray> rays;
+                    rays.reserve(RAY_PACKET_SIZE);
                     for (size_t inblock_row = 0; inblock_row < row_bound; inblock_row++) {
+                        uint32_t row = inblock_row + block_size * block_row;
+                        if (primary_packets) {
+                            // the camera rays of RAY_PACKET_SIZE neighbouring pixels of the row are traced together, a sample of each at a time
+                            for (size_t packet_col = 0; packet_col < col_bound; packet_col += RAY_PACKET_SIZE) {
+                                const int n = static_cast<int>(std::min<size_t>(RAY_PACKET_SIZE, col_bound - packet_col));
+                                const uint32_t first_col = packet_col + block_size * block_col;
+                                for (size_t i = 0; i < sensor->sampler.spp; i++) {
+                                    Float px[RAY_PACKET_SIZE], py[RAY_PACKET_SIZE];
+                                    rays.clear();
+                                    for (int k = 0; k < n; k++)
+                                        rays.push_back(sensor->sample_ray(row, first_col + k, sampler.get_2D(), px[k], py[k]));
+                                    Intersection iscs[RAY_PACKET_SIZE];
+                                    const uint32_t hit_rays = scene->ray_intersect_packet(rays.data(), n, iscs);
+                                    for (int k = 0; k < n; k++) {
+                                        Vec3f returned_radiance = this->sample_radiance_primary(scene, &sampler, rays[k], (hit_rays >> k) & 1u, iscs[k], row, first_col + k);
+                                        commit(returned_radiance, row, first_col + k, px[k], py[k]);
+                                    }
+                                }
+                            }
+                            continue;
+                        }
                         for (size_t inblock_col = 0; inblock_col < col_bound; inblock_col++) {
-                            uint32_t row = inblock_row + block_size * block_row;
                             uint32_t col = inblock_col + block_size * block_col;
 
                             for (size_t i = 0; i < sensor->sampler.spp; i++) {
@@ -60,15 +94,7 @@ void SamplingIntegrator::render(const Scene *scene, Sensor *sensor, uint32_t n_t
                                 Float px, py;
                                 Ray sensor_ray = sensor->sample_ray(row, col, sampler.get_2D(), px, py);
                                 Vec3f returned_radiance = this->sample_radiance(scene, &sampler, sensor_ray, row, col);
-
-                                // check for invalid values
-                                if (!check_valid(returned_radiance)) {
-                                    // throw std::runtime_error("Invalid radiance value: " + std::to_string(returned_radiance.x) + ", " + std::to_string(returned_radiance.y) + ", " + std::to_string(returned_radiance.z) + " at pixel (" + std::to_string(row) + ", " + std::to_string(col) + ")");
-                                    std::cout << "\ninvalid radiance value. considering it zero: " << returned_radiance << ". (row=" << row << ", col=" << col << ")\n";
-                                    returned_radiance = Vec3f{0};
-                                }
-
-                                sensor->film.commit_sample(returned_radiance, row, col, px, py);
+                                commit(returned_radiance, row, col, px, py);
                             }
                         }
                     }
@@ -139,3 +139,79 @@ Mat4f get_rotation_matrix(const Vec3f &axis, Float angle) {
 
     return rot_mat;
 }
+
+bool is_similarity(const Mat4f &transform, Float &scale) {
+    constexpr Float tolerance = 1e-4;
+    // the bottom row of an affine transform is (0, 0, 0, 1)
+    if (transform[0][3] != 0.0 || transform[1][3] != 0.0 || transform[2][3] != 0.0 || transform[3][3] != 1.0)
+        return false;
+    const Vec3f x{transform[0]}, y{transform[1]}, z{transform[2]};
+    scale = glm::length(x);
+    if (scale == 0.0)
+        return false;
+    // the columns of the 3x3 part have the same length and are orthogonal
+    const Float scale2 = Sqr(scale);
+    return std::abs(glm::dot(y, y) - scale2) <= tolerance * scale2 && std::abs(glm::dot(z, z) - scale2) <= tolerance * scale2 &&
+           std::abs(glm::dot(x, y)) <= tolerance * scale2 && std::abs(glm::dot(x, z)) <= tolerance * scale2 && std::abs(glm::dot(y, z)) <= tolerance * scale2;
+}
+
+uint32_t encode_octahedral(const Vec3f &v) {
+    const Float l1 = std::abs(v.x) + std::abs(v.y) + std::abs(v.z);
+    if (l1 == 0.0)
+        return encode_octahedral(Vec3f{0.0, 0.0, 1.0});
+    // project onto the octahedron |x| + |y| + |z| = 1 and unfold the lower half
+    Float x = v.x / l1, y = v.y / l1;
+    if (v.z < 0.0) {
+        const Float folded_x = (1 - std::abs(y)) * (x >= 0.0 ? 1 : -1);
+        y = (1 - std::abs(x)) * (y >= 0.0 ? 1 : -1);
+        x = folded_x;
+    }
+    const Float qx = (glm::clamp(x, Float(-1.0), Float(1.0)) + 1) * Float(0.5 * 65535.0);
+    const Float qy = (glm::clamp(y, Float(-1.0), Float(1.0)) + 1) * Float(0.5 * 65535.0);
+    const Vec3f n = glm::normalize(v);
+    uint32_t best = 0;
+    Float best_dot = -2.0;
+    for (Float ux : {std::floor(qx), std::ceil(qx)}) {
+        for (Float uy : {std::floor(qy), std::ceil(qy)}) {
+            const uint32_t packed = static_cast<uint32_t>(std::min(ux, Float(65535.0))) | static_cast<uint32_t>(std::min(uy, Float(65535.0))) << 16;
+            const Float d = glm::dot(decode_octahedral(packed), n);
+            if (d > best_dot) {
+                best_dot = d;
+                best = packed;
+            }
+        }
+    }
+    return best;
+}
+
+uint16_t float_to_half(float f) {
+    const uint32_t bits = std::bit_cast<uint32_t>(f);
+    const uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+    const uint32_t abs_bits = bits & 0x7FFFFFFF;
+    if (abs_bits > 0x7F800000)
+        return sign | 0x7E00;  // NaN
+    // 65520 and up round past the largest half, 65504
+    if (abs_bits >= 0x477FF000)
+        return sign | 0x7C00;
+    // below half the smallest subnormal, 2^-25
+    if (abs_bits < 0x33000000)
+        return sign;
+    uint32_t half, rest, halfway;
+    if (abs_bits < 0x38800000) {
+        // subnormal: the mantissa with its implicit bit, in units of 2^-24
+        const uint32_t shift = 126 - (abs_bits >> 23);
+        const uint32_t mantissa = (abs_bits & 0x7FFFFF) | 0x800000;
+        half = mantissa >> shift;
+        rest = mantissa & ((1u << shift) - 1);
+        halfway = 1u << (shift - 1);
+    } else {
+        // rebias the exponent from 127 to 15 and drop 13 bits of the mantissa
+        half = (abs_bits - 0x38000000) >> 13;
+        rest = abs_bits & 0x1FFF;
+        halfway = 0x1000;
+    }
+    // a carry out of the mantissa correctly bumps the exponent
+    if (rest > halfway || (rest == halfway && (half & 1)))
+        half++;
+    return sign | static_cast<uint16_t>(half);
+}
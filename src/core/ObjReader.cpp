@@ -0,0 +1,306 @@
+#include "core/ObjReader.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#include "core/Thread.h"
+#include "utils/MappedFile.h"
+
+namespace {
+
+/// chunks are at least this large, so small files are parsed by a single thread
+constexpr size_t MIN_CHUNK_BYTES = 1 << 20;
+/// index of a corner attribute that isn't given
+constexpr int64_t MISSING = std::numeric_limits<int64_t>::min();
+
+/// @brief A face corner, with 0-based indices into the positions, texcoords and normals.
+/// Negative (relative) OBJ indices can only be resolved against the counts of the chunk being parsed; their bit in `relative`
+/// is set and the offset of the chunk is added when the chunks are merged.
+struct ObjCorner {
+    int64_t vertex, texcoord, normal;
+    /// bit 0, 1, 2 for vertex, texcoord, normal
+    uint8_t relative;
+};
+
+/// what a thread parsed from its lines of the file
+struct ObjChunk {
+    std::vector<Vec3f> positions{}, normals{};
+    std::vector<Vec2f> texcoords{};
+    /// three corners per triangle
+    std::vector<ObjCorner> corners{};
+    /// the first triangle of every quad (see TriangleMesh::quads), counted from the first triangle of the chunk
+    std::vector<uint32_t> quads{};
+    /// whether every corner has a normal
+    bool all_normals = true;
+    /// the first line that couldn't be parsed, empty if there's none
+    std::string error{};
+};
+
+/// an OBJ face corner indexes the positions, normals and texcoords separately. Every distinct combination becomes one vertex of the mesh
+struct ObjVertexKey {
+    int64_t vertex, normal, texcoord;
+    bool operator==(const ObjVertexKey &) const = default;
+};
+
+struct ObjVertexKeyHash {
+    size_t operator()(const ObjVertexKey &key) const {
+        uint64_t h = static_cast<uint64_t>(key.vertex) * 0x9E3779B97F4A7C15ull;
+        h ^= (static_cast<uint64_t>(key.normal) << 32 | static_cast<uint32_t>(key.texcoord)) + (h << 6) + (h >> 2);
+        return std::hash<uint64_t>{}(h);
+    }
+};
+
+inline bool is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+inline void skip_spaces(const char *&p, const char *end) {
+    while (p < end && is_space(*p))
+        p++;
+}
+
+bool parse_float(const char *&p, const char *end, Float &value) {
+    skip_spaces(p, end);
+    if (p < end && *p == '+')
+        p++;
+    auto [ptr, ec] = std::from_chars(p, end, value);
+    if (ec != std::errc{})
+        return false;
+    p = ptr;
+    return true;
+}
+
+/// parse "v", "v/vt", "v//vn" or "v/vt/vn". counts are the numbers of positions, texcoords and normals parsed so far in the chunk
+bool parse_corner(const char *&p, const char *end, const size_t counts[3], ObjCorner &corner) {
+    int64_t raw[3] = {0, 0, 0};
+    for (int k = 0; k < 3; k++) {
+        if (k > 0) {
+            if (p == end || *p != '/')
+                break;
+            p++;
+            // "v//vn" has no texcoord
+            if (k == 1 && p < end && *p == '/')
+                continue;
+        }
+        auto [ptr, ec] = std::from_chars(p, end, raw[k]);
+        if (ec != std::errc{} || raw[k] == 0)
+            return false;
+        p = ptr;
+    }
+    if (p < end && !is_space(*p))
+        return false;
+    int64_t *resolved[3] = {&corner.vertex, &corner.texcoord, &corner.normal};
+    corner.relative = 0;
+    for (int k = 0; k < 3; k++) {
+        if (raw[k] > 0) {
+            *resolved[k] = raw[k] - 1;
+        } else if (raw[k] < 0) {
+            *resolved[k] = static_cast<int64_t>(counts[k]) + raw[k];
+            corner.relative |= 1 << k;
+        } else {
+            *resolved[k] = MISSING;
+        }
+    }
+    return true;
+}
+
+bool parse_line(const char *p, const char *end, ObjChunk &chunk, std::vector<ObjCorner> &face) {
+    if (p == end)
+        return true;
+    const bool keyword_end = p + 1 == end || is_space(p[1]);
+    const bool keyword2_end = p + 2 == end || (p + 2 < end && is_space(p[2]));
+    if (p[0] == 'v' && keyword_end) {
+        Vec3f position;
+        p++;
+        if (!parse_float(p, end, position.x) || !parse_float(p, end, position.y) || !parse_float(p, end, position.z))
+            return false;
+        // an optional w or vertex color may follow
+        chunk.positions.push_back(position);
+    } else if (p[0] == 'v' && p + 1 < end && p[1] == 'n' && keyword2_end) {
+        Vec3f normal;
+        p += 2;
+        if (!parse_float(p, end, normal.x) || !parse_float(p, end, normal.y) || !parse_float(p, end, normal.z))
+            return false;
+        chunk.normals.push_back(normal);
+    } else if (p[0] == 'v' && p + 1 < end && p[1] == 't' && keyword2_end) {
+        Vec2f texcoord{0.0, 0.0};
+        p += 2;
+        if (!parse_float(p, end, texcoord.x))
+            return false;
+        // v is optional
+        const char *q = p;
+        if (parse_float(q, end, texcoord.y))
+            p = q;
+        chunk.texcoords.push_back(texcoord);
+    } else if (p[0] == 'f' && keyword_end) {
+        p++;
+        const size_t counts[3] = {chunk.positions.size(), chunk.texcoords.size(), chunk.normals.size()};
+        face.clear();
+        while (true) {
+            skip_spaces(p, end);
+            if (p == end)
+                break;
+            ObjCorner corner;
+            if (!parse_corner(p, end, counts, corner))
+                return false;
+            face.push_back(corner);
+        }
+        if (face.size() < 3)
+            return false;
+        for (const auto &corner : face)
+            chunk.all_normals = chunk.all_normals && corner.normal != MISSING;
+        // fan triangulation of quads and polygons. Consecutive triangles of the fan share a diagonal, and every pair of them is a quad
+        const size_t first_triangle = chunk.corners.size() / 3;
+        for (size_t j = 0; j + 3 < face.size(); j += 2)
+            chunk.quads.push_back(static_cast<uint32_t>(first_triangle + j));
+        for (size_t i = 1; i + 1 < face.size(); i++)
+            chunk.corners.insert(chunk.corners.end(), {face[0], face[i], face[i + 1]});
+    }
+    // comments, objects, groups, smoothing groups, materials, lines and points are skipped; every face goes into the mesh
+    return true;
+}
+
+void parse_chunk(const char *begin, const char *end, ObjChunk &chunk) {
+    std::vector<ObjCorner> face;
+    for (const char *p = begin; p < end;) {
+        const char *line_end = static_cast<const char *>(std::memchr(p, '\n', end - p));
+        if (line_end == nullptr)
+            line_end = end;
+        const char *q = p, *e = line_end;
+        skip_spaces(q, e);
+        if (e > q && e[-1] == '\r')
+            e--;
+        if (!parse_line(q, e, chunk, face)) {
+            chunk.error = std::string{q, e};
+            return;
+        }
+        p = line_end + 1;
+    }
+}
+
+}  // namespace
+
+TriangleMesh *read_obj(const std::string &filepath, TaskPool &pool) {
+    MappedFile file{filepath};
+    const char *text = reinterpret_cast<const char *>(file.data());
+    const size_t size = file.size();
+
+    // split the file into line-aligned chunks: every chunk but the first starts after a newline
+    const size_t n_chunks = std::max<size_t>(1, std::min(pool.size(), size / MIN_CHUNK_BYTES));
+    std::vector<size_t> bounds(n_chunks + 1, size);
+    bounds[0] = 0;
+    for (size_t i = 1; i < n_chunks; i++) {
+        size_t pos = std::max(bounds[i - 1], i * (size / n_chunks));
+        while (pos < size && pos > 0 && text[pos - 1] != '\n')
+            pos++;
+        bounds[i] = pos;
+    }
+
+    std::vector<ObjChunk> chunks(n_chunks);
+    pool.parallel_for_chunks(0, n_chunks, [&](size_t chunk_begin, size_t chunk_end, size_t) {
+        for (size_t c = chunk_begin; c < chunk_end; c++)
+            parse_chunk(text + bounds[c], text + bounds[c + 1], chunks[c]);
+    });
+    for (const auto &chunk : chunks)
+        if (!chunk.error.empty())
+            throw std::runtime_error("Malformed line in OBJ file " + filepath + ": " + chunk.error);
+
+    // offsets of the chunks in the concatenated buffers
+    std::vector<size_t> position_offsets(n_chunks + 1, 0), texcoord_offsets(n_chunks + 1, 0), normal_offsets(n_chunks + 1, 0), corner_offsets(n_chunks + 1, 0);
+    std::vector<size_t> quad_offsets(n_chunks + 1, 0);
+    bool all_normals = true;
+    for (size_t c = 0; c < n_chunks; c++) {
+        position_offsets[c + 1] = position_offsets[c] + chunks[c].positions.size();
+        texcoord_offsets[c + 1] = texcoord_offsets[c] + chunks[c].texcoords.size();
+        normal_offsets[c + 1] = normal_offsets[c] + chunks[c].normals.size();
+        corner_offsets[c + 1] = corner_offsets[c] + chunks[c].corners.size();
+        quad_offsets[c + 1] = quad_offsets[c] + chunks[c].quads.size();
+        all_normals = all_normals && chunks[c].all_normals;
+    }
+    const int64_t n_positions = position_offsets[n_chunks], n_texcoords = texcoord_offsets[n_chunks], n_normals = normal_offsets[n_chunks];
+    const bool has_normals = n_normals > 0 && all_normals;
+    const bool has_texcoords = n_texcoords > 0;
+
+    // concatenate the attributes and resolve the corners against the global counts
+    std::vector<Vec3f> positions(n_positions), normals(n_normals);
+    std::vector<Vec2f> texcoords(n_texcoords);
+    std::vector<ObjCorner> corners(corner_offsets[n_chunks]);
+    std::vector<uint32_t> quads(quad_offsets[n_chunks]);
+    std::vector<char> out_of_range(n_chunks, false);
+    pool.parallel_for_chunks(0, n_chunks, [&](size_t chunk_begin, size_t chunk_end, size_t) {
+        for (size_t c = chunk_begin; c < chunk_end; c++) {
+            ObjChunk &chunk = chunks[c];
+            std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + position_offsets[c]);
+            std::copy(chunk.texcoords.begin(), chunk.texcoords.end(), texcoords.begin() + texcoord_offsets[c]);
+            std::copy(chunk.normals.begin(), chunk.normals.end(), normals.begin() + normal_offsets[c]);
+            for (size_t i = 0; i < chunk.corners.size(); i++) {
+                ObjCorner corner = chunk.corners[i];
+                if (corner.relative & 1)
+                    corner.vertex += position_offsets[c];
+                if (corner.relative & 2)
+                    corner.texcoord += texcoord_offsets[c];
+                if (corner.relative & 4)
+                    corner.normal += normal_offsets[c];
+                if (corner.vertex < 0 || corner.vertex >= n_positions ||
+                    (corner.texcoord != MISSING && (corner.texcoord < 0 || corner.texcoord >= n_texcoords)) ||
+                    (has_normals && (corner.normal < 0 || corner.normal >= n_normals)))
+                    out_of_range[c] = true;
+                corners[corner_offsets[c] + i] = corner;
+            }
+            for (size_t i = 0; i < chunk.quads.size(); i++)
+                quads[quad_offsets[c] + i] = chunk.quads[i] + static_cast<uint32_t>(corner_offsets[c] / 3);
+            chunk = ObjChunk{};
+        }
+    });
+    for (char error : out_of_range)
+        if (error)
+            throw std::runtime_error("OBJ face references a missing vertex: " + filepath);
+
+    auto mesh = new TriangleMesh{};
+    mesh->indices.resize(corners.size());
+    mesh->quads = std::move(quads);
+    // most exporters give every corner the same position, texcoord and normal index ("f 1/1/1"). The OBJ vertices are then the mesh
+    // vertices as they are, and the combinations only need to be deduplicated otherwise
+    bool same_indices = (!has_normals || n_normals == n_positions) && (!has_texcoords || n_texcoords == n_positions);
+    if (same_indices && (has_normals || has_texcoords)) {
+        std::vector<char> differs(pool.size(), false);
+        pool.parallel_for_chunks(0, corners.size(), [&](size_t begin, size_t end, size_t chunk) {
+            for (size_t i = begin; i < end && !differs[chunk]; i++)
+                differs[chunk] = (has_normals && corners[i].normal != corners[i].vertex) || (has_texcoords && corners[i].texcoord != corners[i].vertex);
+        });
+        same_indices = std::none_of(differs.begin(), differs.end(), [](char d) { return d != 0; });
+    }
+    if (same_indices) {
+        mesh->positions = std::move(positions);
+        if (has_normals)
+            mesh->normals = std::move(normals);
+        if (has_texcoords)
+            mesh->texcoords = std::move(texcoords);
+        pool.parallel_for_chunks(0, corners.size(), [&](size_t begin, size_t end, size_t) {
+            for (size_t i = begin; i < end; i++)
+                mesh->indices[i] = static_cast<uint32_t>(corners[i].vertex);
+        });
+    } else {
+        std::unordered_map<ObjVertexKey, uint32_t, ObjVertexKeyHash> vertex_ids;
+        for (size_t i = 0; i < corners.size(); i++) {
+            const ObjCorner &corner = corners[i];
+            ObjVertexKey key{corner.vertex, has_normals ? corner.normal : MISSING, has_texcoords ? corner.texcoord : MISSING};
+            auto [it, inserted] = vertex_ids.try_emplace(key, static_cast<uint32_t>(mesh->positions.size()));
+            if (inserted) {
+                mesh->positions.push_back(positions[key.vertex]);
+                if (has_normals)
+                    mesh->normals.push_back(normals[key.normal]);
+                // corners without texcoords get (0, 0)
+                if (has_texcoords)
+                    mesh->texcoords.push_back(key.texcoord != MISSING ? texcoords[key.texcoord] : Vec2f{0.0});
+            }
+            mesh->indices[i] = it->second;
+        }
+    }
+    return mesh;
+}
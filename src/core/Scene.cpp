@@ -1,9 +1,37 @@
 #include "core/Scene.h"
 
+#include <array>
+#include <bit>
+#include <chrono>
+#include <cstring>
+#include <exception>
+#include <future>
+#include <memory>
+#include <random>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#include "core/BVH.h"
+#include "core/WideBVH.h"
+#include "core/ObjReader.h"
 #include "core/Registry.h"
+#include "core/SceneCache.h"
+#include "core/SerializedReader.h"
+#include "core/ShapeGroup.h"
+#include "core/TriangleMesh.h"
+#include "core/TrianglePacket.h"
+#include "core/Thread.h"
 #include "happly.h"
-#include "utils/FileUtils.h"
 #include "utils/Logger.h"
+#include "utils/MappedFile.h"
 #include "utils/SceneParser.h"
 
 // BUG: memory leak for shapes, geometries, bsdfs, emitters, sensor
@@ -44,503 +72,551 @@ std::unordered_map<EmitterDesc*, Emitter*> load_emitters(const std::vector<Emitt
     return emitters_dict;
 }
 
-bool load_mesh_from_file(const std::string& file_path, const Shape* parent_shape, std::vector<Geometry*>& output_mesh, std::vector<Vec3f*>& vertices, std::vector<Vec3f*>& normals, std::vector<Vec2f*>& texcoords, const std::unordered_map<std::string, std::string>& properties) {
-    tinyobj::ObjReader obj_reader;
-    if (!obj_reader.ParseFromFile(file_path)) {
-        if (!obj_reader.Error().empty())
-            std::cerr << "TinyObjReader error reading file: " << file_path << "; " << obj_reader.Error() << "\n";
-        return false;
+/// peak resident memory of the process so far, in bytes
+size_t peak_memory_usage() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return static_cast<size_t>(usage.ru_maxrss);
+#else
+    // kilobytes on Linux
+    return static_cast<size_t>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+/// transform a mesh to world space and create its triangles
+void finish_mesh(TriangleMesh* mesh, const ShapeDesc* shape_desc, Shape* shape, TaskPool& pool) {
+    mesh->transform(strToMat4f(shape_desc->properties.at("to_world")), strToMat4f(shape_desc->properties.at("inv_to_world")), &pool);
+    shape->mesh = mesh;
+    create_mesh_triangles(mesh, shape_desc->properties, shape, shape->geometries, &pool);
+}
+
+void load_obj(const ShapeDesc* shape_desc, Shape* shape, TaskPool& pool) {
+    std::string filepath = (scene_file_path.parent_path() / shape_desc->properties.at("filename")).string();
+    auto start = std::chrono::high_resolution_clock::now();
+    TriangleMesh* mesh = read_obj(filepath, pool);
+    std::chrono::duration<double> load_time = std::chrono::high_resolution_clock::now() - start;
+    LOG_INFO("Loaded {}: {} vertices, {} triangles in {:.3f} seconds", filepath, mesh->positions.size(), mesh->n_triangles(), load_time.count());
+
+    finish_mesh(mesh, shape_desc, shape, pool);
+}
+
+/// type of a PLY property, or of the count or the items of a list property
+enum class PlyType { Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64 };
+
+struct PlyProperty {
+    std::string name;
+    PlyType type;
+    bool is_list = false;
+    PlyType count_type = PlyType::UInt8;
+    /// offset in the record of the element, if it has no list properties
+    size_t offset = 0;
+};
+
+struct PlyElement {
+    std::string name;
+    size_t count = 0;
+    std::vector<PlyProperty> properties{};
+    /// size of a record, or 0 if the element has list properties and its records vary in size
+    size_t stride = 0;
+
+    const PlyProperty* find(const std::string& property_name) const {
+        for (const auto& property : properties)
+            if (property.name == property_name)
+                return &property;
+        return nullptr;
     }
-    if (!obj_reader.Warning().empty()) {
-        std::cout << "TinyObjReader warning reading file: " << file_path << "; " << obj_reader.Warning() << "\n";
+};
+
+struct PlyHeader {
+    std::vector<PlyElement> elements{};
+    /// offset of the data of the first element in the file
+    size_t body_offset = 0;
+};
+
+size_t ply_type_size(PlyType type) {
+    switch (type) {
+        case PlyType::Int8:
+        case PlyType::UInt8:
+            return 1;
+        case PlyType::Int16:
+        case PlyType::UInt16:
+            return 2;
+        case PlyType::Int32:
+        case PlyType::UInt32:
+        case PlyType::Float32:
+            return 4;
+        case PlyType::Float64:
+            return 8;
     }
+    return 0;
+}
 
-    // Only support objs with one shape
-    const std::vector<tinyobj::shape_t>& shapes = obj_reader.GetShapes();
-    if (shapes.size() == 0) {
-        std::cerr << "TinyObjReader warning reading file: " << file_path << "; " << "No shapes in this file\n";
+bool parse_ply_type(const std::string& name, PlyType& type) {
+    static const std::unordered_map<std::string, PlyType> types{
+        {"char", PlyType::Int8}, {"int8", PlyType::Int8}, {"uchar", PlyType::UInt8}, {"uint8", PlyType::UInt8},
+        {"short", PlyType::Int16}, {"int16", PlyType::Int16}, {"ushort", PlyType::UInt16}, {"uint16", PlyType::UInt16},
+        {"int", PlyType::Int32}, {"int32", PlyType::Int32}, {"uint", PlyType::UInt32}, {"uint32", PlyType::UInt32},
+        {"float", PlyType::Float32}, {"float32", PlyType::Float32}, {"double", PlyType::Float64}, {"float64", PlyType::Float64}};
+    auto it = types.find(name);
+    if (it == types.end())
         return false;
+    type = it->second;
+    return true;
+}
+
+/// read a little-endian value of the given type, converted to T
+template <typename T>
+T read_ply_value(const uint8_t* ptr, PlyType type) {
+    auto read = [ptr]<typename U>(U value) {
+        std::memcpy(&value, ptr, sizeof(U));
+        return static_cast<T>(value);
+    };
+    switch (type) {
+        case PlyType::Int8:
+            return read(int8_t{});
+        case PlyType::UInt8:
+            return read(uint8_t{});
+        case PlyType::Int16:
+            return read(int16_t{});
+        case PlyType::UInt16:
+            return read(uint16_t{});
+        case PlyType::Int32:
+            return read(int32_t{});
+        case PlyType::UInt32:
+            return read(uint32_t{});
+        case PlyType::Float32:
+            return read(float{});
+        case PlyType::Float64:
+            return read(double{});
     }
-    if (shapes.size() > 1) {
-        std::cerr << "TinyObjReader warning reading file: " << file_path << "; " << "More than one shape in .obj file not supported\n";
+    return T{};
+}
+
+/// @brief Parse the header of a PLY file.
+/// @return false if the body isn't binary little-endian, or uses a layout the binary loader doesn't handle (such as a vertex element
+/// with list properties). These files are read with happly, which also reports the errors of malformed headers.
+bool parse_ply_header(const MappedFile& file, PlyHeader& header) {
+    if constexpr (std::endian::native != std::endian::little)
         return false;
+    const char* text = reinterpret_cast<const char*>(file.data());
+    size_t line_start = 0;
+    bool binary_little_endian = false;
+    while (true) {
+        size_t line_end = line_start;
+        while (line_end < file.size() && text[line_end] != '\n')
+            line_end++;
+        if (line_end == file.size())
+            return false;
+        std::istringstream line{std::string{text + line_start, line_end - line_start}};
+        line_start = line_end + 1;
+        std::string keyword;
+        line >> keyword;
+        if (keyword == "end_header") {
+            header.body_offset = line_start;
+            break;
+        } else if (keyword == "format") {
+            std::string format;
+            line >> format;
+            binary_little_endian = format == "binary_little_endian";
+        } else if (keyword == "element") {
+            PlyElement element;
+            if (!(line >> element.name >> element.count))
+                return false;
+            header.elements.push_back(element);
+        } else if (keyword == "property") {
+            if (header.elements.empty())
+                return false;
+            PlyProperty property;
+            std::string type_name;
+            line >> type_name;
+            if (type_name == "list") {
+                std::string count_type_name;
+                line >> count_type_name >> type_name;
+                property.is_list = true;
+                if (!parse_ply_type(count_type_name, property.count_type))
+                    return false;
+            }
+            if (!parse_ply_type(type_name, property.type) || !(line >> property.name))
+                return false;
+            header.elements.back().properties.push_back(property);
+        }
+        // "ply", comments and obj_info lines are skipped
     }
+    if (!binary_little_endian)
+        return false;
 
-    const tinyobj::attrib_t& attrib = obj_reader.GetAttrib();
-
-    // Store vertices, normals and texcoords;
-    size_t num_vertices = attrib.vertices.size() / 3;
-    for (size_t i = 0; i < num_vertices * 3; i += 3)
-        vertices.emplace_back(new Vec3f(attrib.vertices[i], attrib.vertices[i + 1], attrib.vertices[i + 2]));
-    size_t num_normals = attrib.normals.size() / 3;
-    for (size_t i = 0; i < num_normals * 3; i += 3)
-        normals.emplace_back(new Vec3f(attrib.normals[i], attrib.normals[i + 1], attrib.normals[i + 2]));
-    size_t num_texcoords = attrib.texcoords.size() / 2;
-    for (size_t i = 0; i < num_texcoords * 2; i += 2)
-        texcoords.emplace_back(new Vec2f(attrib.texcoords[i], attrib.texcoords[i + 1]));
-
-    // Iterate through faces and fill-up the output_mesh
-    tinyobj::mesh_t mesh = shapes[0].mesh;
-    size_t index_offset = 0;
-    for (size_t f = 0; f < mesh.num_face_vertices.size(); f++) {
-        auto num_face_vertices = mesh.num_face_vertices[f];
-        if (num_face_vertices == 3) {
-            // Triangle
-            std::array<int, 3> vertex_indices;
-            std::array<int, 3> normal_indices;
-            std::array<int, 3> texcoord_indices;
-            for (size_t v = 0; v < 3; v++) {
-                tinyobj::index_t index = mesh.indices[index_offset + v];
-                vertex_indices[v] = index.vertex_index;
-                normal_indices[v] = index.normal_index;
-                texcoord_indices[v] = index.texcoord_index;
-            }
+    for (auto& element : header.elements) {
+        size_t offset = 0;
+        bool has_lists = false;
+        for (auto& property : element.properties) {
+            property.offset = offset;
+            offset += ply_type_size(property.type);
+            has_lists |= property.is_list;
+        }
+        element.stride = has_lists ? 0 : offset;
+        if (element.name == "vertex" && has_lists)
+            return false;
+    }
+    return true;
+}
 
-            GeometryCreationContext gctx{};
-            gctx.vp = {vertices[vertex_indices[0]], vertices[vertex_indices[1]], vertices[vertex_indices[2]]};
-            if (normal_indices[0] != -1)
-                gctx.vn = {normals[normal_indices[0]], normals[normal_indices[1]], normals[normal_indices[2]]};
-            if (texcoord_indices[0] != -1)
-                gctx.vt = {texcoords[texcoord_indices[0]], texcoords[texcoord_indices[1]], texcoords[texcoord_indices[2]]};
-            output_mesh.emplace_back(GeometryRegistry::createGeometry("triangle", properties, parent_shape, &gctx));
+/// @brief Read N properties of every record of a fixed-size element into vectors.
+/// If the properties are consecutive floats they're copied as they are, with a single copy if the records hold nothing else.
+template <int N, typename V>
+void read_ply_vectors(const uint8_t* records, const PlyElement& element, const std::array<const PlyProperty*, N>& properties, std::vector<V>& vectors) {
+    static_assert(sizeof(V) == N * sizeof(Float));
+    vectors.resize(element.count);
+    bool as_is = std::is_same_v<Float, float>;
+    for (int i = 0; i < N; i++)
+        as_is = as_is && properties[i]->type == PlyType::Float32 && properties[i]->offset == properties[0]->offset + 4 * i;
+    if (as_is && element.stride == sizeof(V)) {
+        std::memcpy(vectors.data(), records, element.count * sizeof(V));
+        return;
+    }
+    for (size_t v = 0; v < element.count; v++) {
+        const uint8_t* record = records + v * element.stride;
+        if (as_is) {
+            std::memcpy(&vectors[v], record + properties[0]->offset, sizeof(V));
         } else {
-            // Other polygons
-            throw std::runtime_error("Quad not implemented");
+            for (int i = 0; i < N; i++)
+                vectors[v][i] = read_ply_value<Float>(record + properties[i]->offset, properties[i]->type);
         }
-
-        index_offset += num_face_vertices;
     }
+}
 
-    return true;
+/// @brief Append a face of n >= 3 vertices to a mesh, triangulated as a fan. Consecutive triangles of the fan share a diagonal,
+/// and every pair of them is a quad (see TriangleMesh::quads)
+void append_polygon(TriangleMesh& mesh, const uint32_t* face, size_t n) {
+    const size_t first_triangle = mesh.n_triangles();
+    for (size_t j = 0; j + 3 < n; j += 2)
+        mesh.quads.push_back(static_cast<uint32_t>(first_triangle + j));
+    for (size_t i = 1; i + 1 < n; i++)
+        mesh.indices.insert(mesh.indices.end(), {face[0], face[i], face[i + 1]});
 }
 
-void load_obj(const ShapeDesc* shape_desc, Shape* shape) {
-    std::vector<Vec3f*> vertices;
-    std::vector<Vec3f*> normals;
-    std::vector<Vec2f*> texcoords;
-    std::string filepath = (scene_file_path.parent_path() / shape_desc->properties.at("filename")).string();
+/// @brief Read a binary little-endian PLY file straight from its memory mapping into the buffers of a mesh
+TriangleMesh* load_ply_binary(const MappedFile& file, const PlyHeader& header, const std::string& filepath) {
+    const uint8_t* ptr = file.data() + header.body_offset;
+    const uint8_t* const end = file.data() + file.size();
+    auto require = [&](size_t n_bytes) {
+        if (static_cast<size_t>(end - ptr) < n_bytes)
+            throw std::runtime_error("PLY file is truncated: " + filepath);
+    };
 
-    tinyobj::ObjReader obj_reader;
-    if (!obj_reader.ParseFromFile(filepath) && !obj_reader.Error().empty())
-        throw std::runtime_error("TinyObjReader error reading file: " + filepath + "; " + obj_reader.Error());
-    if (!obj_reader.Warning().empty())
-        throw std::runtime_error("TinyObjReader warning reading file: " + filepath + "; " + obj_reader.Warning());
-
-    // Only support objs with one shape
-    const std::vector<tinyobj::shape_t>& shapes = obj_reader.GetShapes();
-    if (shapes.size() == 0)
-        throw std::runtime_error("TinyObjReader warning reading file: " + filepath + "; " + "No shapes in this file");
-    if (shapes.size() > 1)
-        throw std::runtime_error("TinyObjReader warning reading file: " + filepath + "; " + "More than one shape in .obj file not supported");
-
-    const tinyobj::attrib_t& attrib = obj_reader.GetAttrib();
-
-    // Store vertices, normals and texcoords;
-    size_t num_vertices = attrib.vertices.size() / 3;
-    for (size_t i = 0; i < num_vertices * 3; i += 3)
-        vertices.emplace_back(new Vec3f(attrib.vertices[i], attrib.vertices[i + 1], attrib.vertices[i + 2]));
-    size_t num_normals = attrib.normals.size() / 3;
-    for (size_t i = 0; i < num_normals * 3; i += 3)
-        normals.emplace_back(new Vec3f(attrib.normals[i], attrib.normals[i + 1], attrib.normals[i + 2]));
-    size_t num_texcoords = attrib.texcoords.size() / 2;
-    for (size_t i = 0; i < num_texcoords * 2; i += 2)
-        texcoords.emplace_back(new Vec2f(attrib.texcoords[i], attrib.texcoords[i + 1]));
-
-    // Iterate through faces and fill-up the output_mesh
-    tinyobj::mesh_t mesh = shapes[0].mesh;
-    size_t index_offset = 0;
-    for (size_t f = 0; f < mesh.num_face_vertices.size(); f++) {
-        auto num_face_vertices = mesh.num_face_vertices[f];
-        if (num_face_vertices == 3) {
-            // Triangle
-            std::array<int, 3> vertex_indices;
-            std::array<int, 3> normal_indices;
-            std::array<int, 3> texcoord_indices;
-            for (size_t v = 0; v < 3; v++) {
-                tinyobj::index_t index = mesh.indices[index_offset + v];
-                vertex_indices[v] = index.vertex_index;
-                normal_indices[v] = index.normal_index;
-                texcoord_indices[v] = index.texcoord_index;
+    auto mesh = std::make_unique<TriangleMesh>();
+    bool has_vertices = false, has_faces = false;
+    for (const auto& element : header.elements) {
+        if (element.name == "vertex") {
+            const PlyProperty *x = element.find("x"), *y = element.find("y"), *z = element.find("z");
+            if (x == nullptr || y == nullptr || z == nullptr)
+                throw std::runtime_error("PLY mesh vertex elements must have x, y, z properties");
+            require(element.count * element.stride);
+            read_ply_vectors<3>(ptr, element, {x, y, z}, mesh->positions);
+            const PlyProperty *nx = element.find("nx"), *ny = element.find("ny"), *nz = element.find("nz");
+            if (nx != nullptr && ny != nullptr && nz != nullptr)
+                read_ply_vectors<3>(ptr, element, {nx, ny, nz}, mesh->normals);
+            const PlyProperty* u = element.find("u") != nullptr ? element.find("u") : element.find("s");
+            const PlyProperty* v = element.find("v") != nullptr ? element.find("v") : element.find("t");
+            if (u != nullptr && v != nullptr)
+                read_ply_vectors<2>(ptr, element, {u, v}, mesh->texcoords);
+            ptr += element.count * element.stride;
+            has_vertices = true;
+        } else if (element.name == "face") {
+            const PlyProperty* indices = element.find("vertex_indices") != nullptr ? element.find("vertex_indices") : element.find("vertex_index");
+            if (indices == nullptr || !indices->is_list)
+                throw std::runtime_error("PLY mesh face elements must have vertex_indices property");
+            const size_t index_size = ply_type_size(indices->type);
+            mesh->indices.reserve(element.count * 3);
+            std::vector<uint32_t> face;
+            for (size_t f = 0; f < element.count; f++) {
+                for (const auto& property : element.properties) {
+                    if (!property.is_list) {
+                        require(ply_type_size(property.type));
+                        ptr += ply_type_size(property.type);
+                        continue;
+                    }
+                    require(ply_type_size(property.count_type));
+                    size_t n = read_ply_value<size_t>(ptr, property.count_type);
+                    ptr += ply_type_size(property.count_type);
+                    require(n * ply_type_size(property.type));
+                    if (&property == indices) {
+                        if (n < 3)
+                            throw std::runtime_error("PLY mesh faces must have at least 3 vertices");
+                        face.resize(n);
+                        for (size_t i = 0; i < n; i++)
+                            face[i] = read_ply_value<uint32_t>(ptr + i * index_size, property.type);
+                        append_polygon(*mesh, face.data(), n);
+                    }
+                    ptr += n * ply_type_size(property.type);
+                }
             }
-
-            GeometryCreationContext gctx{};
-            gctx.vp = {vertices[vertex_indices[0]], vertices[vertex_indices[1]], vertices[vertex_indices[2]]};
-            if (normal_indices[0] != -1)
-                gctx.vn = {normals[normal_indices[0]], normals[normal_indices[1]], normals[normal_indices[2]]};
-            if (texcoord_indices[0] != -1)
-                gctx.vt = {texcoords[texcoord_indices[0]], texcoords[texcoord_indices[1]], texcoords[texcoord_indices[2]]};
-            shape->geometries.emplace_back(GeometryRegistry::createGeometry("triangle", shape_desc->properties, shape, &gctx));
+            has_faces = true;
+        } else if (element.stride > 0) {
+            require(element.count * element.stride);
+            ptr += element.count * element.stride;
         } else {
-            // Other polygons
-            throw std::runtime_error("Quad not implemented");
+            for (size_t r = 0; r < element.count; r++)
+                for (const auto& property : element.properties) {
+                    size_t n = 1;
+                    if (property.is_list) {
+                        require(ply_type_size(property.count_type));
+                        n = read_ply_value<size_t>(ptr, property.count_type);
+                        ptr += ply_type_size(property.count_type);
+                    }
+                    require(n * ply_type_size(property.type));
+                    ptr += n * ply_type_size(property.type);
+                }
         }
-
-        index_offset += num_face_vertices;
     }
-
-    // apply transform
-    Mat4f to_world = strToMat4f(shape_desc->properties.at("to_world"));
-    Mat4f tsp_inv_to_world = glm::transpose(strToMat4f(shape_desc->properties.at("inv_to_world")));
-    for (auto& vertex : vertices)
-        *vertex = Vec3f{to_world * Vec4f{*vertex, 1.0}};
-    // use the inverse transpose of the upper-left 3x3 part of the matrix
-    for (auto& normal : normals)
-        *normal = glm::normalize(Vec3f{tsp_inv_to_world * Vec4f{*normal, 0.0}});
+    if (!has_vertices)
+        throw std::runtime_error("PLY mesh must have vertex elements");
+    if (!has_faces)
+        throw std::runtime_error("PLY mesh must have face elements");
+    // negative indices wrap around, so this catches them too
+    for (uint32_t index : mesh->indices)
+        if (index >= mesh->positions.size())
+            throw std::runtime_error("PLY mesh face references a missing vertex");
+    return mesh.release();
 }
 
-void load_ply(const ShapeDesc* shape_desc, Shape* shape) {
-    happly::PLYData mesh{(scene_file_path.parent_path() / shape_desc->properties.at("filename")).string(), false};
+/// @brief Read an ASCII or big-endian PLY file with happly
+TriangleMesh* load_ply_happly(const std::string& filepath) {
+    happly::PLYData ply{filepath, false};
 
-    auto element_names = mesh.getElementNames();
+    auto element_names = ply.getElementNames();
     if (std::find(element_names.begin(), element_names.end(), "vertex") == element_names.end())
         throw std::runtime_error("PLY mesh must have vertex elements");
     if (std::find(element_names.begin(), element_names.end(), "face") == element_names.end())
         throw std::runtime_error("PLY mesh must have face elements");
-    auto& vertex_element = mesh.getElement("vertex");
-    if (!mesh.getElement("vertex").hasProperty("x") || !mesh.getElement("vertex").hasProperty("y") || !mesh.getElement("vertex").hasProperty("z"))
+    auto& vertex_element = ply.getElement("vertex");
+    if (!vertex_element.hasProperty("x") || !vertex_element.hasProperty("y") || !vertex_element.hasProperty("z"))
         throw std::runtime_error("PLY mesh vertex elements must have x, y, z properties");
+
+    auto mesh = std::make_unique<TriangleMesh>();
     auto vp_x = vertex_element.getProperty<Float>("x");
     auto vp_y = vertex_element.getProperty<Float>("y");
     auto vp_z = vertex_element.getProperty<Float>("z");
-    auto vn_x = vertex_element.hasProperty("nx") ? vertex_element.getProperty<Float>("nx") : std::vector<Float>{0};
-    auto vn_y = vertex_element.hasProperty("ny") ? vertex_element.getProperty<Float>("ny") : std::vector<Float>{0};
-    auto vn_z = vertex_element.hasProperty("nz") ? vertex_element.getProperty<Float>("nz") : std::vector<Float>{0};
-    auto vt_u = vertex_element.hasProperty("u") ? vertex_element.getProperty<Float>("u") : vertex_element.hasProperty("s") ? vertex_element.getProperty<Float>("s")
-                                                                                                                           : std::vector<Float>{0};
-    auto vt_v = vertex_element.hasProperty("v") ? vertex_element.getProperty<Float>("v") : vertex_element.hasProperty("t") ? vertex_element.getProperty<Float>("t")
-                                                                                                                           : std::vector<Float>{0};
-    std::vector<Vec3f*> vertices{};
-    std::vector<Vec3f*> normals{};
-    std::vector<Vec2f*> tex_coords{};
-
+    mesh->positions.resize(vp_x.size());
     for (size_t i = 0; i < vp_x.size(); ++i)
-        vertices.push_back(new Vec3f{vp_x[i], vp_y[i], vp_z[i]});
-    for (size_t i = 0; i < vn_x.size(); ++i)
-        if (vn_x.size() != 0)
-            normals.push_back(new Vec3f{vn_x[i], vn_y[i], vn_z[i]});
-    for (size_t i = 0; i < vt_u.size(); ++i)
-        if (vt_u.size() != 0)
-            tex_coords.push_back(new Vec2f{vt_u[i], vt_v[i]});
-
-    // apply transform
-    Mat4f to_world = strToMat4f(shape_desc->properties.at("to_world"));
-    Mat4f tsp_inv_to_world = glm::transpose(strToMat4f(shape_desc->properties.at("inv_to_world")));
-    for (auto& vertex : vertices)
-        *vertex = Vec3f{to_world * Vec4f{*vertex, 1.0}};
-    for (auto& normal : normals)
-        *normal = glm::normalize(Vec3f{tsp_inv_to_world * Vec4f{*normal, 0.0}});
+        mesh->positions[i] = Vec3f{vp_x[i], vp_y[i], vp_z[i]};
+    if (vertex_element.hasProperty("nx") && vertex_element.hasProperty("ny") && vertex_element.hasProperty("nz")) {
+        auto vn_x = vertex_element.getProperty<Float>("nx");
+        auto vn_y = vertex_element.getProperty<Float>("ny");
+        auto vn_z = vertex_element.getProperty<Float>("nz");
+        mesh->normals.resize(vn_x.size());
+        for (size_t i = 0; i < vn_x.size(); ++i)
+            mesh->normals[i] = Vec3f{vn_x[i], vn_y[i], vn_z[i]};
+    }
+    std::string u_name = vertex_element.hasProperty("u") ? "u" : "s";
+    std::string v_name = vertex_element.hasProperty("v") ? "v" : "t";
+    if (vertex_element.hasProperty(u_name) && vertex_element.hasProperty(v_name)) {
+        auto vt_u = vertex_element.getProperty<Float>(u_name);
+        auto vt_v = vertex_element.getProperty<Float>(v_name);
+        mesh->texcoords.resize(vt_u.size());
+        for (size_t i = 0; i < vt_u.size(); ++i)
+            mesh->texcoords[i] = Vec2f{vt_u[i], vt_v[i]};
+    }
+
     // process faces
-    auto& face_element = mesh.getElement("face");
+    auto& face_element = ply.getElement("face");
     if (!face_element.hasProperty("vertex_indices"))
         throw std::runtime_error("PLY mesh face elements must have vertex_indices property");
-    // TODO: clean this
-    // auto face_vertex_indices = face_element.getListProperty<int>("vertex_indices");
     auto face_vertex_indices = face_element.getListProperty<uint32_t>("vertex_indices");
-
+    mesh->indices.reserve(face_vertex_indices.size() * 3);
     for (const auto& face : face_vertex_indices) {
-        if (face.size() == 3) {
-            GeometryCreationContext gctx{};
-            gctx.vp = {vertices[face[0]], vertices[face[1]], vertices[face[2]]};
-            if (normals.size() == vertices.size())
-                gctx.vn = {normals[face[0]], normals[face[1]], normals[face[2]]};
-            if (tex_coords.size() == vertices.size())
-                gctx.vt = {tex_coords[face[0]], tex_coords[face[1]], tex_coords[face[2]]};
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", shape_desc->properties, shape, new GeometryCreationContext{gctx}));
-        } else if (face.size() == 4) {
-            // quad -> 2 triangles
-            GeometryCreationContext gctx1{};
-            gctx1.vp = {vertices[face[0]], vertices[face[1]], vertices[face[2]]};
-            GeometryCreationContext gctx2{};
-            gctx2.vp = {vertices[face[0]], vertices[face[2]], vertices[face[3]]};
-            if (normals.size() == vertices.size()) {
-                gctx1.vn = {normals[face[0]], normals[face[1]], normals[face[2]]};
-                gctx2.vn = {normals[face[0]], normals[face[2]], normals[face[3]]};
-            }
-            if (tex_coords.size() == vertices.size()) {
-                gctx1.vt = {tex_coords[face[0]], tex_coords[face[1]], tex_coords[face[2]]};
-                gctx2.vt = {tex_coords[face[0]], tex_coords[face[2]], tex_coords[face[3]]};
-            }
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", shape_desc->properties, shape, &gctx1));
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", shape_desc->properties, shape, &gctx2));
-        } else {
-            throw std::runtime_error("Only triangle and quad faces are supported in PLY mesh");
-        }
+        for (const auto& index : face)
+            if (index >= mesh->positions.size())
+                throw std::runtime_error("PLY mesh face references a missing vertex");
+        if (face.size() < 3)
+            throw std::runtime_error("PLY mesh faces must have at least 3 vertices");
+        append_polygon(*mesh, face.data(), face.size());
+    }
+
+    return mesh.release();
+}
+
+void load_ply(const ShapeDesc* shape_desc, Shape* shape, TaskPool& pool) {
+    std::string filepath = (scene_file_path.parent_path() / shape_desc->properties.at("filename")).string();
+    auto start = std::chrono::high_resolution_clock::now();
+
+    TriangleMesh* mesh;
+    bool binary;
+    {
+        MappedFile file{filepath};
+        PlyHeader header;
+        binary = parse_ply_header(file, header);
+        mesh = binary ? load_ply_binary(file, header, filepath) : load_ply_happly(filepath);
     }
+    std::chrono::duration<double> load_time = std::chrono::high_resolution_clock::now() - start;
+    LOG_INFO("Loaded {} ({}): {} vertices, {} triangles in {:.3f} seconds", filepath, binary ? "memory-mapped" : "happly",
+             mesh->positions.size(), mesh->n_triangles(), load_time.count());
+
+    finish_mesh(mesh, shape_desc, shape, pool);
 }
 
-void load_serialized(const ShapeDesc* shape_desc, Shape* shape) {
+
+void load_serialized(const ShapeDesc* shape_desc, Shape* shape, SerializedFileCache& serialized_files, TaskPool& pool) {
     int shape_index = 0;
     if (shape_desc->properties.find("shape_index") != shape_desc->properties.end())
         shape_index = std::stoi(shape_desc->properties.find("shape_index")->second);
     if (shape_index < 0)
         throw std::runtime_error("shape_index must be non-negative");
 
-    std::string filepath = (scene_file_path.parent_path() / shape_desc->properties.at("filename")).string();
-    std::ifstream file(filepath, std::ios::binary);
-    if (!file)
-        throw std::runtime_error("Failed to open file");
-
-    uint16_t id = read_u16_le(file);
-    uint16_t version = read_u16_le(file);
-
-    // read the last 4 bytes as a uint32_t
-    file.seekg(-4, std::ios::end);
-    uint32_t n_shapes = read_u32_le(file);
-    if (shape_index >= n_shapes)
-        throw std::runtime_error("shape_index out of range");
-    file.seekg(0, std::ios::end);
-    std::streamoff file_size = file.tellg();
-    std::vector<uint64_t> offsets(n_shapes);
-    uint64_t last_offset;
-    if (version == 4) {
-        last_offset = file_size - (4 + n_shapes * 8);
-        for (size_t i = 0; i < n_shapes; i++) {
-            file.seekg(-4 - (n_shapes - i) * 8, std::ios::end);
-            offsets[i] = read_u64_le(file);
-        }
-    } else if (version == 3) {
-        last_offset = file_size - 4 * (n_shapes + 1);
-        for (size_t i = 0; i < n_shapes; i++) {
-            file.seekg(-(n_shapes - i + 1) * 4, std::ios::end);
-            offsets[i] = read_u32_le(file);
-        }
-    } else {
-        throw std::runtime_error("unsupported version");
-    }
-
-    file.seekg(offsets[shape_index] + 4, std::ios::beg);
-    std::vector<uint8_t> compressed((shape_index == n_shapes - 1 ? last_offset : offsets[shape_index + 1]) - offsets[shape_index] - 4);
-    file.read(reinterpret_cast<char*>(compressed.data()), compressed.size());
-    uLongf decompressed_size = compressed.size() * 4;  // rough guess; will expand if needed
-    std::vector<uint8_t> decompressed(decompressed_size);
-    int status = uncompress(decompressed.data(), &decompressed_size, compressed.data(), compressed.size());
-    if (status == Z_BUF_ERROR) {
-        // Try again with larger buffer. TODO: implement a more robust way
-        decompressed_size = compressed.size() * 10;
-        decompressed.resize(decompressed_size);
-        status = uncompress(decompressed.data(), &decompressed_size, compressed.data(), compressed.size());
-    }
-    if (status != Z_OK)
-        throw std::runtime_error("Decompression failed: " + std::to_string(status));
-    decompressed.resize(decompressed_size);
-
-    // read contents
-    std::vector<Vec3f*> vertices{};
-    std::vector<Vec3f*> normals{};
-    std::vector<Vec2f*> texcoords{};
-    size_t offset = 0;
-    uint32_t flags = read_u32_le_buffer(decompressed.data(), offset);
-    std::string name;
-    if (version == 4)
-        name = read_utf8_string(decompressed.data(), offset);
-    uint64_t num_vertices = read_u64_le_buffer(decompressed.data(), offset);
-    uint64_t num_triangles = read_u64_le_buffer(decompressed.data(), offset);
-    bool single_precision = (flags & 0x1000) != 0;
-    bool double_precision = (flags & 0x2000) != 0;
-    if (single_precision && double_precision)
-        throw std::runtime_error("Both single and double precision flags are set");
-    if (!single_precision && !double_precision)
-        throw std::runtime_error("Neither single nor double precision flags are set");
-    bool has_normals = (flags & 0x1) != 0;
-    bool has_texcoords = (flags & 0x2) != 0;
-    bool has_colors = (flags & 0x8) != 0;
-    if (has_colors)  // TODO
-        throw std::runtime_error("Serialized mesh with vertex colors not supported");
-
-    if (double_precision) {
-        for (uint64_t i = 0; i < num_vertices; ++i) {
-            Float x = read_double_le_buffer(decompressed.data(), offset);
-            Float y = read_double_le_buffer(decompressed.data(), offset);
-            Float z = read_double_le_buffer(decompressed.data(), offset);
-            vertices.push_back(new Vec3f{x, y, z});
-        }
-        if (has_normals) {
-            for (uint64_t i = 0; i < num_vertices; ++i) {
-                Float x = read_double_le_buffer(decompressed.data(), offset);
-                Float y = read_double_le_buffer(decompressed.data(), offset);
-                Float z = read_double_le_buffer(decompressed.data(), offset);
-                normals.push_back(new Vec3f{x, y, z});
-            }
-        }
-        if (has_texcoords) {
-            for (uint64_t i = 0; i < num_vertices; ++i) {
-                Float u = read_double_le_buffer(decompressed.data(), offset);
-                Float v = read_double_le_buffer(decompressed.data(), offset);
-                texcoords.push_back(new Vec2f{u, v});
-            }
-        }
-        // TODO: colors
-    } else {
-        for (uint32_t i = 0; i < num_vertices; ++i) {
-            Float x = read_float_le_buffer(decompressed.data(), offset);
-            Float y = read_float_le_buffer(decompressed.data(), offset);
-            Float z = read_float_le_buffer(decompressed.data(), offset);
-            vertices.push_back(new Vec3f{x, y, z});
-        }
-        if (has_normals) {
-            for (uint32_t i = 0; i < num_vertices; ++i) {
-                Float x = read_float_le_buffer(decompressed.data(), offset);
-                Float y = read_float_le_buffer(decompressed.data(), offset);
-                Float z = read_float_le_buffer(decompressed.data(), offset);
-                normals.push_back(new Vec3f{x, y, z});
-            }
-        }
-        if (has_texcoords) {
-            for (uint32_t i = 0; i < num_vertices; ++i) {
-                Float u = read_float_le_buffer(decompressed.data(), offset);
-                Float v = read_float_le_buffer(decompressed.data(), offset);
-                texcoords.push_back(new Vec2f{u, v});
-            }
-        }
-        // TODO: colors
-    }
-
-    // apply transform
-    Mat4f to_world = strToMat4f(shape_desc->properties.at("to_world"));
-    Mat4f tsp_inv_to_world = glm::transpose(strToMat4f(shape_desc->properties.at("inv_to_world")));
-    for (auto& vertex : vertices)
-        *vertex = Vec3f{to_world * Vec4f{*vertex, 1.0}};
-    for (auto& normal : normals)
-        *normal = glm::normalize(Vec3f{tsp_inv_to_world * Vec4f{*normal, 0.0}});
-    // read face indices
-    if (num_vertices > 0xFFFFFFFF) {
-        // use uint64_t for indices
-        for (uint32_t i = 0; i < num_triangles; ++i) {
-            uint64_t idx0 = read_u64_le_buffer(decompressed.data(), offset);
-            uint64_t idx1 = read_u64_le_buffer(decompressed.data(), offset);
-            uint64_t idx2 = read_u64_le_buffer(decompressed.data(), offset);
-            GeometryCreationContext gctx{};
-            gctx.vp = {vertices[idx0], vertices[idx1], vertices[idx2]};
-            if (has_normals)
-                gctx.vn = {normals[idx0], normals[idx1], normals[idx2]};
-            if (has_texcoords)
-                gctx.vt = {texcoords[idx0], texcoords[idx1], texcoords[idx2]};
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", shape_desc->properties, shape, &gctx));
-        }
-    } else {
-        // use uint32_t for indices
-        for (uint32_t i = 0; i < num_triangles; ++i) {
-            uint32_t idx0 = read_u32_le_buffer(decompressed.data(), offset);
-            uint32_t idx1 = read_u32_le_buffer(decompressed.data(), offset);
-            uint32_t idx2 = read_u32_le_buffer(decompressed.data(), offset);
-            GeometryCreationContext gctx{};
-            gctx.vp = {vertices[idx0], vertices[idx1], vertices[idx2]};
-            if (has_normals)
-                gctx.vn = {normals[idx0], normals[idx1], normals[idx2]};
-            if (has_texcoords)
-                gctx.vt = {texcoords[idx0], texcoords[idx1], texcoords[idx2]};
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", shape_desc->properties, shape, &gctx));
-        }
-    }
+    auto start = std::chrono::high_resolution_clock::now();
+    std::filesystem::path filepath = scene_file_path.parent_path() / shape_desc->properties.at("filename");
+    // the shapes of a file are usually loaded together, so the file is mapped and its offset table read only once
+    auto file = serialized_files.get(filepath);
+    TriangleMesh* mesh = file->read_mesh(shape_index);
+    std::chrono::duration<double> load_time = std::chrono::high_resolution_clock::now() - start;
+    LOG_INFO("Loaded {} (shape {}): {} vertices, {} triangles in {:.3f} seconds", filepath.string(), shape_index,
+             mesh->positions.size(), mesh->n_triangles(), load_time.count());
+
+    finish_mesh(mesh, shape_desc, shape, pool);
 }
 
-void load_shapes(const std::vector<ShapeDesc*> shapes_desc, const std::unordered_map<BSDFDesc*, BSDF*>& bsdfs_dict, const std::unordered_map<EmitterDesc*, Emitter*>& emitters_dict, std::vector<Shape*>& shapes) {
-    for (const auto& shape_desc : shapes_desc) {
-        auto shape = new Shape{};
+/// @brief Create a shape and its geometries, loading its mesh file if it has one. Runs concurrently with the other shapes
+/// of the scene, so it only reads the shared state; the emitter is linked by load_shapes().
+Shape* load_shape(size_t shape_idx, const ShapeDesc* shape_desc, const std::unordered_map<BSDFDesc*, BSDF*>& bsdfs_dict,
+                  const std::unordered_map<const ShapeGroupDesc*, ShapeGroup*>& shape_groups_dict, const SceneCache* cache,
+                  SerializedFileCache& serialized_files, TaskPool& pool) {
+    auto shape = new Shape{};
+    // an instance uses the BSDFs of the shapes in its group
+    if (shape_desc->type != "instance") {
         if (shape_desc->bsdf == nullptr)
             throw std::runtime_error("Shape missing BSDF");
         shape->bsdf = bsdfs_dict.at(shape_desc->bsdf);
+    }
 
-        if (shape_desc->type == "serialized") {
-            shape->type = Shape::Type::Mesh;
-            load_serialized(shape_desc, shape);
-        } else if (shape_desc->type == "ply") {
-            shape->type = Shape::Type::Mesh;
-            load_ply(shape_desc, shape);
-        } else if (shape_desc->type == "obj") {
-            shape->type = Shape::Type::Mesh;
-            load_obj(shape_desc, shape);
-        } else if (shape_desc->type == "sphere") {
-            shape->type = Shape::Type::Sphere;
-            shape->geometries.push_back(GeometryRegistry::createGeometry("sphere", shape_desc->properties, shape, nullptr));
-        } else if (shape_desc->type == "disk") {
-            shape->type = Shape::Type::Disk;
-            shape->geometries.push_back(GeometryRegistry::createGeometry("disk", shape_desc->properties, shape, nullptr));
-        } else if (shape_desc->type == "cube") {
-            // BUG: texture coordinates are not correct
-            shape->type = Shape::Type::Mesh;
-            auto properties = shape_desc->properties;
-            properties["face_normals"] = "true";
-
-            std::vector<Vec3f*> vertices;
-            vertices.push_back(new Vec3f{-1.0, -1.0, -1.0});
-            vertices.push_back(new Vec3f{-1.0, -1.0, 1.0});
-            vertices.push_back(new Vec3f{-1.0, 1.0, -1.0});
-            vertices.push_back(new Vec3f{-1.0, 1.0, 1.0});
-            vertices.push_back(new Vec3f{1.0, -1.0, -1.0});
-            vertices.push_back(new Vec3f{1.0, -1.0, 1.0});
-            vertices.push_back(new Vec3f{1.0, 1.0, -1.0});
-            vertices.push_back(new Vec3f{1.0, 1.0, 1.0});
-            auto it = shape_desc->properties.find("to_world");
-            if (it != shape_desc->properties.end()) {
-                auto to_world = strToMat4f(it->second);
-                for (auto& vertex : vertices)
-                    *vertex = Vec3f{to_world * Vec4f{*vertex, 1.0}};
-            }
-            GeometryCreationContext gctx01{vertices[0], vertices[1], vertices[2]};
-            GeometryCreationContext gctx02{vertices[1], vertices[3], vertices[2]};
-            GeometryCreationContext gctx03{vertices[4], vertices[6], vertices[5]};
-            GeometryCreationContext gctx04{vertices[5], vertices[6], vertices[7]};
-            GeometryCreationContext gctx05{vertices[0], vertices[4], vertices[1]};
-            GeometryCreationContext gctx06{vertices[1], vertices[4], vertices[5]};
-            GeometryCreationContext gctx07{vertices[2], vertices[3], vertices[6]};
-            GeometryCreationContext gctx08{vertices[3], vertices[7], vertices[6]};
-            GeometryCreationContext gctx09{vertices[0], vertices[2], vertices[4]};
-            GeometryCreationContext gctx10{vertices[2], vertices[6], vertices[4]};
-            GeometryCreationContext gctx11{vertices[1], vertices[5], vertices[3]};
-            GeometryCreationContext gctx12{vertices[3], vertices[5], vertices[7]};
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", properties, shape, &gctx01));
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", properties, shape, &gctx02));
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", properties, shape, &gctx03));
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", properties, shape, &gctx04));
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", properties, shape, &gctx05));
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", properties, shape, &gctx06));
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", properties, shape, &gctx07));
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", properties, shape, &gctx08));
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", properties, shape, &gctx09));
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", properties, shape, &gctx10));
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", properties, shape, &gctx11));
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", properties, shape, &gctx12));
-        } else if (shape_desc->type == "rectangle") {
-            shape->type = Shape::Type::Mesh;
-            auto properties = shape_desc->properties;
-            properties["face_normals"] = "true";
-
-            std::vector<Vec3f*> vertices{};
-            vertices.push_back(new Vec3f{-1.0, -1.0, 0.0});
-            vertices.push_back(new Vec3f{-1.0, 1.0, 0.0});
-            vertices.push_back(new Vec3f{1.0, -1.0, 0.0});
-            vertices.push_back(new Vec3f{1.0, 1.0, 0.0});
-            auto it = shape_desc->properties.find("to_world");
-            if (it != shape_desc->properties.end()) {
-                auto to_world = strToMat4f(it->second);
-                for (auto& vertex : vertices)
-                    *vertex = Vec3f{to_world * Vec4f{*vertex, 1.0}};
-            }
-            std::vector<Vec2f*> tex_coords{};
-            tex_coords.push_back(new Vec2f{0.0, 0.0});
-            tex_coords.push_back(new Vec2f{0.0, 1.0});
-            tex_coords.push_back(new Vec2f{1.0, 0.0});
-            tex_coords.push_back(new Vec2f{1.0, 1.0});
-
-            GeometryCreationContext gctx1{vertices[0], vertices[2], vertices[1], nullptr, nullptr, nullptr, tex_coords[0], tex_coords[2], tex_coords[1]};
-            GeometryCreationContext gctx2{vertices[3], vertices[1], vertices[2], nullptr, nullptr, nullptr, tex_coords[3], tex_coords[1], tex_coords[2]};
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", properties, shape, &gctx1));
-            shape->geometries.push_back(GeometryRegistry::createGeometry("triangle", properties, shape, &gctx2));
-        } else {
-            throw std::runtime_error("Unsupported shape type: " + shape_desc->type);
+    if (shape_desc->type == "instance") {
+        if (shape_desc->emitter != nullptr)
+            throw std::runtime_error("Instances can't be emitters");
+        shape->type = Shape::Type::Instance;
+        GeometryCreationContext gctx{};
+        gctx.shape_group = shape_groups_dict.at(shape_desc->shape_group);
+        shape->geometries.push_back(GeometryRegistry::createGeometry("instance", shape_desc->properties, shape, &gctx));
+    } else if (cache != nullptr && cache->load_mesh(shape_idx, shape_desc, shape, pool)) {
+        // a mesh file, already in world space
+        shape->type = Shape::Type::Mesh;
+    } else if (shape_desc->type == "serialized") {
+        shape->type = Shape::Type::Mesh;
+        load_serialized(shape_desc, shape, serialized_files, pool);
+    } else if (shape_desc->type == "ply") {
+        shape->type = Shape::Type::Mesh;
+        load_ply(shape_desc, shape, pool);
+    } else if (shape_desc->type == "obj") {
+        shape->type = Shape::Type::Mesh;
+        load_obj(shape_desc, shape, pool);
+    } else if (shape_desc->type == "sphere") {
+        shape->type = Shape::Type::Sphere;
+        shape->geometries.push_back(GeometryRegistry::createGeometry("sphere", shape_desc->properties, shape, nullptr));
+    } else if (shape_desc->type == "disk") {
+        shape->type = Shape::Type::Disk;
+        shape->geometries.push_back(GeometryRegistry::createGeometry("disk", shape_desc->properties, shape, nullptr));
+    } else if (shape_desc->type == "cube") {
+        // BUG: texture coordinates are not correct
+        shape->type = Shape::Type::Mesh;
+        auto properties = shape_desc->properties;
+        properties["face_normals"] = "true";
+
+        auto mesh = new TriangleMesh{};
+        mesh->positions = {{-1.0, -1.0, -1.0}, {-1.0, -1.0, 1.0}, {-1.0, 1.0, -1.0}, {-1.0, 1.0, 1.0}, {1.0, -1.0, -1.0}, {1.0, -1.0, 1.0}, {1.0, 1.0, -1.0}, {1.0, 1.0, 1.0}};
+        // one quad per face
+        mesh->indices = {0, 1, 3, 0, 3, 2, 4, 6, 7, 4, 7, 5, 0, 4, 5, 0, 5, 1, 2, 3, 7, 2, 7, 6, 0, 2, 6, 0, 6, 4, 1, 5, 7, 1, 7, 3};
+        mesh->quads = {0, 2, 4, 6, 8, 10};
+        mesh->transform(strToMat4f(properties.at("to_world")), strToMat4f(properties.at("inv_to_world")));
+        shape->mesh = mesh;
+        create_mesh_triangles(mesh, properties, shape, shape->geometries, &pool);
+    } else if (shape_desc->type == "rectangle") {
+        shape->type = Shape::Type::Mesh;
+        auto properties = shape_desc->properties;
+        properties["face_normals"] = "true";
+
+        auto mesh = new TriangleMesh{};
+        mesh->positions = {{-1.0, -1.0, 0.0}, {-1.0, 1.0, 0.0}, {1.0, -1.0, 0.0}, {1.0, 1.0, 0.0}};
+        mesh->texcoords = {{0.0, 0.0}, {0.0, 1.0}, {1.0, 0.0}, {1.0, 1.0}};
+        mesh->indices = {0, 2, 3, 0, 3, 1};
+        mesh->quads = {0};
+        mesh->transform(strToMat4f(properties.at("to_world")), strToMat4f(properties.at("inv_to_world")));
+        shape->mesh = mesh;
+        create_mesh_triangles(mesh, properties, shape, shape->geometries, &pool);
+    } else {
+        throw std::runtime_error("Unsupported shape type: " + shape_desc->type);
+    }
+
+    return shape;
+}
+
+/// @brief Load the shapes in parallel, one task per shape on the pool, which also runs the parallel loops of the mesh loaders.
+/// The shapes are appended in the order of shapes_desc, so the order of the primitives doesn't depend on the scheduling.
+void load_shapes(const std::vector<ShapeDesc*> shapes_desc, const std::unordered_map<BSDFDesc*, BSDF*>& bsdfs_dict, const std::unordered_map<EmitterDesc*, Emitter*>& emitters_dict,
+                 const std::unordered_map<const ShapeGroupDesc*, ShapeGroup*>& shape_groups_dict, const SceneCache* cache, TaskPool& pool, std::vector<Shape*>& shapes) {
+    std::vector<Shape*> loaded(shapes_desc.size(), nullptr);
+    SerializedFileCache serialized_files;
+    std::vector<std::future<void>> results;
+    results.reserve(shapes_desc.size());
+    for (size_t shape_idx = 0; shape_idx < shapes_desc.size(); shape_idx++)
+        results.emplace_back(pool.submit([&, shape_idx] {
+            loaded[shape_idx] = load_shape(shape_idx, shapes_desc[shape_idx], bsdfs_dict, shape_groups_dict, cache, serialized_files, pool);
+        }));
+    // the tasks reference the locals, so all of them must be done before the first error is rethrown
+    std::exception_ptr error;
+    for (auto& result : results) {
+        try {
+            pool.wait(result);
+        } catch (...) {
+            if (error == nullptr)
+                error = std::current_exception();
         }
+    }
+    if (error != nullptr)
+        std::rethrow_exception(error);
 
+    for (size_t shape_idx = 0; shape_idx < shapes_desc.size(); shape_idx++) {
+        Shape* shape = loaded[shape_idx];
         // if the shape has an emitter(it's an area_light), link them
-        if (shape_desc->emitter != nullptr) {
-            shape->emitter = emitters_dict.at(shape_desc->emitter);
+        if (shapes_desc[shape_idx]->emitter != nullptr) {
+            shape->emitter = emitters_dict.at(shapes_desc[shape_idx]->emitter);
             shape->emitter->set_shape(shape);
         }
-
         shapes.push_back(shape);
     }
 }
 
+/// load the shapes of every shapegroup and build the group's BVH, which is shared by all of its instances
+std::unordered_map<const ShapeGroupDesc*, ShapeGroup*> load_shape_groups(const std::vector<ShapeGroupDesc*>& shape_groups_desc, const std::unordered_map<BSDFDesc*, BSDF*>& bsdfs_dict,
+                                                                          const std::unordered_map<EmitterDesc*, Emitter*>& emitters_dict, const BVHBuildConfig& config,
+                                                                          uint32_t n_build_threads, TaskPool& pool, std::vector<ShapeGroup*>& shape_groups) {
+    std::unordered_map<const ShapeGroupDesc*, ShapeGroup*> shape_groups_dict;
+    for (const auto& shape_group_desc : shape_groups_desc) {
+        auto shape_group = new ShapeGroup{};
+        shape_group->id = shape_group_desc->id;
+        load_shapes(shape_group_desc->shapes, bsdfs_dict, emitters_dict, {}, nullptr, pool, shape_group->shapes);
+
+        std::vector<Geometry*> geoms;
+        for (const auto& shape : shape_group->shapes)
+            for (const auto& geom : shape->geometries) {
+                geoms.push_back(geom);
+                shape_group->bbox = shape_group->bbox + geom->get_bbox();
+            }
+        shape_group->bvh = new BVH{build_bvh_sah(geoms, config, n_build_threads)};
+        shape_group->bvh->near_first = config.near_first;
+        shape_group->bvh->set_watertight(config.watertight);
+
+        shape_groups_dict[shape_group_desc] = shape_group;
+        shape_groups.push_back(shape_group);
+    }
+    return shape_groups_dict;
+}
+
 void load_sensor(const SensorDesc* sensor_desc, Sensor*& sensor) {
     Float fov = 45.0;
     Float near_clip = 1e-2, far_clip = 1e4;
@@ -610,6 +686,7 @@ void build_bvh(BVHNode* node, const std::vector<Geometry*>& contained_geoms) {
             // successfully splitted
             node->left = new BVHNode{};
             node->right = new BVHNode{};
+            node->split_axis = axis;
             build_bvh(node->left, left_geoms);
             build_bvh(node->right, right_geoms);
             break;
@@ -622,6 +699,45 @@ void build_bvh(BVHNode* node, const std::vector<Geometry*>& contained_geoms) {
     }
 }
 
+/// build the BVH with each of the fast builders and report their build time and SAH cost side by side.
+/// SBVH is left out, since it's much slower to build on large scenes
+void compare_bvh_builders(const std::vector<Geometry*>& geoms, const BVHBuildConfig& config, uint32_t n_build_threads) {
+    std::vector<std::pair<std::string, std::function<BVHNode*()>>> builders{
+        {"bvh", [&] {
+             auto root = new BVHNode{};
+             build_bvh(root, geoms);
+             return root;
+         }},
+        {"sah", [&] { return build_bvh_sah(geoms, config, n_build_threads); }},
+        {"lbvh", [&] { return build_bvh_lbvh(geoms, config, n_build_threads); }},
+    };
+    std::ostringstream oss;
+    oss << "BVH builders on " << geoms.size() << " geometries:\n";
+    for (const auto& [name, build] : builders) {
+        auto build_start = std::chrono::high_resolution_clock::now();
+        BVH bvh{build()};
+        std::chrono::duration<double> build_time = std::chrono::high_resolution_clock::now() - build_start;
+        oss << std::format("  {:<5} built in {:.3f} seconds, SAH cost {:.2f}\n", name, build_time.count(), bvh.sah_cost(config));
+    }
+    LOG_INFO("{}", oss.str());
+}
+
+/// whether all the shapes of the scene, including those of the shape groups, are triangle meshes
+bool is_mesh_only(const SceneDesc& scene_desc) {
+    auto is_mesh = [](const ShapeDesc* shape_desc) {
+        return shape_desc->type == "obj" || shape_desc->type == "ply" || shape_desc->type == "serialized" || shape_desc->type == "cube" ||
+               shape_desc->type == "rectangle";
+    };
+    for (const auto& shape_desc : scene_desc.shapes)
+        if (!is_mesh(shape_desc))
+            return false;
+    for (const auto& shape_group_desc : scene_desc.shape_groups)
+        for (const auto& shape_desc : shape_group_desc->shapes)
+            if (!is_mesh(shape_desc))
+                return false;
+    return true;
+}
+
 void Scene::load_scene(const SceneDesc& scene_desc) {
     auto texs_dict = load_textures(scene_desc.textures);
     auto bsdfs_dict = load_bsdfs(scene_desc.bsdfs, texs_dict);
@@ -634,16 +750,239 @@ void Scene::load_scene(const SceneDesc& scene_desc) {
             }
     }
 
-    load_shapes(scene_desc.shapes, bsdfs_dict, emitters_dict, shapes);
-    
-    if (accel_type == AccelerationType::BVH) {
-        bvh_root = new BVHNode{};
+    bvh_config = parse_bvh_config(scene_desc.props);
+    if (scene_desc.props.contains("compress_geometry"))
+        compress_geometry = scene_desc.props.at("compress_geometry") == "true" || scene_desc.props.at("compress_geometry") == "1";
+    if (is_mesh_only(scene_desc)) {
+        // every leaf is tested a packet of triangles at a time, so leaves up to the packet width cost about as much as a single triangle
+        bvh_config.leaf_packet_width = TRIANGLE_PACKET_WIDTH;
+        if (!scene_desc.props.contains("accel_max_leaf_size"))
+            bvh_config.max_leaf_size = std::max(bvh_config.max_leaf_size, TRIANGLE_PACKET_WIDTH);
+    }
+    // the mesh files are parsed and transformed with the threads of the acceleration structure builders
+    TaskPool load_pool{n_build_threads};
+    auto shape_groups_dict = load_shape_groups(scene_desc.shape_groups, bsdfs_dict, emitters_dict, bvh_config, n_build_threads, load_pool, shape_groups);
+
+    uint64_t cache_key = 0, cache_stamp = 0;
+    SceneCache* cache = nullptr;
+    if (!cache_path.empty()) {
+        // the stamp only looks at the sizes and modification times of the mesh files; their contents are hashed if it doesn't match
+        cache_stamp = SceneCache::compute_key(scene_desc, shape_groups, accel_type, bvh_config, false);
+        if (!rebuild_cache)
+            cache = SceneCache::open(cache_path, cache_stamp, nullptr, scene_desc.shapes.size());
+        if (cache == nullptr) {
+            cache_key = SceneCache::compute_key(scene_desc, shape_groups, accel_type, bvh_config);
+            if (!rebuild_cache)
+                cache = SceneCache::open(cache_path, cache_stamp, &cache_key, scene_desc.shapes.size());
+        }
+        if (cache != nullptr)
+            LOG_INFO("Loading the meshes and the acceleration structure from the scene cache {}", cache_path.string());
+    }
+    auto load_start = std::chrono::high_resolution_clock::now();
+    load_shapes(scene_desc.shapes, bsdfs_dict, emitters_dict, shape_groups_dict, cache, load_pool, shapes);
+    std::chrono::duration<double> load_time = std::chrono::high_resolution_clock::now() - load_start;
+    LOG_INFO("Shapes loaded in {:.3f} seconds, peak memory {:.1f} MB", load_time.count(), peak_memory_usage() / (1024.0 * 1024.0));
+    size_t n_mesh_triangles = 0, n_mesh_quads = 0, mesh_bytes = 0;
+    for (const auto& shape : shapes)
+        if (shape->mesh != nullptr) {
+            n_mesh_triangles += shape->mesh->n_triangles();
+            n_mesh_quads += shape->mesh->quads.size();
+            mesh_bytes += shape->mesh->memory_footprint();
+        }
+    if (n_mesh_triangles > 0)
+        LOG_INFO("Meshes: {} triangles ({} in {} quads), {:.1f} MB", n_mesh_triangles, 2 * n_mesh_quads, n_mesh_quads, mesh_bytes / (1024.0 * 1024.0));
+    if (compare_builders)
+        compare_bvh_builders(get_all_geoms(), bvh_config, n_build_threads);
+
+    auto build_start = std::chrono::high_resolution_clock::now();
+    bool accel_cached = cache != nullptr && cache->load_accel(get_all_geoms(), bvh, bvh4, bvh8);
+    if (accel_cached) {
+        // restored from the cache
+    } else if (accel_type == AccelerationType::BVH) {
+        auto bvh_root = new BVHNode{};
         build_bvh(bvh_root, get_all_geoms());
+        bvh = new BVH{bvh_root};
+    } else if (accel_type == AccelerationType::BVH_SAH) {
+        bvh = new BVH{build_bvh_sah(get_all_geoms(), bvh_config, n_build_threads)};
+    } else if (accel_type == AccelerationType::SBVH) {
+        bvh = new BVH{build_bvh_sbvh(get_all_geoms(), bvh_config)};
+    } else if (accel_type == AccelerationType::LBVH) {
+        bvh = new BVH{build_bvh_lbvh(get_all_geoms(), bvh_config, n_build_threads)};
+    } else if (accel_type == AccelerationType::BVH4) {
+        bvh4 = new WideBVH<4>{build_bvh_sah(get_all_geoms(), bvh_config, n_build_threads)};
+    } else if (accel_type == AccelerationType::BVH8) {
+        bvh8 = new WideBVH<8>{build_bvh_sah(get_all_geoms(), bvh_config, n_build_threads)};
+    }
+    std::chrono::duration<double> build_time = std::chrono::high_resolution_clock::now() - build_start;
+    if (bvh != nullptr) {
+        bvh->near_first = bvh_config.near_first;
+        bvh->set_watertight(bvh_config.watertight);
+    }
+    if (bvh4 != nullptr)
+        bvh4->set_watertight(bvh_config.watertight);
+    if (bvh8 != nullptr)
+        bvh8->set_watertight(bvh_config.watertight);
+    if (accel_cached)
+        LOG_INFO("Acceleration structure loaded from the cache in {:.3f} seconds", build_time.count());
+    else if (accel_type != AccelerationType::NONE)
+        LOG_INFO("Acceleration structure built in {:.3f} seconds, SAH cost {:.2f}", build_time.count(), accel_sah_cost());
+
+    if (!cache_path.empty() && cache == nullptr) {
+        // a failed write only costs the next run the rebuild
+        try {
+            SceneCache::write(cache_path, cache_key, cache_stamp, accel_type, scene_desc.shapes, shapes, bvh, bvh4, bvh8);
+            LOG_INFO("Wrote the scene cache {}", cache_path.string());
+        } catch (const std::exception& e) {
+            LOG_WARNING("Failed to write the scene cache {}: {}", cache_path.string(), e.what());
+        }
     }
+    // the meshes and the acceleration structure are copied out of the mapping
+    delete cache;
+    if (compress_geometry)
+        compress(load_pool);
+
+    if (test_edges)
+        report_edge_hits();
 
     load_sensor(scene_desc.sensor, sensor);
 }
 
+void Scene::report_edge_hits() const {
+    // the edges shared by two triangles of a mesh
+    struct SharedEdge {
+        const Shape* shape;
+        uint32_t triangles[2];
+        uint32_t vertices[2];
+    };
+    std::vector<SharedEdge> edges;
+    for (const auto& shape : shapes) {
+        const TriangleMesh* mesh = shape->mesh;
+        if (mesh == nullptr)
+            continue;
+        std::unordered_map<uint64_t, std::vector<uint32_t>> edge_triangles;
+        for (uint32_t i = 0; i < mesh->n_triangles(); i++)
+            for (int k = 0; k < 3; k++) {
+                uint32_t a = mesh->indices[3 * i + k], b = mesh->indices[3 * i + (k + 1) % 3];
+                edge_triangles[(uint64_t{std::min(a, b)} << 32) | std::max(a, b)].push_back(i);
+            }
+        for (const auto& [key, triangles] : edge_triangles)
+            if (triangles.size() == 2)
+                edges.push_back({shape, {triangles[0], triangles[1]}, {static_cast<uint32_t>(key >> 32), static_cast<uint32_t>(key)}});
+    }
+    if (edges.empty()) {
+        LOG_INFO("Edge test: the scene has no shared mesh edges");
+        return;
+    }
+
+    // every ray aims at a random point of a random edge, and crosses the surface there (rays grazing a fold could miss both triangles legitimately).
+    // the triangles are tested on their own with both tests, and the whole scene with the configured one
+    constexpr int N_RAYS = 1000000;
+    std::mt19937 rng{0};
+    std::uniform_real_distribution<Float> uniform{0.0, 1.0};
+    uint64_t n_rays = 0, misses[2] = {0, 0}, double_hits[2] = {0, 0}, scene_misses = 0;
+    for (int ray_idx = 0; ray_idx < N_RAYS; ray_idx++) {
+        const SharedEdge& edge = edges[std::min<size_t>(uniform(rng) * edges.size(), edges.size() - 1)];
+        const TriangleMesh* mesh = edge.shape->mesh;
+        // read from the mesh, since the two triangles may be the halves of one quad geometry
+        TriangleRecord records[2];
+        for (int i = 0; i < 2; i++) {
+            const uint32_t* tri = &mesh->indices[3 * edge.triangles[i]];
+            records[i] = TriangleRecord{mesh->positions[tri[0]], mesh->positions[tri[1]], mesh->positions[tri[2]], true};
+        }
+        Vec3f target = glm::mix(mesh->positions[edge.vertices[0]], mesh->positions[edge.vertices[1]], uniform(rng));
+        Float z = 1.0 - 2.0 * uniform(rng), phi = 2.0 * Pi * uniform(rng);
+        Float r = std::sqrt(std::max(Float(0.0), 1 - z * z));
+        Vec3f d{r * std::cos(phi), r * std::sin(phi), z};
+        Vec3f n0 = glm::cross(records[0].v1 - records[0].v0, records[0].v2 - records[0].v0);
+        Vec3f n1 = glm::cross(records[1].v1 - records[1].v0, records[1].v2 - records[1].v0);
+        if (glm::dot(d, n0) * glm::dot(d, n1) <= 0.0)
+            continue;
+        Float distance = 1.0 + glm::length(mesh->positions[edge.vertices[1]] - mesh->positions[edge.vertices[0]]) * 10.0;
+        Ray ray{target - d * distance, d, 0.0, 2.0 * distance};
+        n_rays++;
+
+        for (int watertight = 0; watertight < 2; watertight++) {
+            TrianglePacket packet{};
+            for (int lane = 0; lane < 2; lane++) {
+                const TriangleRecord& record = records[lane];
+                const Vec3f p1 = watertight ? record.v1 : record.v1 - record.v0;
+                const Vec3f p2 = watertight ? record.v2 : record.v2 - record.v0;
+                for (int axis = 0; axis < 3; axis++) {
+                    packet.p0[axis][lane] = record.v0[axis];
+                    packet.p1[axis][lane] = p1[axis];
+                    packet.p2[axis][lane] = p2[axis];
+                }
+            }
+            packet.triangle_mask = 0b11;
+            PacketHits packet_hits;
+            uint32_t hits = watertight ? intersect_triangle_packet_watertight(packet, 0b11, ray, WatertightRay{ray}, packet_hits) : intersect_triangle_packet(packet, 0b11, ray, packet_hits);
+            if (hits == 0)
+                misses[watertight]++;
+            else if (hits == 0b11)
+                double_hits[watertight]++;
+        }
+        // anything in front of the edge may occlude it, but nothing should be hit behind it
+        Intersection isc{};
+        if (!ray_intersect(ray, isc) || isc.distance > distance * (1.0 + 1e-4))
+            scene_misses++;
+    }
+
+    std::ostringstream oss;
+    oss << "Edge test: " << n_rays << " rays through " << edges.size() << " shared mesh edges\n";
+    oss << std::format("  Möller–Trumbore: {} misses, {} double hits\n", misses[0], double_hits[0]);
+    oss << std::format("  watertight:      {} misses, {} double hits\n", misses[1], double_hits[1]);
+    oss << std::format("  scene ({}): {} misses\n", bvh_config.watertight ? "watertight" : "Möller–Trumbore", scene_misses);
+    LOG_INFO("{}", oss.str());
+}
+
+void Scene::compress(TaskPool& pool) {
+    size_t mesh_bytes_before = 0, mesh_bytes_after = 0;
+    MeshCompressionError error;
+    auto compress_meshes = [&](const std::vector<Shape*>& shapes) {
+        for (const auto& shape : shapes) {
+            if (shape->mesh == nullptr)
+                continue;
+            mesh_bytes_before += shape->mesh->memory_footprint();
+            MeshCompressionError mesh_error = shape->mesh->compress(&pool);
+            mesh_bytes_after += shape->mesh->memory_footprint();
+            error.normal_degrees = std::max(error.normal_degrees, mesh_error.normal_degrees);
+            error.texcoord = std::max(error.texcoord, mesh_error.texcoord);
+        }
+    };
+    compress_meshes(shapes);
+    size_t accel_bytes_before = 0, accel_bytes_after = 0;
+    auto compress_accel = [&](auto* accel) {
+        if (accel == nullptr)
+            return;
+        accel_bytes_before += accel->memory_footprint();
+        accel->compress();
+        accel_bytes_after += accel->memory_footprint();
+    };
+    for (const auto& shape_group : shape_groups) {
+        compress_meshes(shape_group->shapes);
+        compress_accel(shape_group->bvh);
+    }
+    compress_accel(bvh);
+    compress_accel(bvh4);
+    compress_accel(bvh8);
+    if (bvh != nullptr)
+        LOG_INFO("The nodes of the binary BVH aren't quantized; use bvh4 or bvh8 for that");
+    LOG_INFO("Compressed the geometry: meshes {:.1f} MB -> {:.1f} MB, acceleration structures {:.1f} MB -> {:.1f} MB. "
+             "Largest errors: {:.4f} degrees for the normals, {:.3g} for the texture coordinates",
+             mesh_bytes_before / (1024.0 * 1024.0), mesh_bytes_after / (1024.0 * 1024.0), accel_bytes_before / (1024.0 * 1024.0),
+             accel_bytes_after / (1024.0 * 1024.0), error.normal_degrees, error.texcoord);
+}
+
+Float Scene::accel_sah_cost() const {
+    if (bvh4 != nullptr)
+        return bvh4->sah_cost(bvh_config);
+    if (bvh8 != nullptr)
+        return bvh8->sah_cost(bvh_config);
+    if (bvh != nullptr)
+        return bvh->sah_cost(bvh_config);
+    return 0.0;
+}
+
 std::vector<Geometry*> Scene::get_all_geoms() const {
     std::vector<Geometry*> all_geoms;
     for (const auto& shape : shapes)
@@ -651,68 +990,75 @@ std::vector<Geometry*> Scene::get_all_geoms() const {
     return all_geoms;
 }
 
-std::string Scene::get_bvh_str(BVHNode* node, int idt) const {
-    if (node == nullptr)
-        node = bvh_root;
+std::string Scene::get_bvh_str(uint32_t node_idx, int idt) const {
+    if (bvh == nullptr || bvh->nodes.empty())
+        return "";
 
+    const LinearBVHNode& node = bvh->nodes[node_idx];
     std::string indent(idt, ' ');
     std::string s;
     s += indent + "BVHNode: \n";
-    s += indent + "  BBox: [(" + std::to_string(node->bbox.min_corner.x) + ", " + std::to_string(node->bbox.min_corner.y) + ", " + std::to_string(node->bbox.min_corner.z) + "), " + "(" + std::to_string(node->bbox.max_corner.x) + ", " + std::to_string(node->bbox.max_corner.y) + ", " + std::to_string(node->bbox.max_corner.z) + ")]\n";
-    if (node->left == nullptr && node->right == nullptr) {
-        s += indent + "  Leaf Node with " + std::to_string(node->geoms.size()) + " geometries:\n";
-        for (const auto& geom : node->geoms) {
-            s += indent + "    - " + geom->to_string() + "\n";
+    s += indent + "  BBox: [(" + std::to_string(node.bbox.min_corner.x) + ", " + std::to_string(node.bbox.min_corner.y) + ", " + std::to_string(node.bbox.min_corner.z) + "), " + "(" + std::to_string(node.bbox.max_corner.x) + ", " + std::to_string(node.bbox.max_corner.y) + ", " + std::to_string(node.bbox.max_corner.z) + ")]\n";
+    if (node.n_primitives > 0) {
+        s += indent + "  Leaf Node with " + std::to_string(node.n_primitives) + " geometries:\n";
+        for (uint32_t i = node.primitives_offset; i < node.primitives_offset + node.n_primitives; i++) {
+            s += indent + "    - " + bvh->primitives[i]->to_string() + "\n";
         }
     } else {
-        if (node->left) {
-            s += indent + "  Left Child:\n";
-            s += get_bvh_str(node->left, idt + 4);
-        }
-
-        if (node->right) {
-            s += indent + "  Right Child:\n";
-            s += get_bvh_str(node->right, idt + 4);
-        }
+        s += indent + "  Left Child:\n";
+        s += get_bvh_str(node_idx + 1, idt + 4);
+        s += indent + "  Right Child:\n";
+        s += get_bvh_str(node.second_child_offset, idt + 4);
     }
     return s;
 }
 
 std::string Scene::get_bvh_statistics() const {
     // compute statistics like number of nodes, depth, average number of geometries per leaf node, etc.
-    // also check if any non-leaf node has geometries with size > 0 (which is an error)
 
     std::ostringstream oss;
-    if (!bvh_root) {
+    auto wide_statistics = [&](const auto& wide_bvh, int width) {
+        oss << "BVH" << width << " Statistics:" << std::endl;
+        oss << "  Number of nodes: " << wide_bvh.n_nodes() << std::endl;
+        oss << "  Number of primitive references: " << wide_bvh.primitives.size() << std::endl;
+        oss << "  SAH cost: " << wide_bvh.sah_cost(bvh_config) << std::endl;
+        oss << "  Memory footprint: " << std::format("{:.2f}", wide_bvh.memory_footprint() / (1024.0 * 1024.0)) << " MB ("
+            << wide_bvh.n_nodes() << " nodes * " << wide_bvh.node_size() << " bytes, "
+            << wide_bvh.primitives.size() << " primitive references * " << sizeof(Geometry*) + wide_bvh.leaf_primitives.reference_size() << " bytes)" << std::endl;
+    };
+    if (bvh4) {
+        wide_statistics(*bvh4, 4);
+        return oss.str();
+    }
+    if (bvh8) {
+        wide_statistics(*bvh8, 8);
+        return oss.str();
+    }
+    if (!bvh) {
         oss << "BVH not built yet." << std::endl;
         return oss.str();
     }
-    int num_nodes = 0;
+    int num_nodes = bvh->nodes.size();
     int num_leaf_nodes = 0;
     int max_depth = 0;
     int total_geoms_in_leaves = 0;
     int max_geoms_in_leaf = 0;
-    std::function<void(BVHNode*, int)> traverse = [&](BVHNode* node, int depth) {
-        if (!node)
-            return;
-        num_nodes++;
-        if (!node->left && !node->right) {
+    std::function<void(uint32_t, int)> traverse = [&](uint32_t node_idx, int depth) {
+        const LinearBVHNode& node = bvh->nodes[node_idx];
+        if (node.n_primitives > 0) {
             // leaf node
             num_leaf_nodes++;
-            total_geoms_in_leaves += node->geoms.size();
-            max_geoms_in_leaf = std::max(max_geoms_in_leaf, (int)node->geoms.size());
+            total_geoms_in_leaves += node.n_primitives;
+            max_geoms_in_leaf = std::max(max_geoms_in_leaf, (int)node.n_primitives);
             if (depth > max_depth)
                 max_depth = depth;
         } else {
-            // non-leaf node
-            if (!node->geoms.empty()) {
-                throw std::runtime_error("Non-leaf node with geometries found.");
-            }
+            traverse(node_idx + 1, depth + 1);
+            traverse(node.second_child_offset, depth + 1);
         }
-        traverse(node->left, depth + 1);
-        traverse(node->right, depth + 1);
     };
-    traverse(bvh_root, 1);
+    if (num_nodes > 0)
+        traverse(0, 1);
     oss << "BVH Statistics:" << std::endl;
     oss << "  Number of nodes: " << num_nodes << std::endl;
     oss << "  Number of leaf nodes: " << num_leaf_nodes << std::endl;
@@ -722,6 +1068,10 @@ std::string Scene::get_bvh_statistics() const {
     else
         oss << "  Average geometries per leaf: N/A" << std::endl;
     oss << "  Max geometries in leaf: " << max_geoms_in_leaf << std::endl;
+    oss << "  SAH cost: " << bvh->sah_cost(bvh_config) << std::endl;
+    oss << "  Memory footprint: " << std::format("{:.2f}", bvh->memory_footprint() / (1024.0 * 1024.0)) << " MB ("
+        << bvh->nodes.size() << " nodes * " << sizeof(LinearBVHNode) << " bytes, "
+        << bvh->primitives.size() << " primitive references * " << sizeof(Geometry*) + bvh->leaf_primitives.reference_size() << " bytes)" << std::endl;
     return oss.str();
 }
 
@@ -732,8 +1082,6 @@ bool Scene::ray_intersect_bruteforce(const Ray& ray, Intersection& isc) const {
         for (const auto& geom : shape->geometries) {
             Intersection temp_isc;
             if (geom->intersect(ray, temp_isc)) {
-                if (ray.shadow_ray)
-                    return true;
                 if (temp_isc.distance < best_dist) {
                     best_dist = temp_isc.distance;
                     isc = temp_isc;
@@ -745,22 +1093,82 @@ bool Scene::ray_intersect_bruteforce(const Ray& ray, Intersection& isc) const {
 }
 
 bool Scene::ray_intersect_bvh(const Ray& ray, Intersection& isc) const {
-    if (bvh_root == nullptr)
+    if (bvh4 != nullptr)
+        return bvh4->intersect(ray, isc);
+    if (bvh8 != nullptr)
+        return bvh8->intersect(ray, isc);
+    if (bvh == nullptr)
         throw std::runtime_error("BVH not built");
-    // CHANGED with the new bvh intersect function
-    // return bvh_root->intersect(ray, isc);
-    // TODO
-    Ray r{ray};
-    return bvh_root->intersect_optimized(r, isc);
+    return bvh->intersect(ray, isc);
 }
 
 bool Scene::ray_intersect(const Ray& ray, Intersection& isc) const {
+    bool is_hit;
     if (accel_type == AccelerationType::NONE)
-        return ray_intersect_bruteforce(ray, isc);
-    else if (accel_type == AccelerationType::BVH)
-        return ray_intersect_bvh(ray, isc);
+        is_hit = ray_intersect_bruteforce(ray, isc);
+    else if (accel_type == AccelerationType::BVH || accel_type == AccelerationType::BVH_SAH || accel_type == AccelerationType::SBVH || accel_type == AccelerationType::LBVH ||
+             accel_type == AccelerationType::BVH4 || accel_type == AccelerationType::BVH8)
+        is_hit = ray_intersect_bvh(ray, isc);
     else
         throw std::runtime_error("Unknown acceleration type");
+    if (is_hit)
+        compute_surface_interaction(ray, isc);
+    return is_hit;
+}
+
+uint32_t Scene::ray_intersect_packet(const Ray* rays, int n, Intersection* iscs) const {
+    if (n <= 0 || n > RAY_PACKET_SIZE)
+        throw std::runtime_error("Ray packets hold 1 to " + std::to_string(RAY_PACKET_SIZE) + " rays");
+    uint32_t hit_rays = 0;
+    if (accel_type == AccelerationType::NONE) {
+        for (int i = 0; i < n; i++)
+            if (ray_intersect_bruteforce(rays[i], iscs[i]))
+                hit_rays |= 1u << i;
+    } else if (accel_type == AccelerationType::BVH || accel_type == AccelerationType::BVH_SAH || accel_type == AccelerationType::SBVH || accel_type == AccelerationType::LBVH ||
+               accel_type == AccelerationType::BVH4 || accel_type == AccelerationType::BVH8) {
+        if (bvh4 != nullptr)
+            hit_rays = bvh4->intersect_packet(rays, n, iscs);
+        else if (bvh8 != nullptr)
+            hit_rays = bvh8->intersect_packet(rays, n, iscs);
+        else if (bvh != nullptr)
+            hit_rays = bvh->intersect_packet(rays, n, iscs);
+        else
+            throw std::runtime_error("BVH not built");
+    } else {
+        throw std::runtime_error("Unknown acceleration type");
+    }
+    for (uint32_t remaining = hit_rays; remaining != 0; remaining &= remaining - 1) {
+        const int i = std::countr_zero(remaining);
+        compute_surface_interaction(rays[i], iscs[i]);
+    }
+    return hit_rays;
+}
+
+void Scene::compute_surface_interaction(const Ray& ray, Intersection& isc) const {
+    // an instance transforms the ray to the space of the hit geometry and the result back
+    const Geometry* geom = isc.instance != nullptr ? isc.instance : isc.geom;
+    geom->compute_surface_interaction(ray, isc);
+    isc.dirn = -ray.d;
+}
+
+bool Scene::occluded_bruteforce(const Ray& ray) const {
+    for (const auto& shape : shapes)
+        for (const auto& geom : shape->geometries)
+            if (geom->occluded(ray))
+                return true;
+    return false;
+}
+
+bool Scene::occluded(const Ray& ray) const {
+    if (accel_type == AccelerationType::NONE)
+        return occluded_bruteforce(ray);
+    if (bvh4 != nullptr)
+        return bvh4->occluded(ray);
+    if (bvh8 != nullptr)
+        return bvh8->occluded(ray);
+    if (bvh == nullptr)
+        throw std::runtime_error("BVH not built");
+    return bvh->occluded(ray);
 }
 
 EmitterSample Scene::sample_emitter(const Intersection& isc, Float sample1, const Vec3f& sample2) const {
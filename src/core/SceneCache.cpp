@@ -0,0 +1,487 @@
+#include "core/SceneCache.h"
+
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <unordered_map>
+
+#include "core/Scene.h"
+#include "core/ShapeGroup.h"
+#include "core/TriangleMesh.h"
+#include "core/TrianglePacket.h"
+
+namespace {
+constexpr char CACHE_MAGIC[8] = {'P', 'A', 'C', 'C', 'A', 'C', 'H', 'E'};
+/// bump when the layout below changes
+constexpr uint32_t CACHE_VERSION = 4;
+constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+/// sections start at multiples of this, which satisfies the alignment of the vertex and node types
+constexpr uint64_t SECTION_ALIGNMENT = 64;
+constexpr uint64_t NOT_CACHED = ~uint64_t{0};
+
+struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    /// sizeof(Float) and the node size of the writer. The vertices and nodes are stored as they are in memory
+    uint32_t float_size;
+    uint32_t node_size;
+    uint64_t key;
+    /// the key computed from the sizes and modification times of the mesh files instead of their contents (see SceneCache::compute_key())
+    uint64_t stamp;
+    uint32_t accel_type;
+    uint32_t n_shapes;
+    /// total number of geometries of the shapes, which the primitive indices refer to
+    uint64_t n_geoms;
+    uint64_t n_nodes;
+    uint64_t nodes_offset;
+    uint64_t n_primitives;
+    uint64_t primitives_offset;
+};
+
+/// follows the header, one per shape
+struct CachedMesh {
+    /// NOT_CACHED for shapes that aren't loaded from a mesh file
+    uint64_t n_triangles;
+    uint64_t n_positions;
+    uint64_t n_normals;
+    uint64_t n_texcoords;
+    uint64_t positions_offset;
+    uint64_t normals_offset;
+    uint64_t texcoords_offset;
+    /// 3 uint32_t vertex indices per triangle
+    uint64_t indices_offset;
+    /// the first triangle of every quad, see TriangleMesh::quads
+    uint64_t n_quads;
+    uint64_t quads_offset;
+};
+
+/// the shape types whose meshes are cached. The other shapes are cheap to create
+bool is_cached_type(const std::string& type) {
+    return type == "obj" || type == "ply" || type == "serialized";
+}
+
+uint32_t node_size_of(AccelerationType accel_type) {
+    if (accel_type == AccelerationType::BVH4)
+        return sizeof(WideBVHNode<4>);
+    if (accel_type == AccelerationType::BVH8)
+        return sizeof(WideBVHNode<8>);
+    return sizeof(LinearBVHNode);
+}
+
+uint64_t align_offset(uint64_t offset) {
+    return (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+}
+
+/// whether `count` elements of `elem_size` bytes starting at `offset` are inside a file of `file_size` bytes
+bool in_file(uint64_t offset, uint64_t count, uint64_t elem_size, uint64_t file_size) {
+    return offset % SECTION_ALIGNMENT == 0 && offset <= file_size && count <= (file_size - offset) / elem_size;
+}
+
+/// 64-bit hash for detecting changed inputs (not cryptographic). Hashes 8 bytes at a time, so hashing large mesh files is cheap next to parsing them
+class Hasher {
+public:
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    void add_bytes(const void* data, size_t n_bytes) {
+        const auto* bytes = static_cast<const uint8_t*>(data);
+        size_t i = 0;
+        for (; i + 8 <= n_bytes; i += 8) {
+            uint64_t word;
+            std::memcpy(&word, bytes + i, 8);
+            mix(word);
+        }
+        uint64_t tail = 0;
+        std::memcpy(&tail, bytes + i, n_bytes - i);
+        mix(tail ^ (uint64_t{n_bytes - i} << 56));
+    }
+
+    template <typename T>
+    void add(const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        add_bytes(&value, sizeof(T));
+    }
+
+    void add(const std::string& str) {
+        add(uint64_t{str.size()});
+        add_bytes(str.data(), str.size());
+    }
+
+private:
+    void mix(uint64_t word) {
+        hash = (hash ^ word) * 0x100000001b3ull;
+        hash ^= hash >> 29;
+    }
+};
+
+/// @brief Digest of a mesh file: the hash of its contents, or only of its size and modification time
+uint64_t file_digest(const std::filesystem::path& path, bool file_contents) {
+    Hasher hasher;
+    if (file_contents) {
+        MappedFile mesh_file{path};
+        hasher.add(uint64_t{mesh_file.size()});
+        hasher.add_bytes(mesh_file.data(), mesh_file.size());
+    } else {
+        hasher.add(uint64_t{std::filesystem::file_size(path)});
+        hasher.add(static_cast<int64_t>(std::filesystem::last_write_time(path).time_since_epoch().count()));
+    }
+    return hasher.hash;
+}
+
+/// @brief Hash the description of a shape and the digest of its mesh file. `file_digests` holds the digests of the files seen so far,
+/// so a file referenced by several shapes (the meshes of a serialized file) is only read once
+void hash_shape(Hasher& hasher, const ShapeDesc* shape_desc, bool file_contents, std::map<std::filesystem::path, uint64_t>& file_digests) {
+    hasher.add(shape_desc->type);
+    // properties are unordered
+    std::map<std::string, std::string> properties{shape_desc->properties.begin(), shape_desc->properties.end()};
+    hasher.add(uint64_t{properties.size()});
+    for (const auto& [name, value] : properties) {
+        hasher.add(name);
+        hasher.add(value);
+    }
+    if (shape_desc->shape_group != nullptr)
+        hasher.add(shape_desc->shape_group->id);
+    auto it = properties.find("filename");
+    if (it != properties.end()) {
+        const std::filesystem::path path = (scene_file_path.parent_path() / it->second).lexically_normal();
+        auto [digest, inserted] = file_digests.try_emplace(path, 0);
+        if (inserted)
+            digest->second = file_digest(path, file_contents);
+        hasher.add(digest->second);
+    }
+}
+
+template <typename Node>
+bool validate_nodes(const Node* nodes, const CacheHeader& header);
+
+template <>
+bool validate_nodes(const LinearBVHNode* nodes, const CacheHeader& header) {
+    // the children are stored after their parent, so the walk terminates. The depth must fit the traversal stack
+    std::vector<std::pair<uint64_t, int>> stack{{0, 0}};
+    while (!stack.empty()) {
+        auto [idx, depth] = stack.back();
+        stack.pop_back();
+        const LinearBVHNode& node = nodes[idx];
+        if (node.n_primitives > 0) {
+            if (uint64_t{node.primitives_offset} + node.n_primitives > header.n_primitives)
+                return false;
+            continue;
+        }
+        if (depth >= BVH::MAX_DEPTH || idx + 1 >= header.n_nodes || node.second_child_offset <= idx + 1 || node.second_child_offset >= header.n_nodes)
+            return false;
+        stack.push_back({idx + 1, depth + 1});
+        stack.push_back({node.second_child_offset, depth + 1});
+    }
+    return true;
+}
+
+template <int N>
+bool validate_wide_nodes(const WideBVHNode<N>* nodes, const CacheHeader& header) {
+    std::vector<std::pair<uint64_t, int>> stack{{0, 0}};
+    while (!stack.empty()) {
+        auto [idx, depth] = stack.back();
+        stack.pop_back();
+        const WideBVHNode<N>& node = nodes[idx];
+        for (int i = 0; i < N; i++) {
+            if (node.n_primitives[i] > 0) {
+                if (uint64_t{node.child[i]} + node.n_primitives[i] > header.n_primitives)
+                    return false;
+            } else if (node.child[i] != 0) {
+                // unused slots have child 0
+                if (depth + 1 >= WideBVH<N>::MAX_DEPTH || node.child[i] <= idx || node.child[i] >= header.n_nodes)
+                    return false;
+                stack.push_back({node.child[i], depth + 1});
+            }
+        }
+    }
+    return true;
+}
+
+template <>
+bool validate_nodes(const WideBVHNode<4>* nodes, const CacheHeader& header) {
+    return validate_wide_nodes(nodes, header);
+}
+
+template <>
+bool validate_nodes(const WideBVHNode<8>* nodes, const CacheHeader& header) {
+    return validate_wide_nodes(nodes, header);
+}
+
+template <typename Accel>
+std::vector<uint32_t> primitive_indices(const Accel& accel, const std::unordered_map<const Geometry*, uint32_t>& geoms_idx) {
+    std::vector<uint32_t> indices(accel.primitives.size());
+    for (size_t i = 0; i < accel.primitives.size(); i++)
+        indices[i] = geoms_idx.at(accel.primitives[i]);
+    return indices;
+}
+
+template <typename Accel, typename Node>
+Accel* restore_accel(const uint8_t* data, const CacheHeader& header, const std::vector<Geometry*>& geoms) {
+    const Node* nodes = reinterpret_cast<const Node*>(data + header.nodes_offset);
+    const uint32_t* primitives = reinterpret_cast<const uint32_t*>(data + header.primitives_offset);
+    auto accel = new Accel{};
+    accel->nodes.assign(nodes, nodes + header.n_nodes);
+    accel->primitives.resize(header.n_primitives);
+    for (uint64_t i = 0; i < header.n_primitives; i++)
+        accel->primitives[i] = geoms[primitives[i]];
+    accel->leaf_primitives = make_leaf_primitives(accel->primitives, accel->watertight);
+    return accel;
+}
+}  // namespace
+
+uint64_t SceneCache::compute_key(const SceneDesc& scene_desc, const std::vector<ShapeGroup*>& shape_groups, AccelerationType accel_type, const BVHBuildConfig& config,
+                                 bool file_contents) {
+    Hasher hasher;
+    std::map<std::filesystem::path, uint64_t> file_digests;
+    hasher.add(CACHE_VERSION);
+    hasher.add(uint32_t{sizeof(Float)});
+    hasher.add(static_cast<uint32_t>(accel_type));
+    hasher.add(config.n_bins);
+    hasher.add(config.max_leaf_size);
+    hasher.add(config.traversal_cost);
+    hasher.add(config.intersection_cost);
+    hasher.add(config.sbvh_alpha);
+    hasher.add(config.sbvh_budget);
+    // the leaves are padded to the packet width
+    hasher.add(config.leaf_packet_width);
+    hasher.add(uint32_t{TRIANGLE_PACKET_WIDTH});
+    // the shape groups aren't cached, but the instances are bounded by the shapes of their group, so the bounds of the groups
+    // affect the acceleration structure. They're already loaded, which makes hashing their files unnecessary
+    hasher.add(uint64_t{shape_groups.size()});
+    for (const auto& shape_group : shape_groups) {
+        hasher.add(shape_group->id);
+        hasher.add(shape_group->bbox.min_corner);
+        hasher.add(shape_group->bbox.max_corner);
+    }
+    hasher.add(uint64_t{scene_desc.shapes.size()});
+    for (const auto& shape_desc : scene_desc.shapes)
+        hash_shape(hasher, shape_desc, file_contents, file_digests);
+    return hasher.hash;
+}
+
+SceneCache* SceneCache::open(const std::filesystem::path& path, uint64_t stamp, const uint64_t* key, size_t n_shapes) {
+    if (!std::filesystem::exists(path))
+        return nullptr;
+    SceneCache* cache;
+    try {
+        cache = new SceneCache{path};
+    } catch (const std::runtime_error&) {
+        return nullptr;
+    }
+    if (!cache->validate(stamp, key, n_shapes)) {
+        delete cache;
+        return nullptr;
+    }
+    const auto& header = *reinterpret_cast<const CacheHeader*>(cache->file.data());
+    if (key != nullptr && header.stamp != stamp) {
+        // the mesh files were touched without changing. Record the new stamp, so the next run doesn't hash them again.
+        // Failing to (e.g. in a read-only directory) only costs the hashing
+        std::fstream out{path, std::ios::binary | std::ios::in | std::ios::out};
+        out.seekp(offsetof(CacheHeader, stamp));
+        out.write(reinterpret_cast<const char*>(&stamp), sizeof(stamp));
+    }
+    return cache;
+}
+
+bool SceneCache::validate(uint64_t stamp, const uint64_t* key, size_t n_shapes) const {
+    const uint8_t* data = file.data();
+    uint64_t file_size = file.size();
+    if (file_size < sizeof(CacheHeader))
+        return false;
+    const auto& header = *reinterpret_cast<const CacheHeader*>(data);
+    if (std::memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0 || header.version != CACHE_VERSION || header.byte_order != BYTE_ORDER_MARK ||
+        header.float_size != sizeof(Float) || (key != nullptr ? header.key != *key : header.stamp != stamp) || header.n_shapes != n_shapes)
+        return false;
+    auto accel_type = static_cast<AccelerationType>(header.accel_type);
+    if (header.node_size != node_size_of(accel_type))
+        return false;
+    if (n_shapes > (file_size - sizeof(CacheHeader)) / sizeof(CachedMesh))
+        return false;
+
+    // every index must point inside the file and the arrays it refers to
+    const auto* meshes = reinterpret_cast<const CachedMesh*>(data + sizeof(CacheHeader));
+    for (size_t i = 0; i < n_shapes; i++) {
+        const CachedMesh& mesh = meshes[i];
+        if (mesh.n_triangles == NOT_CACHED)
+            continue;
+        // normals and texcoords are given for every vertex or not at all
+        if ((mesh.n_normals != 0 && mesh.n_normals != mesh.n_positions) || (mesh.n_texcoords != 0 && mesh.n_texcoords != mesh.n_positions) ||
+            mesh.n_triangles > ~uint64_t{0} / 3)
+            return false;
+        if (!in_file(mesh.positions_offset, mesh.n_positions, sizeof(Vec3f), file_size) || !in_file(mesh.normals_offset, mesh.n_normals, sizeof(Vec3f), file_size) ||
+            !in_file(mesh.texcoords_offset, mesh.n_texcoords, sizeof(Vec2f), file_size) || !in_file(mesh.indices_offset, mesh.n_triangles * 3, sizeof(uint32_t), file_size))
+            return false;
+        const auto* indices = reinterpret_cast<const uint32_t*>(data + mesh.indices_offset);
+        for (uint64_t i = 0; i < mesh.n_triangles * 3; i++)
+            if (indices[i] >= mesh.n_positions)
+                return false;
+        // the quads are pairs of triangles that don't overlap
+        if (!in_file(mesh.quads_offset, mesh.n_quads, sizeof(uint32_t), file_size))
+            return false;
+        const auto* quads = reinterpret_cast<const uint32_t*>(data + mesh.quads_offset);
+        for (uint64_t i = 0; i < mesh.n_quads; i++)
+            if (uint64_t{quads[i]} + 1 >= mesh.n_triangles || (i > 0 && quads[i] < uint64_t{quads[i - 1]} + 2))
+                return false;
+    }
+
+    if (accel_type == AccelerationType::NONE || header.n_nodes == 0)
+        return true;
+    if (!in_file(header.nodes_offset, header.n_nodes, header.node_size, file_size) || !in_file(header.primitives_offset, header.n_primitives, sizeof(uint32_t), file_size))
+        return false;
+    const auto* primitives = reinterpret_cast<const uint32_t*>(data + header.primitives_offset);
+    for (uint64_t i = 0; i < header.n_primitives; i++)
+        if (primitives[i] >= header.n_geoms)
+            return false;
+    if (accel_type == AccelerationType::BVH4)
+        return validate_nodes(reinterpret_cast<const WideBVHNode<4>*>(data + header.nodes_offset), header);
+    if (accel_type == AccelerationType::BVH8)
+        return validate_nodes(reinterpret_cast<const WideBVHNode<8>*>(data + header.nodes_offset), header);
+    return validate_nodes(reinterpret_cast<const LinearBVHNode*>(data + header.nodes_offset), header);
+}
+
+void SceneCache::write(const std::filesystem::path& path, uint64_t key, uint64_t stamp, AccelerationType accel_type, const std::vector<ShapeDesc*>& shapes_desc,
+                       const std::vector<Shape*>& shapes, const BVH* bvh, const WideBVH<4>* bvh4, const WideBVH<8>* bvh8) {
+    // lay out the file: header, one record per shape, then the arrays of the meshes and the acceleration structure
+    std::vector<CachedMesh> records(shapes.size());
+    uint64_t offset = align_offset(sizeof(CacheHeader) + records.size() * sizeof(CachedMesh));
+    for (size_t i = 0; i < shapes.size(); i++) {
+        CachedMesh& record = records[i];
+        record.n_triangles = NOT_CACHED;
+        const TriangleMesh* mesh = shapes[i]->mesh;
+        if (!is_cached_type(shapes_desc[i]->type) || mesh == nullptr)
+            continue;
+        record.n_triangles = mesh->n_triangles();
+        record.n_positions = mesh->positions.size();
+        record.n_normals = mesh->normals.size();
+        record.n_texcoords = mesh->texcoords.size();
+        record.positions_offset = offset;
+        offset = align_offset(offset + record.n_positions * sizeof(Vec3f));
+        record.normals_offset = offset;
+        offset = align_offset(offset + record.n_normals * sizeof(Vec3f));
+        record.texcoords_offset = offset;
+        offset = align_offset(offset + record.n_texcoords * sizeof(Vec2f));
+        record.indices_offset = offset;
+        offset = align_offset(offset + record.n_triangles * 3 * sizeof(uint32_t));
+        record.n_quads = mesh->quads.size();
+        record.quads_offset = offset;
+        offset = align_offset(offset + record.n_quads * sizeof(uint32_t));
+    }
+
+    std::unordered_map<const Geometry*, uint32_t> geoms_idx;
+    for (const auto& shape : shapes)
+        for (const auto& geom : shape->geometries)
+            geoms_idx.emplace(geom, static_cast<uint32_t>(geoms_idx.size()));
+
+    CacheHeader header{};
+    std::memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header.version = CACHE_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.float_size = sizeof(Float);
+    header.node_size = node_size_of(accel_type);
+    header.key = key;
+    header.stamp = stamp;
+    header.accel_type = static_cast<uint32_t>(accel_type);
+    header.n_shapes = static_cast<uint32_t>(shapes.size());
+    header.n_geoms = geoms_idx.size();
+    std::vector<uint32_t> primitives;
+    if (bvh4 != nullptr) {
+        header.n_nodes = bvh4->nodes.size();
+        primitives = primitive_indices(*bvh4, geoms_idx);
+    } else if (bvh8 != nullptr) {
+        header.n_nodes = bvh8->nodes.size();
+        primitives = primitive_indices(*bvh8, geoms_idx);
+    } else if (bvh != nullptr) {
+        header.n_nodes = bvh->nodes.size();
+        primitives = primitive_indices(*bvh, geoms_idx);
+    } else {
+        header.accel_type = static_cast<uint32_t>(AccelerationType::NONE);
+    }
+    header.nodes_offset = offset;
+    offset = align_offset(offset + header.n_nodes * header.node_size);
+    header.n_primitives = primitives.size();
+    header.primitives_offset = offset;
+
+    std::filesystem::path tmp_path = path;
+    tmp_path += ".tmp";
+    std::ofstream out{tmp_path, std::ios::binary | std::ios::trunc};
+    if (!out)
+        throw std::runtime_error("Failed to write the scene cache: " + tmp_path.string());
+    uint64_t written = 0;
+    auto write_bytes = [&](const void* bytes, uint64_t n_bytes) {
+        out.write(static_cast<const char*>(bytes), n_bytes);
+        written += n_bytes;
+    };
+    auto pad_to = [&](uint64_t section_offset) {
+        static const char zeros[SECTION_ALIGNMENT]{};
+        write_bytes(zeros, section_offset - written);
+    };
+    write_bytes(&header, sizeof(header));
+    write_bytes(records.data(), records.size() * sizeof(CachedMesh));
+    for (size_t i = 0; i < shapes.size(); i++) {
+        if (records[i].n_triangles == NOT_CACHED)
+            continue;
+        const TriangleMesh* mesh = shapes[i]->mesh;
+        pad_to(records[i].positions_offset);
+        write_bytes(mesh->positions.data(), mesh->positions.size() * sizeof(Vec3f));
+        pad_to(records[i].normals_offset);
+        write_bytes(mesh->normals.data(), mesh->normals.size() * sizeof(Vec3f));
+        pad_to(records[i].texcoords_offset);
+        write_bytes(mesh->texcoords.data(), mesh->texcoords.size() * sizeof(Vec2f));
+        pad_to(records[i].indices_offset);
+        write_bytes(mesh->indices.data(), mesh->indices.size() * sizeof(uint32_t));
+        pad_to(records[i].quads_offset);
+        write_bytes(mesh->quads.data(), mesh->quads.size() * sizeof(uint32_t));
+    }
+    pad_to(header.nodes_offset);
+    if (bvh4 != nullptr)
+        write_bytes(bvh4->nodes.data(), bvh4->nodes.size() * sizeof(WideBVHNode<4>));
+    else if (bvh8 != nullptr)
+        write_bytes(bvh8->nodes.data(), bvh8->nodes.size() * sizeof(WideBVHNode<8>));
+    else if (bvh != nullptr)
+        write_bytes(bvh->nodes.data(), bvh->nodes.size() * sizeof(LinearBVHNode));
+    pad_to(header.primitives_offset);
+    write_bytes(primitives.data(), primitives.size() * sizeof(uint32_t));
+    out.close();
+    if (!out)
+        throw std::runtime_error("Failed to write the scene cache: " + tmp_path.string());
+    std::filesystem::rename(tmp_path, path);
+}
+
+bool SceneCache::load_mesh(size_t shape_idx, const ShapeDesc* shape_desc, Shape* shape, TaskPool& pool) const {
+    const uint8_t* data = file.data();
+    const CachedMesh& mesh = reinterpret_cast<const CachedMesh*>(data + sizeof(CacheHeader))[shape_idx];
+    if (mesh.n_triangles == NOT_CACHED)
+        return false;
+
+    // the buffers are already in world space
+    const auto* positions = reinterpret_cast<const Vec3f*>(data + mesh.positions_offset);
+    const auto* normals = reinterpret_cast<const Vec3f*>(data + mesh.normals_offset);
+    const auto* texcoords = reinterpret_cast<const Vec2f*>(data + mesh.texcoords_offset);
+    const auto* indices = reinterpret_cast<const uint32_t*>(data + mesh.indices_offset);
+    const auto* quads = reinterpret_cast<const uint32_t*>(data + mesh.quads_offset);
+    auto triangle_mesh = new TriangleMesh{};
+    triangle_mesh->positions.assign(positions, positions + mesh.n_positions);
+    triangle_mesh->normals.assign(normals, normals + mesh.n_normals);
+    triangle_mesh->texcoords.assign(texcoords, texcoords + mesh.n_texcoords);
+    triangle_mesh->indices.assign(indices, indices + mesh.n_triangles * 3);
+    triangle_mesh->quads.assign(quads, quads + mesh.n_quads);
+    shape->mesh = triangle_mesh;
+    create_mesh_triangles(triangle_mesh, shape_desc->properties, shape, shape->geometries, &pool);
+    return true;
+}
+
+bool SceneCache::load_accel(const std::vector<Geometry*>& geoms, BVH*& bvh, WideBVH<4>*& bvh4, WideBVH<8>*& bvh8) const {
+    const uint8_t* data = file.data();
+    const auto& header = *reinterpret_cast<const CacheHeader*>(data);
+    auto accel_type = static_cast<AccelerationType>(header.accel_type);
+    if (accel_type == AccelerationType::NONE || geoms.size() != header.n_geoms)
+        return false;
+    if (accel_type == AccelerationType::BVH4)
+        bvh4 = restore_accel<WideBVH<4>, WideBVHNode<4>>(data, header, geoms);
+    else if (accel_type == AccelerationType::BVH8)
+        bvh8 = restore_accel<WideBVH<8>, WideBVHNode<8>>(data, header, geoms);
+    else
+        bvh = restore_accel<BVH, LinearBVHNode>(data, header, geoms);
+    return true;
+}
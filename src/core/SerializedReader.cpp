@@ -0,0 +1,184 @@
+#include "core/SerializedReader.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+
+#include "utils/FileUtils.h"
+
+namespace {
+
+/// identifier in the header of every mesh of a serialized file
+constexpr uint16_t SERIALIZED_FILE_ID = 0x041C;
+
+/// @brief Inflates a zlib stream into caller-provided memory, exactly as many bytes at a time as requested
+class Inflater {
+public:
+    Inflater(const uint8_t *data, size_t size, const std::string &filepath) : next_in(data), remaining_in(size), filepath(filepath) {
+        if (inflateInit(&stream) != Z_OK)
+            throw std::runtime_error("Failed to initialize zlib for " + filepath);
+    }
+
+    Inflater(const Inflater &) = delete;
+    Inflater &operator=(const Inflater &) = delete;
+
+    ~Inflater() {
+        inflateEnd(&stream);
+    }
+
+    /// inflate the next n_bytes of the stream into dst
+    void read(void *dst, size_t n_bytes) {
+        auto out = static_cast<Bytef *>(dst);
+        while (n_bytes > 0) {
+            // avail_in and avail_out are 32-bit, so large buffers are fed in pieces
+            if (stream.avail_in == 0 && remaining_in > 0) {
+                stream.next_in = const_cast<Bytef *>(next_in);
+                stream.avail_in = static_cast<uInt>(std::min<size_t>(remaining_in, UINT_MAX));
+                next_in += stream.avail_in;
+                remaining_in -= stream.avail_in;
+            }
+            stream.next_out = out;
+            stream.avail_out = static_cast<uInt>(std::min<size_t>(n_bytes, UINT_MAX));
+            const uInt requested = stream.avail_out;
+            int status = inflate(&stream, Z_NO_FLUSH);
+            size_t produced = requested - stream.avail_out;
+            out += produced;
+            n_bytes -= produced;
+            if (n_bytes > 0 && (status == Z_STREAM_END || status == Z_BUF_ERROR))
+                throw std::runtime_error("Serialized mesh data is truncated: " + filepath);
+            if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR)
+                throw std::runtime_error("Decompression failed: " + std::to_string(status));
+        }
+    }
+
+    /// inflate n little-endian values of type T into dst, converting them to Float
+    template <typename T>
+    void read_values(Float *dst, size_t n) {
+        if constexpr (std::is_same_v<T, Float>) {
+            read(dst, n * sizeof(Float));
+        } else {
+            T buffer[4096];
+            for (size_t begin = 0; begin < n; begin += std::size(buffer)) {
+                size_t count = std::min(n - begin, std::size(buffer));
+                read(buffer, count * sizeof(T));
+                for (size_t i = 0; i < count; i++)
+                    dst[begin + i] = static_cast<Float>(buffer[i]);
+            }
+        }
+    }
+
+private:
+    z_stream stream{};
+    const uint8_t *next_in;
+    size_t remaining_in;
+    const std::string &filepath;
+};
+
+}  // namespace
+
+SerializedFile::SerializedFile(const std::filesystem::path &path) : file(path), filepath(path.string()) {
+    const uint8_t *data = file.data();
+    const size_t size = file.size();
+    if (size < 8)
+        throw std::runtime_error("Serialized file is too small: " + filepath);
+    size_t offset = 0;
+    if ((read_u32_le_buffer(data, offset) & 0xFFFF) != SERIALIZED_FILE_ID)
+        throw std::runtime_error("Not a serialized file: " + filepath);
+    version = static_cast<uint16_t>(data[2] | (data[3] << 8));
+
+    // the footer is the offset of every mesh, followed by the number of meshes
+    offset = size - 4;
+    uint64_t n_meshes = read_u32_le_buffer(data, offset);
+    uint64_t entry_size;
+    if (version == 4)
+        entry_size = 8;
+    else if (version == 3)
+        entry_size = 4;
+    else
+        throw std::runtime_error("unsupported version");
+    if (n_meshes * entry_size + 4 > size)
+        throw std::runtime_error("Serialized file has a corrupt offset table: " + filepath);
+    const uint64_t table_offset = size - 4 - n_meshes * entry_size;
+    // the last mesh ends where the table starts
+    offsets.resize(n_meshes + 1);
+    offset = table_offset;
+    for (size_t i = 0; i < n_meshes; i++)
+        offsets[i] = entry_size == 8 ? read_u64_le_buffer(data, offset) : read_u32_le_buffer(data, offset);
+    offsets.back() = table_offset;
+    for (size_t i = 0; i < n_meshes; i++)
+        if (offsets[i] + 4 > offsets[i + 1])
+            throw std::runtime_error("Serialized file has a corrupt offset table: " + filepath);
+}
+
+TriangleMesh *SerializedFile::read_mesh(size_t index) const {
+    if (index >= n_meshes())
+        throw std::runtime_error("shape_index out of range");
+
+    // every mesh starts with the file id and the version, followed by its zlib stream
+    const uint8_t *stream_begin = file.data() + offsets[index] + 4;
+    Inflater inflater{stream_begin, static_cast<size_t>(offsets[index + 1] - offsets[index] - 4), filepath};
+    uint32_t flags;
+    inflater.read(&flags, sizeof(flags));
+    if (version == 4) {
+        // the name of the mesh, null-terminated
+        char c;
+        do
+            inflater.read(&c, 1);
+        while (c != '\0');
+    }
+    uint64_t num_vertices, num_triangles;
+    inflater.read(&num_vertices, sizeof(num_vertices));
+    inflater.read(&num_triangles, sizeof(num_triangles));
+    bool single_precision = (flags & 0x1000) != 0;
+    bool double_precision = (flags & 0x2000) != 0;
+    if (single_precision && double_precision)
+        throw std::runtime_error("Both single and double precision flags are set");
+    if (!single_precision && !double_precision)
+        throw std::runtime_error("Neither single nor double precision flags are set");
+    bool has_normals = (flags & 0x1) != 0;
+    bool has_texcoords = (flags & 0x2) != 0;
+    bool has_colors = (flags & 0x8) != 0;
+    if (has_colors)  // TODO
+        throw std::runtime_error("Serialized mesh with vertex colors not supported");
+    // the index buffer is 32-bit
+    if (num_vertices > 0xFFFFFFFF)
+        throw std::runtime_error("Serialized mesh with more than 2^32 vertices not supported");
+
+    static_assert(sizeof(Vec3f) == 3 * sizeof(Float) && sizeof(Vec2f) == 2 * sizeof(Float));
+    auto read_values = [&](Float *dst, size_t n) {
+        if (double_precision)
+            inflater.read_values<double>(dst, n);
+        else
+            inflater.read_values<float>(dst, n);
+    };
+    auto mesh = std::make_unique<TriangleMesh>();
+    mesh->positions.resize(num_vertices);
+    read_values(&mesh->positions.data()->x, 3 * num_vertices);
+    if (has_normals) {
+        mesh->normals.resize(num_vertices);
+        read_values(&mesh->normals.data()->x, 3 * num_vertices);
+    }
+    if (has_texcoords) {
+        mesh->texcoords.resize(num_vertices);
+        read_values(&mesh->texcoords.data()->x, 2 * num_vertices);
+    }
+    // TODO: colors
+
+    // the indices are little-endian uint32, like the index buffer
+    mesh->indices.resize(num_triangles * 3);
+    inflater.read(mesh->indices.data(), mesh->indices.size() * sizeof(uint32_t));
+    for (uint32_t index : mesh->indices)
+        if (index >= num_vertices)
+            throw std::runtime_error("Serialized mesh face references a missing vertex");
+    return mesh.release();
+}
+
+std::shared_ptr<const SerializedFile> SerializedFileCache::get(const std::filesystem::path &path) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &entry = files[path.string()];
+    if (entry == nullptr)
+        entry = std::make_shared<const SerializedFile>(path);
+    return entry;
+}
@@ -1,6 +1,6 @@
 #include "core/Shape.h"
 
-std::tuple<Vec3f, Vec3f, Float> Shape::sample_point_on_surface(Float sample1, const Vec2f &sample2) const {
+std::tuple<Vec3f, Vec3f, Float> Shape::sample_point_on_surface(Float sample1, const Vec2f &sample2, const Geometry **sampled_geom) const {
     if (geometries.size() == 0)
         throw std::runtime_error("Shape has no geometries to sample from");
 
@@ -10,6 +10,8 @@ std::tuple<Vec3f, Vec3f, Float> Shape::sample_point_on_surface(Float sample1, co
         geom = geometries[std::min(int(sample1 * geometries.size()), int(geometries.size() - 1))];
     auto [p, n, pdf] = geom->sample_point_on_surface(sample2);
     pdf /= geometries.size();
+    if (sampled_geom != nullptr)
+        *sampled_geom = geom;
 
     return {p, n, pdf};
 }
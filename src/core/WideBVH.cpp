@@ -0,0 +1,560 @@
+#include "core/WideBVH.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <limits>
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <immintrin.h>
+#define WIDE_BVH_SSE
+#endif
+
+namespace {
+/// round to single precision towards -inf, so the float box never shrinks
+inline float round_down(Float v) {
+    float f = static_cast<float>(v);
+    if (f > v)
+        f = std::nextafter(f, -INFINITY);
+    return f;
+}
+
+/// round to single precision towards +inf
+inline float round_up(Float v) {
+    float f = static_cast<float>(v);
+    if (f < v)
+        f = std::nextafter(f, INFINITY);
+    return f;
+}
+
+inline bool is_leaf(const BVHNode *node) {
+    return node->left == nullptr && node->right == nullptr;
+}
+
+template <int N>
+uint32_t collapse(WideBVH<N> &bvh, const BVHNode *node, int depth) {
+    // gather up to N children by repeatedly opening the interior child with the largest surface area
+    const BVHNode *children[N];
+    int n_children = 0;
+    if (is_leaf(node)) {
+        children[n_children++] = node;
+    } else {
+        // the builders only create interior nodes with two children, but be tolerant to a missing one
+        if (node->left != nullptr)
+            children[n_children++] = node->left;
+        if (node->right != nullptr)
+            children[n_children++] = node->right;
+    }
+    while (n_children < N) {
+        int best = -1;
+        Float best_area = -1.0;
+        for (int i = 0; i < n_children; i++) {
+            if (!is_leaf(children[i]) && children[i]->bbox.surface_area() > best_area) {
+                best = i;
+                best_area = children[i]->bbox.surface_area();
+            }
+        }
+        if (best < 0)
+            break;
+        const BVHNode *opened = children[best];
+        children[best] = opened->left != nullptr ? opened->left : opened->right;
+        if (opened->left != nullptr && opened->right != nullptr)
+            children[n_children++] = opened->right;
+    }
+
+    uint32_t node_idx = static_cast<uint32_t>(bvh.nodes.size());
+    bvh.nodes.emplace_back();
+    for (int i = 0; i < N; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            bvh.nodes[node_idx].bounds[axis][i] = INFINITY;
+            bvh.nodes[node_idx].bounds[axis + 3][i] = -INFINITY;
+        }
+        bvh.nodes[node_idx].child[i] = 0;
+        bvh.nodes[node_idx].n_primitives[i] = 0;
+    }
+
+    for (int i = 0; i < n_children; i++) {
+        const BVHNode *child = children[i];
+        if (is_leaf(child) || depth + 1 >= WideBVH<N>::MAX_DEPTH) {
+            std::vector<Geometry *> geoms{};
+            collect_bvh_geoms(child, geoms);
+            // an empty leaf keeps the inverted box, so it's never visited
+            if (geoms.empty())
+                continue;
+            pad_for_leaf(bvh.primitives, geoms.size());
+            bvh.nodes[node_idx].child[i] = static_cast<uint32_t>(bvh.primitives.size());
+            bvh.nodes[node_idx].n_primitives[i] = static_cast<uint32_t>(geoms.size());
+            bvh.primitives.insert(bvh.primitives.end(), geoms.begin(), geoms.end());
+        } else {
+            // bvh.nodes may be reallocated by the recursive call, so don't keep a reference across it
+            uint32_t child_idx = collapse(bvh, child, depth + 1);
+            bvh.nodes[node_idx].child[i] = child_idx;
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            bvh.nodes[node_idx].bounds[axis][i] = round_down(child->bbox.min_corner[axis]);
+            bvh.nodes[node_idx].bounds[axis + 3][i] = round_up(child->bbox.max_corner[axis]);
+        }
+    }
+    return node_idx;
+}
+
+/// quantized min of the unused slots of a QuantizedWideBVHNode
+constexpr uint16_t UNUSED_MIN = 0xFFFF;
+
+/// origin + q * scale rounded like the traversal computes it, with a separate multiply and add. The products and sums of floats are
+/// exact or correctly rounded in double, so this is the float result
+inline float dequantize_mul_add(float q, float scale, float origin) {
+    return static_cast<float>(static_cast<double>(static_cast<float>(static_cast<double>(q) * scale)) + origin);
+}
+
+/// the same with a fused multiply-add, which the compiler may contract the multiply and add of the traversal into
+inline float dequantize_fma(float q, float scale, float origin) {
+    return std::fma(q, scale, origin);
+}
+
+/// the largest q whose box coordinate is at most value, with either rounding
+inline uint16_t quantize_down(float value, float origin, float scale) {
+    const double q = std::floor((static_cast<double>(value) - origin) / scale);
+    // UNUSED_MIN is reserved for the unused slots
+    uint32_t qi = static_cast<uint32_t>(std::clamp(q, 0.0, double(UNUSED_MIN - 1)));
+    // q = 0 decodes to the origin exactly, which is the smallest min of the children
+    while (qi > 0 && std::max(dequantize_mul_add(float(qi), scale, origin), dequantize_fma(float(qi), scale, origin)) > value)
+        qi--;
+    return static_cast<uint16_t>(qi);
+}
+
+/// the smallest q whose box coordinate is at least value, with either rounding
+inline uint16_t quantize_up(float value, float origin, float scale) {
+    const double q = std::ceil((static_cast<double>(value) - origin) / scale);
+    uint32_t qi = static_cast<uint32_t>(std::clamp(q, 0.0, 65535.0));
+    // the scale is chosen so that q = 65535 reaches the largest max of the children
+    while (qi < 65535 && std::min(dequantize_mul_add(float(qi), scale, origin), dequantize_fma(float(qi), scale, origin)) < value)
+        qi++;
+    return static_cast<uint16_t>(qi);
+}
+
+template <int N>
+inline bool is_used(const WideBVHNode<N> &node, int i) {
+    return node.bounds[0][i] <= node.bounds[3][i];
+}
+
+/// @brief Quantize the bounds of the children of a node relative to its box, rounding outward
+template <int N>
+QuantizedWideBVHNode<N> quantize(const WideBVHNode<N> &node) {
+    QuantizedWideBVHNode<N> quantized;
+    for (int axis = 0; axis < 3; axis++) {
+        float lo = INFINITY, hi = -INFINITY;
+        for (int i = 0; i < N; i++) {
+            if (is_used(node, i)) {
+                lo = std::min(lo, node.bounds[axis][i]);
+                hi = std::max(hi, node.bounds[axis + 3][i]);
+            }
+        }
+        if (lo > hi)
+            lo = hi = 0.0f;
+        const double extent = static_cast<double>(hi) - lo;
+        float scale = static_cast<float>(extent / 65535.0);
+        if (!(scale >= std::numeric_limits<float>::min()))
+            scale = extent > 0.0 ? std::numeric_limits<float>::min() : 1.0f;
+        // the last step must reach the max corner with either rounding
+        while (std::min(dequantize_mul_add(65535.0f, scale, lo), dequantize_fma(65535.0f, scale, lo)) < hi)
+            scale = std::nextafter(scale, INFINITY);
+        quantized.origin[axis] = lo;
+        quantized.scale[axis] = scale;
+        for (int i = 0; i < N; i++) {
+            quantized.bounds[axis][i] = is_used(node, i) ? quantize_down(node.bounds[axis][i], lo, scale) : UNUSED_MIN;
+            quantized.bounds[axis + 3][i] = is_used(node, i) ? quantize_up(node.bounds[axis + 3][i], lo, scale) : 0;
+        }
+    }
+    for (int i = 0; i < N; i++) {
+        quantized.child[i] = node.child[i];
+        quantized.n_primitives[i] = node.n_primitives[i];
+    }
+    return quantized;
+}
+
+/// rows of child bounds in the layout of WideBVHNode::bounds
+template <int N>
+using BoundsRows = const float (*)[N];
+
+/// the bounds of the children of a node
+template <int N>
+inline BoundsRows<N> child_bounds(const WideBVHNode<N> &node, float (&)[6][N]) {
+    return node.bounds;
+}
+
+/// the bounds of the children of a quantized node, decoded into scratch. Unused slots get an infinite min corner
+template <int N>
+inline BoundsRows<N> child_bounds(const QuantizedWideBVHNode<N> &node, float (&scratch)[6][N]) {
+#if defined(WIDE_BVH_SSE)
+    const __m128i unused = _mm_set1_epi32(UNUSED_MIN);
+    for (int row = 0; row < 6; row++) {
+        const __m128 scale = _mm_set1_ps(node.scale[row % 3]);
+        const __m128 origin = _mm_set1_ps(node.origin[row % 3]);
+        for (int g = 0; g < N; g += 4) {
+            // widen 4 uint16 to int32
+            const __m128i q = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(node.bounds[row] + g)), _mm_setzero_si128());
+            __m128 value = _mm_add_ps(_mm_mul_ps(_mm_cvtepi32_ps(q), scale), origin);
+            if (row < 3) {
+                const __m128 is_unused = _mm_castsi128_ps(_mm_cmpeq_epi32(q, unused));
+                value = _mm_or_ps(_mm_andnot_ps(is_unused, value), _mm_and_ps(is_unused, _mm_set1_ps(INFINITY)));
+            }
+            _mm_store_ps(scratch[row] + g, value);
+        }
+    }
+#else
+    for (int row = 0; row < 6; row++) {
+        for (int i = 0; i < N; i++) {
+            const uint16_t q = node.bounds[row][i];
+            scratch[row][i] = row < 3 && q == UNUSED_MIN ? INFINITY : static_cast<float>(q) * node.scale[row % 3] + node.origin[row % 3];
+        }
+    }
+#endif
+    return scratch;
+}
+
+/// the ray in the form used by the slab tests
+struct WideRay {
+    float org[3];
+    float inv_d[3];
+    /// rows of WideBVHNode::bounds holding the near and far planes on each axis, depending on the direction's sign
+    int near_row[3], far_row[3];
+
+    explicit WideRay(const Ray &r) {
+        for (int axis = 0; axis < 3; axis++) {
+            org[axis] = static_cast<float>(r.o[axis]);
+            // keep 1/d finite: inf * 0 would produce a NaN when the origin lies on a slab plane
+            float d = static_cast<float>(r.d[axis]);
+            if (std::abs(d) < 1e-20f)
+                d = std::copysign(1e-20f, d);
+            inv_d[axis] = 1.0f / d;
+            near_row[axis] = inv_d[axis] < 0.0f ? axis + 3 : axis;
+            far_row[axis] = inv_d[axis] < 0.0f ? axis : axis + 3;
+        }
+    }
+};
+
+/// the exit distances of the slab tests are enlarged by their rounding error, so the boxes are conservative (see BVH.cpp)
+constexpr float EXIT_SCALE = 1 + 2 * rounding_gamma<float>(3);
+
+/// @brief Slab test of all the children of a node against [tmin, tmax]
+/// @param bounds the bounds of the children (see child_bounds()), 16-byte aligned
+/// @param t_near receives the entry distance of each child
+/// @return bitmask of the children that are hit
+template <int N>
+inline uint32_t intersect_children(BoundsRows<N> bounds, const WideRay &wr, float tmin, float tmax, float *t_near) {
+    uint32_t mask = 0;
+#if defined(WIDE_BVH_SSE)
+    for (int g = 0; g < N; g += 4) {
+        __m128 tn = _mm_set1_ps(tmin);
+        __m128 tf = _mm_set1_ps(tmax);
+        for (int axis = 0; axis < 3; axis++) {
+            __m128 o = _mm_set1_ps(wr.org[axis]);
+            __m128 inv_d = _mm_set1_ps(wr.inv_d[axis]);
+            __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[wr.near_row[axis]] + g), o), inv_d);
+            __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(bounds[wr.far_row[axis]] + g), o), inv_d);
+            tn = _mm_max_ps(tn, t0);
+            tf = _mm_min_ps(tf, t1);
+        }
+        tf = _mm_mul_ps(tf, _mm_set1_ps(EXIT_SCALE));
+        _mm_store_ps(t_near + g, tn);
+        mask |= static_cast<uint32_t>(_mm_movemask_ps(_mm_cmple_ps(tn, tf))) << g;
+    }
+#else
+    for (int i = 0; i < N; i++) {
+        float tn = tmin, tf = tmax;
+        for (int axis = 0; axis < 3; axis++) {
+            tn = std::max(tn, (bounds[wr.near_row[axis]][i] - wr.org[axis]) * wr.inv_d[axis]);
+            tf = std::min(tf, (bounds[wr.far_row[axis]][i] - wr.org[axis]) * wr.inv_d[axis]);
+        }
+        t_near[i] = tn;
+        if (tn <= tf * EXIT_SCALE)
+            mask |= 1u << i;
+    }
+#endif
+    return mask;
+}
+
+#if defined(__AVX__)
+template <>
+inline uint32_t intersect_children<8>(BoundsRows<8> bounds, const WideRay &wr, float tmin, float tmax, float *t_near) {
+    __m256 tn = _mm256_set1_ps(tmin);
+    __m256 tf = _mm256_set1_ps(tmax);
+    for (int axis = 0; axis < 3; axis++) {
+        __m256 o = _mm256_set1_ps(wr.org[axis]);
+        __m256 inv_d = _mm256_set1_ps(wr.inv_d[axis]);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[wr.near_row[axis]]), o), inv_d);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(bounds[wr.far_row[axis]]), o), inv_d);
+        tn = _mm256_max_ps(tn, t0);
+        tf = _mm256_min_ps(tf, t1);
+    }
+    tf = _mm256_mul_ps(tf, _mm256_set1_ps(EXIT_SCALE));
+    _mm256_store_ps(t_near, tn);
+    return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_cmp_ps(tn, tf, _CMP_LE_OQ)));
+}
+#endif
+
+/// @brief Entry of the traversal stack: a node, or a leaf if n_primitives > 0
+struct WideStackEntry {
+    uint32_t idx;
+    uint32_t n_primitives;
+    float t_near;
+};
+
+/// @brief Entry of the packet traversal stack: a node or a leaf like WideStackEntry, and the rays that hit its box
+struct WidePacketStackEntry {
+    uint32_t idx;
+    uint32_t n_primitives;
+    uint32_t rays;
+    /// the nearest entry distance of those rays
+    Float t_near;
+};
+
+/// area of a child slot's box, 0 for unused slots
+template <int N>
+Float child_area(BoundsRows<N> bounds, int i) {
+    if (!(bounds[0][i] <= bounds[3][i]))
+        return 0.0;
+    AABB bbox{Vec3f{bounds[0][i], bounds[1][i], bounds[2][i]}, Vec3f{bounds[3][i], bounds[4][i], bounds[5][i]}};
+    return bbox.surface_area();
+}
+}  // namespace
+
+template <int N>
+WideBVH<N>::WideBVH(BVHNode *root) {
+    if (root == nullptr)
+        return;
+    collapse(*this, root, 0);
+    nodes.shrink_to_fit();
+    primitives.shrink_to_fit();
+    leaf_primitives = make_leaf_primitives(primitives, watertight);
+    delete_bvh_tree(root);
+}
+
+template <int N>
+void WideBVH<N>::set_watertight(bool watertight) {
+    if (watertight == this->watertight)
+        return;
+    this->watertight = watertight;
+    leaf_primitives = make_leaf_primitives(primitives, watertight, leaf_primitives.compact);
+}
+
+template <int N>
+void WideBVH<N>::compress() {
+    if (quantized_nodes.empty() && !nodes.empty()) {
+        quantized_nodes.reserve(nodes.size());
+        for (const auto &node : nodes)
+            quantized_nodes.push_back(quantize(node));
+        nodes.clear();
+        nodes.shrink_to_fit();
+    }
+    if (!leaf_primitives.compact)
+        leaf_primitives = make_leaf_primitives(primitives, watertight, true);
+}
+
+template <int N>
+bool WideBVH<N>::intersect(const Ray &ray, Intersection &isc) const {
+    return quantized_nodes.empty() ? intersect_nodes(nodes, ray, isc) : intersect_nodes(quantized_nodes, ray, isc);
+}
+
+template <int N>
+uint32_t WideBVH<N>::intersect_packet(const Ray *rays, int n, Intersection *iscs) const {
+    return quantized_nodes.empty() ? intersect_packet_nodes(nodes, rays, n, iscs) : intersect_packet_nodes(quantized_nodes, rays, n, iscs);
+}
+
+template <int N>
+bool WideBVH<N>::occluded(const Ray &ray) const {
+    return quantized_nodes.empty() ? occluded_nodes(nodes, ray) : occluded_nodes(quantized_nodes, ray);
+}
+
+template <int N>
+template <typename Node>
+bool WideBVH<N>::intersect_nodes(const std::vector<Node> &tree, const Ray &ray, Intersection &isc) const {
+    if (tree.empty())
+        return false;
+
+    // tmax shrinks with every hit, culling the children behind the closest hit found so far
+    Ray r{ray};
+    const WideRay wr{r};
+    const WatertightRay watertight_ray{r};
+    const float tmin = round_down(r.tmin);
+    float tmax = round_up(r.tmax);
+    bool is_hit = false;
+
+    // every visited node replaces its entry with at most N children
+    WideStackEntry stack[N * MAX_DEPTH];
+    int stack_size = 0;
+    stack[stack_size++] = {0, 0, tmin};
+    [[maybe_unused]] uint64_t n_nodes_visited = 0, n_primitive_tests = 0;
+    while (stack_size > 0) {
+        const WideStackEntry entry = stack[--stack_size];
+        // a closer hit may have been found since the entry was pushed
+        if (entry.t_near > tmax)
+            continue;
+
+        if (entry.n_primitives > 0) {
+            n_primitive_tests += entry.n_primitives;
+            if (intersect_leaf(primitives, leaf_primitives, entry.idx, entry.idx + entry.n_primitives, r, watertight ? &watertight_ray : nullptr, isc)) {
+                tmax = round_up(r.tmax);
+                is_hit = true;
+            }
+            continue;
+        }
+
+        const Node &node = tree[entry.idx];
+        n_nodes_visited++;
+        alignas(32) float bounds[6][N];
+        alignas(32) float t_near[N];
+        uint32_t mask = intersect_children<N>(child_bounds(node, bounds), wr, tmin, tmax, t_near);
+        // push the hit children sorted far to near, so the nearest one is popped first
+        const int first = stack_size;
+        while (mask != 0) {
+            int i = std::countr_zero(mask);
+            mask &= mask - 1;
+            WideStackEntry child{node.child[i], node.n_primitives[i], t_near[i]};
+            int j = stack_size++;
+            while (j > first && stack[j - 1].t_near < child.t_near) {
+                stack[j] = stack[j - 1];
+                j--;
+            }
+            stack[j] = child;
+        }
+    }
+#ifdef BVH_STATS
+    bvh_traversal_stats.add_ray(n_nodes_visited, n_primitive_tests);
+#endif
+    return is_hit;
+}
+
+template <int N>
+template <typename Node>
+uint32_t WideBVH<N>::intersect_packet_nodes(const std::vector<Node> &tree, const Ray *rays, int n, Intersection *iscs) const {
+    if (tree.empty())
+        return 0;
+
+    // the children are tested one at a time against all the rays, after the interval test of the whole packet
+    RayPacket packet{rays, n};
+    uint32_t hit_rays = 0;
+    WidePacketStackEntry stack[N * MAX_DEPTH];
+    int stack_size = 0;
+    stack[stack_size++] = {0, 0, packet.valid, packet.tmin_lo};
+    while (stack_size > 0) {
+        const WidePacketStackEntry entry = stack[--stack_size];
+        // closer hits of all the rays may have been found since the entry was pushed
+        if (entry.t_near > packet.tmax_hi)
+            continue;
+
+        if (entry.n_primitives > 0) {
+            hit_rays |= intersect_leaf_packet(primitives, leaf_primitives, entry.idx, entry.idx + entry.n_primitives, rays, packet, entry.rays, watertight, iscs);
+            continue;
+        }
+
+        const Node &node = tree[entry.idx];
+        alignas(32) float bounds[6][N];
+        BoundsRows<N> node_bounds = child_bounds(node, bounds);
+        // push the hit children sorted far to near, so the nearest one is popped first
+        const int first = stack_size;
+        for (int i = 0; i < N; i++) {
+            // unused slots hold an inverted or infinite box
+            if (!(node_bounds[0][i] <= node_bounds[3][i]))
+                continue;
+            const Vec3f min_corner{node_bounds[0][i], node_bounds[1][i], node_bounds[2][i]};
+            const Vec3f max_corner{node_bounds[3][i], node_bounds[4][i], node_bounds[5][i]};
+            if (packet_misses_box(packet, min_corner, max_corner))
+                continue;
+            alignas(32) Float t_near[RAY_PACKET_SIZE];
+            const uint32_t child_rays = intersect_box_packet(packet, min_corner, max_corner, entry.rays, t_near);
+            if (child_rays == 0)
+                continue;
+            WidePacketStackEntry child{node.child[i], node.n_primitives[i], child_rays, INFINITY};
+            for (uint32_t remaining = child_rays; remaining != 0; remaining &= remaining - 1)
+                child.t_near = std::min(child.t_near, t_near[std::countr_zero(remaining)]);
+            int j = stack_size++;
+            while (j > first && stack[j - 1].t_near < child.t_near) {
+                stack[j] = stack[j - 1];
+                j--;
+            }
+            stack[j] = child;
+        }
+    }
+    return hit_rays;
+}
+
+template <int N>
+template <typename Node>
+bool WideBVH<N>::occluded_nodes(const std::vector<Node> &tree, const Ray &ray) const {
+    if (tree.empty())
+        return false;
+
+    // any hit will do, so the hit children are pushed unsorted and tmax never shrinks
+    const WideRay wr{ray};
+    const WatertightRay watertight_ray{ray};
+    const float tmin = round_down(ray.tmin);
+    const float tmax = round_up(ray.tmax);
+    WideStackEntry stack[N * MAX_DEPTH];
+    int stack_size = 0;
+    stack[stack_size++] = {0, 0, tmin};
+    while (stack_size > 0) {
+        const WideStackEntry entry = stack[--stack_size];
+        if (entry.n_primitives > 0) {
+            if (occluded_leaf(primitives, leaf_primitives, entry.idx, entry.idx + entry.n_primitives, ray, watertight ? &watertight_ray : nullptr))
+                return true;
+            continue;
+        }
+
+        const Node &node = tree[entry.idx];
+        alignas(32) float bounds[6][N];
+        alignas(32) float t_near[N];
+        uint32_t mask = intersect_children<N>(child_bounds(node, bounds), wr, tmin, tmax, t_near);
+        while (mask != 0) {
+            int i = std::countr_zero(mask);
+            mask &= mask - 1;
+            stack[stack_size++] = {node.child[i], node.n_primitives[i], t_near[i]};
+        }
+    }
+    return false;
+}
+
+template <int N>
+Float WideBVH<N>::sah_cost(const BVHBuildConfig &config) const {
+    auto tree_cost = [&](const auto &tree) -> Float {
+        if (tree.empty())
+            return 0.0;
+        alignas(32) float bounds[6][N];
+        BoundsRows<N> root_bounds = child_bounds(tree[0], bounds);
+        AABB root_bbox = AABB::empty();
+        for (int i = 0; i < N; i++) {
+            if (!(root_bounds[0][i] <= root_bounds[3][i]))
+                continue;
+            root_bbox = root_bbox + AABB{Vec3f{root_bounds[0][i], root_bounds[1][i], root_bounds[2][i]},
+                                         Vec3f{root_bounds[3][i], root_bounds[4][i], root_bounds[5][i]}};
+        }
+        Float root_area = root_bbox.surface_area();
+        if (root_area <= 0.0)
+            return 0.0;
+
+        // the root is always visited; every other node or leaf is paid for with the probability of hitting its box
+        Float cost = config.traversal_cost;
+        for (const auto &node : tree) {
+            BoundsRows<N> node_bounds = child_bounds(node, bounds);
+            for (int i = 0; i < N; i++) {
+                Float relative_area = child_area<N>(node_bounds, i) / root_area;
+                if (node.n_primitives[i] > 0)
+                    cost += relative_area * config.leaf_cost(node.n_primitives[i]);
+                else
+                    cost += relative_area * config.traversal_cost;
+            }
+        }
+        return cost;
+    };
+    return quantized_nodes.empty() ? tree_cost(nodes) : tree_cost(quantized_nodes);
+}
+
+template <int N>
+size_t WideBVH<N>::memory_footprint() const {
+    return nodes.capacity() * sizeof(WideBVHNode<N>) + quantized_nodes.capacity() * sizeof(QuantizedWideBVHNode<N>) + primitives.capacity() * sizeof(Geometry *) +
+           leaf_primitives.memory_footprint();
+}
+
+template class WideBVH<4>;
+template class WideBVH<8>;
@@ -1,4 +1,5 @@
 #include "core/Geometry.h"
+#include "core/PrimitiveRecords.h"
 #include "core/Registry.h"
 #include "utils/Misc.h"
 
@@ -7,49 +8,76 @@ public:
     Mat4f transform;
     Mat4f inv_transform;
     Float world_radius;
+    Vec3f world_center;
     Vec3f world_normal;
+    Float world_area;
+    /// whether `transform` is a similarity, so the disk is a circle of world_radius around world_center in world space
+    bool similarity;
     bool flip_normals;
 
     Disk(const Mat4f &transform, const Mat4f &inv_transform, bool flip_normals, const Shape *parent_shape) {
         this->parent_shape = parent_shape;
         this->transform = transform;
-        // check for non-uniform scaling
-        Float sx = glm::length(Vec3f{transform[0]});
-        Float sy = glm::length(Vec3f{transform[1]});
-        Float sz = glm::length(Vec3f{transform[2]});
-        if (std::abs(sx - sy) > Epsilon || std::abs(sx - sz) > Epsilon || std::abs(sy - sz) > Epsilon)
-            throw std::runtime_error("Disk geometry does not support non-uniform scaling: " + std::to_string(sx) + ", " + std::to_string(sy) + ", " + std::to_string(sz));
-        world_radius = sx;
         this->inv_transform = inv_transform;
         this->flip_normals = flip_normals;
+        // non-uniform scales turn the disk into an ellipse, which is intersected in local space
+        similarity = is_similarity(transform, world_radius);
+        if (!similarity)
+            world_radius = glm::length(Vec3f{transform[0]});
+        world_center = Vec3f{transform[3]};
         world_normal = glm::normalize(Vec3f{glm::transpose(inv_transform)[2]});
+        world_area = Pi * glm::length(glm::cross(Vec3f{transform[0]}, Vec3f{transform[1]}));
     }
 
-    bool intersect(const Ray &ray, Intersection &isc) const override {
+    /// Returns the distance of the hit along the ray, if it hits within [tmin, tmax]. With a similarity transform, the ray is
+    /// intersected with the plane of the disk in world space (see intersect_disk()); otherwise in local space, where the distances
+    /// are the same since the direction isn't normalized
+    bool hit_distance(const Ray &ray, Float &distance) const {
+        if (similarity)
+            return intersect_disk(DiskRecord{world_center, world_radius, world_normal}, ray, distance);
         Vec3f local_o = Vec3f{inv_transform * Vec4f{ray.o, 1.0}};
         Vec3f local_d = Vec3f{inv_transform * Vec4f{ray.d, 0.0}};
         if (std::abs(local_d.z) < Epsilon)
             return false;
         Float t = -local_o.z / local_d.z;
-        if (t <= 0.0)
+        if (t <= 0.0 || t < ray.tmin || t > ray.tmax)
             return false;
         Vec3f local_posn = local_o + t * local_d;
         if (Sqr(local_posn.x) + Sqr(local_posn.y) > 1.0)
             return false;
-        Vec3f world_posn = Vec3f{transform * Vec4f{local_posn, 1.0}};
-        Float distance = glm::length(world_posn - ray.o);
-        if (distance < ray.tmin || distance > ray.tmax)
+        distance = t;
+        return true;
+    }
+
+    bool intersect(const Ray &ray, Intersection &isc) const override {
+        Float distance;
+        if (!hit_distance(ray, distance))
             return false;
 
-        isc.dirn = -ray.d;
         isc.distance = distance;
-        isc.position = world_posn;
-        isc.normal = get_normal(world_posn);
         isc.shape = parent_shape;
         isc.geom = this;
         return true;
     }
 
+    void compute_surface_interaction(const Ray &ray, Intersection &isc) const override {
+        isc.position = ray(isc.distance);
+        isc.normal = get_normal(isc.position);
+        isc.uv = get_uv(isc.position);
+    }
+
+    bool occluded(const Ray &ray) const override {
+        Float distance;
+        return hit_distance(ray, distance);
+    }
+
+    bool get_disk_record(DiskRecord &record) const override {
+        if (!similarity)
+            return false;
+        record = DiskRecord{world_center, world_radius, world_normal};
+        return true;
+    }
+
     AABB get_bbox() const override {
         std::vector<Vec3f> vertices = {
             Vec3f{-1.0, -1.0, -0.01},
@@ -78,7 +106,7 @@ public:
     }
 
     Float area() const override {
-        return Pi * Sqr(world_radius);
+        return world_area;
     }
 
     std::tuple<Vec3f, Vec3f, Float> sample_point_on_surface(const Vec2f &sample) const override {
@@ -86,13 +114,18 @@ public:
         Float theta = 2 * Pi * sample.y;
         Vec3f posn{r * std::cos(theta), r * std::sin(theta), 0.0};
         posn = Vec3f{transform * Vec4f{posn, 1.0}};
-        Float pdf = 1.0 / (Pi * Sqr(world_radius));
+        Float pdf = 1.0 / world_area;
 
         return {posn, get_normal(posn), pdf};
     }
 
+    /// polar coordinates in the local space of the disk: (radius, angle / 2pi)
     Vec2f get_uv(const Vec3f &posn) const override {
-        throw std::runtime_error("disk get_uv not implemented");
+        Vec3f posn_local = Vec3f{inv_transform * Vec4f{posn, 1.0}};
+        Float phi = std::atan2(posn_local.y, posn_local.x);  // phi ∈ [-pi, pi]
+        if (phi < 0.0)
+            phi += 2.0 * Pi;
+        return Vec2f{std::sqrt(Sqr(posn_local.x) + Sqr(posn_local.y)), phi / (2.0 * Pi)};
     }
 
     std::string to_string() const override {
@@ -0,0 +1,128 @@
+#include "core/Geometry.h"
+#include "core/Registry.h"
+#include "core/ShapeGroup.h"
+#include "utils/Misc.h"
+
+/// A shape group placed in the scene with a transform. Rays are transformed into the group's space and traced
+/// against the group's BVH, so the geometries are stored and built only once no matter how many instances there are.
+class Instance : public Geometry {
+public:
+    const ShapeGroup *group;
+    Mat4f transform;
+    Mat4f inv_transform;
+    /// transposed inverse, for transforming the normals to world space
+    Mat4f tsp_inv_transform;
+
+    Instance(const ShapeGroup *group, const Mat4f &transform, const Mat4f &inv_transform, const Shape *parent_shape)
+        : group(group), transform(transform), inv_transform(inv_transform), tsp_inv_transform(glm::transpose(inv_transform)) {
+        this->parent_shape = parent_shape;
+    }
+
+    /// the ray in the group's space. d is normalized again, and the interval is scaled accordingly:
+    /// a distance t along the world ray is t * scale along the local ray
+    Ray to_local(const Ray &ray, Float &scale) const {
+        Vec3f d_local = Vec3f{inv_transform * Vec4f{ray.d, 0.0}};
+        scale = glm::length(d_local);
+        return Ray{Vec3f{inv_transform * Vec4f{ray.o, 1.0}}, d_local / scale, ray.tmin * scale, ray.tmax * scale};
+    }
+
+    bool intersect(const Ray &ray, Intersection &isc) const override {
+        if (group->bvh == nullptr)
+            return false;
+        Float scale;
+        Ray local_ray = to_local(ray, scale);
+        if (!group->bvh->intersect(local_ray, isc))
+            return false;
+
+        // shape and geom stay the ones of the group, so the BSDF of the hit shape is used
+        isc.distance /= scale;
+        isc.instance = this;
+        return true;
+    }
+
+    /// the hit geometry fills the record in the group's space, which is then transformed to world space
+    void compute_surface_interaction(const Ray &ray, Intersection &isc) const override {
+        Float scale;
+        Ray local_ray = to_local(ray, scale);
+        Float distance = isc.distance;
+        isc.distance *= scale;
+        isc.geom->compute_surface_interaction(local_ray, isc);
+        isc.distance = distance;
+        isc.position = Vec3f{transform * Vec4f{isc.position, 1.0}};
+        isc.normal = glm::normalize(Vec3f{tsp_inv_transform * Vec4f{isc.normal, 0.0}});
+    }
+
+    bool occluded(const Ray &ray) const override {
+        if (group->bvh == nullptr)
+            return false;
+        Float scale;
+        return group->bvh->occluded(to_local(ray, scale));
+    }
+
+    AABB get_bbox() const override {
+        if (group->bbox.is_empty())
+            return AABB::empty();
+        AABB bbox = AABB::empty();
+        for (int i = 0; i < 8; i++) {
+            Vec3f corner{(i & 1) ? group->bbox.max_corner.x : group->bbox.min_corner.x,
+                         (i & 2) ? group->bbox.max_corner.y : group->bbox.min_corner.y,
+                         (i & 4) ? group->bbox.max_corner.z : group->bbox.min_corner.z};
+            corner = Vec3f{transform * Vec4f{corner, 1.0}};
+            bbox = bbox + AABB{corner, corner};
+        }
+        return bbox;
+    }
+
+    // instances can't be emitters, so they're never sampled. the hit geometry (Intersection::geom) answers the rest
+    Vec3f get_normal(const Vec3f &position) const override {
+        throw std::runtime_error("get_normal() is not supported for instances. Use the normal of the intersection.");
+    }
+
+    Float area() const override {
+        throw std::runtime_error("area() is not supported for instances");
+    }
+
+    std::tuple<Vec3f, Vec3f, Float> sample_point_on_surface(const Vec2f &sample) const override {
+        throw std::runtime_error("Sampling a point on an instance is not supported");
+    }
+
+    Vec2f get_uv(const Vec3f &posn) const override {
+        throw std::runtime_error("get_uv() is not supported for instances. Use Intersection::uv.");
+    }
+
+    std::string to_string() const override {
+        std::ostringstream oss;
+        oss << "Geometry(Instance): [ shapegroup=" << group->id << " --- " << group->shapes.size() << " shapes ]";
+        return oss.str();
+    }
+};
+
+// --------------------------- Registry functions ---------------------------
+Geometry *createInstance(const std::unordered_map<std::string, std::string> &properties, const Shape *parent_shape, const GeometryCreationContext *ctx) {
+    if (ctx == nullptr || ctx->shape_group == nullptr)
+        throw std::runtime_error("Instance geometry requires a shape group");
+
+    Mat4f transform{1.0};
+    Mat4f inv_transform{1.0};
+    for (const auto &[key, value] : properties) {
+        if (key == "to_world") {
+            transform = strToMat4f(value);
+        } else if (key == "inv_to_world") {
+            inv_transform = strToMat4f(value);
+        } else {
+            throw std::runtime_error("Unknown property '" + key + "' for instance geometry");
+        }
+    }
+
+    return new Instance{ctx->shape_group, transform, inv_transform, parent_shape};
+}
+
+namespace {
+struct InstanceRegistrar {
+    InstanceRegistrar() {
+        GeometryRegistry::registerGeometry("instance", createInstance);
+    }
+};
+
+static InstanceRegistrar registrar;
+}  // namespace
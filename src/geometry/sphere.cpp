@@ -1,6 +1,8 @@
 #include <algorithm>
+#include <cmath>
 
 #include "core/Geometry.h"
+#include "core/PrimitiveRecords.h"
 #include "core/Registry.h"
 #include "utils/Misc.h"
 
@@ -9,75 +11,92 @@ class Sphere : public Geometry {
 private:
     Mat4f inv_transform;
 
+    /// @brief Distances along the ray to the two points where its line crosses the sphere, t0 <= t1. false if it misses.
+    /// A similarity transform is baked into world_center and radius_world, and the quadratic is solved in world space
+    /// (see intersect_sphere()). Other transforms solve it in local space and scale the roots back.
+    bool hit_distances(const Ray &ray, Float &t0, Float &t1) const {
+        if (similarity)
+            return intersect_sphere(SphereRecord{world_center, radius_world}, ray, t0, t1);
+        // transform ray to local space. The world distance is the local one over the length of the local direction
+        Vec3f o_local = Vec3f{inv_transform * Vec4f{ray.o, 1.0}};
+        Vec3f d_local = Vec3f{inv_transform * Vec4f{ray.d, 0.0}};
+        Float d_length = glm::length(d_local);
+        d_local /= d_length;
+
+        Vec3f o_minus_c = o_local - center;
+        Float b_prime = dot(o_minus_c, d_local);
+        Float delta_prime = Sqr(b_prime) - dot(o_minus_c, o_minus_c) + Sqr(radius);
+        if (delta_prime <= 0.0)
+            return false;
+        Float delta_prime_sqrt = std::sqrt(delta_prime);
+        t0 = (-b_prime - delta_prime_sqrt) / d_length;
+        t1 = (-b_prime + delta_prime_sqrt) / d_length;
+        return true;
+    }
+
 public:
     Vec3f center;
     Float radius;
     Float radius_world;  // radius in world space
     // the center and radius are in local space, `transform` is used to transform. used for intersection and bbox building
     Mat4f transform;
+    Vec3f world_center;
+    /// whether `transform` is a similarity, so the sphere is a sphere in world space too
+    bool similarity;
     bool flip_normals;
 
     Sphere(const Vec3f &center, Float radius, const Mat4f &transform, const Mat4f &inv_transform, const Shape *parent_shape, bool flip_normals) : transform(transform), inv_transform(inv_transform), center(center), radius(radius), flip_normals(flip_normals) {
-        Vec3f scaled_x = Vec3f{transform[0]};
-        radius_world = radius * glm::length(scaled_x);
+        Float scale;
+        similarity = is_similarity(transform, scale);
+        radius_world = radius * (similarity ? scale : glm::length(Vec3f{transform[0]}));
+        world_center = Vec3f{transform * Vec4f{center, 1.0}};
         this->parent_shape = parent_shape;
     }
 
     bool intersect(const Ray &ray, Intersection &isc) const override {
-        // transform ray to local space
-        Vec3f o_local = Vec3f{inv_transform * Vec4f{ray.o, 1.0}};
-        Vec3f d_local = glm::normalize(Vec3f{inv_transform * Vec4f{ray.d, 0.0}});
-
-        Vec3f o_minus_c = o_local - center;
-        Float o_minus_c_length2 = dot(o_minus_c, o_minus_c);
-        Float b_prime = dot(o_minus_c, d_local);
-        Float delta_prime = Sqr(b_prime) - o_minus_c_length2 + Sqr(radius);
-
-        // no intersection (in any direction)
-        if (delta_prime <= 0.0)
+        Float t0, t1;
+        if (!hit_distances(ray, t0, t1))
             return false;
 
-        // tangent to the sphere
-        if (delta_prime < Epsilon) {
-            Float t_local = -b_prime;
-            // hit from behind
-            if (t_local < 0.0)
-                return false;
-            Vec3f local_hit_pos = o_local + t_local * d_local;
-            isc.position = Vec3f{transform * Vec4f{local_hit_pos, 1.0}};
-            isc.normal = get_normal(isc.position);
-        } else {  // hit the sphere twice (might be in the back or front of ray)
-            Float delta_prime_sqrt = std::sqrt(delta_prime);
-            Float t1_local = -b_prime - delta_prime_sqrt;
-            Float t2_local = -b_prime + delta_prime_sqrt;
-            // both hitpoints are behind the ray
-            if (t2_local <= 0.0)
-                return false;
-            if (t1_local >= 0.0) {
-                Vec3f local_hit_pos = o_local + t1_local * d_local;
-                isc.position = Vec3f{transform * Vec4f{local_hit_pos, 1.0}};
-                isc.distance = glm::length(isc.position - ray.o);
-                if (isc.distance < ray.tmin || isc.distance > ray.tmax)
-                    goto lbl1;
-                isc.normal = get_normal(isc.position);
-            } else {  // if (t2_local >= 0.0)
-            lbl1:
-                Vec3f local_hit_pos = o_local + t2_local * d_local;
-                isc.position = Vec3f{transform * Vec4f{o_local + t2_local * d_local, 1.0}};
-                isc.distance = glm::length(isc.position - ray.o);
-                if (isc.distance > ray.tmax || isc.distance < ray.tmin)
-                    return false;
-                isc.normal = get_normal(isc.position);
-            }
-        }
+        // only the distance is recorded; compute_surface_interaction() recovers the hit position from it
+        Float distance;
+        if (t0 >= ray.tmin && t0 <= ray.tmax)
+            distance = t0;
+        else if (t1 >= ray.tmin && t1 <= ray.tmax)
+            distance = t1;
+        else
+            return false;
 
-        isc.dirn = -ray.d;
+        isc.distance = distance;
         isc.shape = parent_shape;
         isc.geom = this;
         return true;
     }
 
+    void compute_surface_interaction(const Ray &ray, Intersection &isc) const override {
+        isc.position = ray(isc.distance);
+        isc.normal = get_normal(isc.position);
+        isc.uv = get_uv(isc.position);
+    }
+
+    bool occluded(const Ray &ray) const override {
+        // only the distances of the two hitpoints are needed; check if either lies in [tmin, tmax]
+        Float t0, t1;
+        if (!hit_distances(ray, t0, t1))
+            return false;
+        return (t0 >= ray.tmin && t0 <= ray.tmax) || (t1 >= ray.tmin && t1 <= ray.tmax);
+    }
+
+    bool get_sphere_record(SphereRecord &record) const override {
+        if (!similarity)
+            return false;
+        record = SphereRecord{world_center, radius_world};
+        return true;
+    }
+
     AABB get_bbox() const override {
+        if (similarity)
+            return AABB{world_center - Vec3f{radius_world + Epsilon}, world_center + Vec3f{radius_world + Epsilon}};
         Vec3f corner_1 = center + Vec3f{radius, radius, radius};
         Vec3f corner_2 = center + Vec3f{radius, radius, -radius};
         Vec3f corner_3 = center + Vec3f{radius, -radius, radius};
@@ -103,7 +122,6 @@ public:
     }
 
     Vec3f get_normal(const Vec3f &position) const override {
-        Vec3f world_center = Vec3f{transform * Vec4f{center, 1.0}};
         Vec3f normal = glm::normalize(position - world_center);
         return flip_normals ? -normal : normal;
     }
@@ -120,8 +138,8 @@ public:
             sin(theta) * cos(phi),
             sin(theta) * sin(phi),
             cos(theta)};
-        Vec3f position = center + radius * normal;
-        position = Vec3f{transform * Vec4f{position, 1.0}};
+        // a similarity maps a uniform distribution on the sphere to a uniform one, so the sample is placed in world space directly
+        Vec3f position = similarity ? world_center + radius_world * normal : Vec3f{transform * Vec4f{center + radius * normal, 1.0}};
         Float pdf = 1.0 / (4.0 * Pi * Sqr(radius_world));
 
         return {position, get_normal(position), pdf};
@@ -139,7 +157,10 @@ public:
 
     std::string to_string() const override {
         std::ostringstream oss;
-        oss << "Geometry(Sphere): [ local_center=" << center << ", local_radius=" << radius << " ]";
+        oss << "Geometry(Sphere): [ local_center=" << center << ", local_radius=" << radius;
+        if (similarity)
+            oss << ", world_center=" << world_center << ", world_radius=" << radius_world;
+        oss << " ]";
         return oss.str();
     }
 };
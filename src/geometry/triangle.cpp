@@ -1,110 +1,574 @@
 #include "core/Geometry.h"
-#include "core/Registry.h"
+#include "core/Thread.h"
+#include "core/TriangleMesh.h"
+#include "core/TrianglePacket.h"
 #include "utils/Misc.h"
 
+/// A triangle of a TriangleMesh. It only stores its index; the vertices and the shading flags are in the mesh
 class Triangle : public Geometry {
 public:
-    const std::array<const Vec3f *, 3> positions;
-    const std::array<const Vec3f *, 3> normals;
-    const std::array<const Vec2f *, 3> tex_coords;
-    bool face_normals;
-    bool flip_normals;
+    const TriangleMesh *mesh = nullptr;
+    uint32_t index = 0;
 
-    Triangle(const std::array<const Vec3f *, 3> &positions_, const std::array<const Vec3f *, 3> &normals_, const std::array<const Vec2f *, 3> &tex_coords_, const Shape *parent_shape, bool face_normals_, bool flip_normals_) : positions(positions_), normals(normals_), tex_coords(tex_coords_), face_normals(face_normals_), flip_normals(flip_normals_) {
-        this->parent_shape = parent_shape;
+    const Vec3f &position(int i) const {
+        return mesh->positions[mesh->indices[3 * index + i]];
+    }
+    Vec3f normal(int i) const {
+        return mesh->normal(mesh->indices[3 * index + i]);
+    }
+    Vec2f tex_coord(int i) const {
+        return mesh->texcoord(mesh->indices[3 * index + i]);
+    }
+
+    TriangleRecord record() const {
+        return TriangleRecord{position(0), position(1), position(2), true};
+    }
+
+    /// the shading normal at the point with barycentric coordinates (b0, b1, b2)
+    Vec3f shading_normal(const Vec3f &bary_coords) const {
+        Vec3f normal;
+        if (mesh->face_normals)
+            normal = mesh->geometric_normal(index);
+        else
+            normal = glm::normalize(bary_coords.x * this->normal(0) + bary_coords.y * this->normal(1) + bary_coords.z * this->normal(2));
+        return mesh->flip_normals ? -normal : normal;
     }
 
     bool intersect(const Ray &ray, Intersection &isc) const override {
-        Vec3f edge1 = *positions[1] - *positions[0];
-        Vec3f edge2 = *positions[2] - *positions[0];
-        Vec3f h = glm::cross(ray.d, edge2);
-        Float a = glm::dot(edge1, h);
-        if (a > -Epsilon && a < Epsilon)
-            return false;  // parallel to triangle
-        Float f = 1.0 / a;
-        Vec3f s = ray.o - *positions[0];
-        Float u = f * glm::dot(s, h);
-        if (u < 0.0 || u > 1.0)
-            return false;
-        Vec3f q = glm::cross(s, edge1);
-        Float v = f * glm::dot(ray.d, q);
-        // if (v < 0.0 || u + v > 1.0)
-        if (v < -Epsilon || u + v > 1.0 + Epsilon)
-            return false;
-        Float t = f * glm::dot(edge2, q);
-        if (t >= ray.tmin && t <= ray.tmax)  // ray intersection
-        {
-            isc.distance = t;
-            isc.position = ray(t);
-            isc.normal = get_normal(isc.position);
-            isc.dirn = -ray.d;
-            isc.shape = parent_shape;
-            isc.geom = this;
-            return true;
-        } else  // isc point is behind the ray
+        Float t;
+        Vec2f bary;
+        if (!intersect_triangle(record(), ray, t, bary))
             return false;
+        set_triangle_hit(this, t, bary, isc);
+        return true;
+    }
+
+    bool occluded(const Ray &ray) const override {
+        Float t;
+        Vec2f bary;
+        return intersect_triangle(record(), ray, t, bary);
+    }
+
+    void compute_surface_interaction(const Ray &ray, Intersection &isc) const override {
+        // interpolate with the barycentric coordinates of the hit, instead of recovering them from the position
+        const Vec3f bary_coords{Float(1.0) - isc.bary.x - isc.bary.y, isc.bary.x, isc.bary.y};
+        isc.position = bary_coords.x * position(0) + bary_coords.y * position(1) + bary_coords.z * position(2);
+        isc.normal = shading_normal(bary_coords);
+        if (!mesh->has_texcoords())
+            isc.uv = Vec2f{0.0, 0.0};
+        else
+            isc.uv = bary_coords.x * tex_coord(0) + bary_coords.y * tex_coord(1) + bary_coords.z * tex_coord(2);
+    }
+
+    bool get_triangle_record(TriangleRecord &record) const override {
+        record = this->record();
+        return true;
+    }
+
+    bool get_mesh_triangle(const TriangleMesh *&mesh, uint32_t &index) const override {
+        mesh = this->mesh;
+        index = this->index;
+        return true;
     }
 
     AABB get_bbox() const override {
-        return AABB{Vec3f{std::min(positions[0]->x, std::min(positions[1]->x, positions[2]->x)) - Epsilon, std::min(positions[0]->y, std::min(positions[1]->y, positions[2]->y)) - Epsilon, std::min(positions[0]->z, std::min(positions[1]->z, positions[2]->z)) - Epsilon},
-                    Vec3f{std::max(positions[0]->x, std::max(positions[1]->x, positions[2]->x)) + Epsilon, std::max(positions[0]->y, std::max(positions[1]->y, positions[2]->y)) + Epsilon, std::max(positions[0]->z, std::max(positions[1]->z, positions[2]->z)) + Epsilon}};
+        const Vec3f &p0 = position(0), &p1 = position(1), &p2 = position(2);
+        return AABB{Vec3f{std::min(p0.x, std::min(p1.x, p2.x)) - Epsilon, std::min(p0.y, std::min(p1.y, p2.y)) - Epsilon, std::min(p0.z, std::min(p1.z, p2.z)) - Epsilon},
+                    Vec3f{std::max(p0.x, std::max(p1.x, p2.x)) + Epsilon, std::max(p0.y, std::max(p1.y, p2.y)) + Epsilon, std::max(p0.z, std::max(p1.z, p2.z)) + Epsilon}};
     }
 
-    Vec3f get_normal(const Vec3f &position) const override {
-        Vec3f normal;
-        if (face_normals) {
-            normal = glm::normalize(glm::cross(*positions[1] - *positions[0], *positions[2] - *positions[0]));
-        } else {
-            Vec3f bary_coords = barycentric(*positions[0], *positions[1], *positions[2], position);
-            normal = glm::normalize(bary_coords.x * (*normals[0]) + bary_coords.y * (*normals[1]) + bary_coords.z * (*normals[2]));
+    AABB get_clipped_bbox(const AABB &clip) const override {
+        // clip the triangle against the six planes of the box (Sutherland-Hodgman) and bound the remaining polygon.
+        // every plane adds at most one vertex
+        std::array<Vec3f, 9> polygon, clipped;
+        int n_vertices = 3;
+        for (int i = 0; i < 3; i++)
+            polygon[i] = position(i);
+        for (int axis = 0; axis < 3; axis++) {
+            for (int side = 0; side < 2; side++) {
+                Float plane = side == 0 ? clip.min_corner[axis] : clip.max_corner[axis];
+                auto inside = [&](const Vec3f &p) { return side == 0 ? p[axis] >= plane : p[axis] <= plane; };
+                int n_clipped = 0;
+                for (int i = 0; i < n_vertices; i++) {
+                    const Vec3f &a = polygon[i];
+                    const Vec3f &b = polygon[(i + 1) % n_vertices];
+                    if (inside(a))
+                        clipped[n_clipped++] = a;
+                    if (inside(a) != inside(b)) {
+                        Vec3f p = a + (b - a) * ((plane - a[axis]) / (b[axis] - a[axis]));
+                        p[axis] = plane;
+                        clipped[n_clipped++] = p;
+                    }
+                }
+                polygon = clipped;
+                n_vertices = n_clipped;
+                if (n_vertices == 0)
+                    return AABB::empty();
+            }
         }
-        return flip_normals ? -normal : normal;
+        AABB bbox = AABB::empty();
+        for (int i = 0; i < n_vertices; i++)
+            bbox = bbox + AABB{polygon[i], polygon[i]};
+        // same padding as get_bbox(), but never outside the clip box
+        return AABB{bbox.min_corner - Vec3f{Epsilon}, bbox.max_corner + Vec3f{Epsilon}}.intersection(clip);
+    }
+
+    Vec3f get_normal(const Vec3f &posn) const override {
+        if (mesh->face_normals)
+            return shading_normal(Vec3f{});
+        return shading_normal(barycentric(position(0), position(1), position(2), posn));
     }
 
     Float area() const override {
-        return triangle_area(*positions[0], *positions[1], *positions[2]);
+        return triangle_area(position(0), position(1), position(2));
     }
 
     std::tuple<Vec3f, Vec3f, Float> sample_point_on_surface(const Vec2f &sample) const override {
         // uniform sampling on triangle surface
         Float r_sqrd = std::sqrt(sample.x);
-        Vec3f rnd_pt = *positions[0] * (Float(1.0) - sample.y) * r_sqrd + *positions[1] * (Float(1.0) - r_sqrd) + *positions[2] * sample.y * r_sqrd;
+        Vec3f rnd_pt = position(0) * (Float(1.0) - sample.y) * r_sqrd + position(1) * (Float(1.0) - r_sqrd) + position(2) * sample.y * r_sqrd;
         Vec3f normal = get_normal(rnd_pt);
-        Float pdf = 1.0 / triangle_area(*positions[0], *positions[1], *positions[2]);
+        Float pdf = 1.0 / area();
 
         return {rnd_pt, normal, pdf};
     }
 
     Vec2f get_uv(const Vec3f &posn) const override {
-        if (tex_coords[0] == nullptr || tex_coords[1] == nullptr || tex_coords[2] == nullptr)
+        if (!mesh->has_texcoords())
             return Vec2f{0.0, 0.0};
-        Vec3f bary_coords = barycentric(*positions[0], *positions[1], *positions[2], posn);
-        return bary_coords.x * (*tex_coords[0]) + bary_coords.y * (*tex_coords[1]) + bary_coords.z * (*tex_coords[2]);
+        Vec3f bary_coords = barycentric(position(0), position(1), position(2), posn);
+        return bary_coords.x * tex_coord(0) + bary_coords.y * tex_coord(1) + bary_coords.z * tex_coord(2);
     }
 
     std::string to_string() const override {
         std::ostringstream oss;
         oss << "Geometry(Triangle): [";
-        oss << " positions=" << std::format("[{}, {}, {}] - [{}, {}, {}] - [{}, {}, {}]", positions[0]->x, positions[0]->y, positions[0]->z, positions[1]->x, positions[1]->y, positions[1]->z, positions[2]->x, positions[2]->y, positions[2]->z);
-        if (normals[0] != nullptr)
-            oss << " --- normals=" << std::format("[{}, {}, {}] - [{}, {}, {}] - [{}, {}, {}]", normals[0]->x, normals[0]->y, normals[0]->z, normals[1]->x, normals[1]->y, normals[1]->z, normals[2]->x, normals[2]->y, normals[2]->z);
-        if (tex_coords[0] != nullptr)
-            oss << " --- texcoords=" << std::format("[{}, {}] - [{}, {}] - [{}, {}] ", tex_coords[0]->x, tex_coords[0]->y, tex_coords[1]->x, tex_coords[1]->y, tex_coords[2]->x, tex_coords[2]->y);
+        oss << " positions=" << std::format("[{}, {}, {}] - [{}, {}, {}] - [{}, {}, {}]", position(0).x, position(0).y, position(0).z, position(1).x, position(1).y, position(1).z, position(2).x, position(2).y, position(2).z);
+        if (mesh->has_normals()) {
+            const Vec3f n0 = normal(0), n1 = normal(1), n2 = normal(2);
+            oss << " --- normals=" << std::format("[{}, {}, {}] - [{}, {}, {}] - [{}, {}, {}]", n0.x, n0.y, n0.z, n1.x, n1.y, n1.z, n2.x, n2.y, n2.z);
+        }
+        if (mesh->has_texcoords()) {
+            const Vec2f t0 = tex_coord(0), t1 = tex_coord(1), t2 = tex_coord(2);
+            oss << " --- texcoords=" << std::format("[{}, {}] - [{}, {}] - [{}, {}] ", t0.x, t0.y, t1.x, t1.y, t2.x, t2.y);
+        }
+        oss << "]";
+        return oss.str();
+    }
+};
+
+/// A quad of a TriangleMesh: the triangles first_triangle and first_triangle + 1, (v0, v1, v2) and (v0, v2, v3) (see TriangleMesh::quads).
+/// One geometry, and one primitive reference in the accelerators, instead of two Triangles
+class Quad : public Geometry {
+public:
+    const TriangleMesh *mesh = nullptr;
+    uint32_t first_triangle = 0;
+
+    /// the vertex i of the quad, in (v0, v1, v2, v3)
+    const Vec3f &position(int i) const {
+        return mesh->positions[mesh->quad_indices(first_triangle)[i]];
+    }
+
+    /// the first (0) or second (1) half of the quad
+    Triangle half(int h) const {
+        Triangle triangle;
+        triangle.mesh = mesh;
+        triangle.index = first_triangle + h;
+        triangle.parent_shape = parent_shape;
+        return triangle;
+    }
+
+    /// the half of the quad that contains a point on its surface: the second one if it's past the diagonal v0 - v2
+    int half_of(const Vec3f &posn) const {
+        return barycentric(position(0), position(1), position(2), posn).y < 0.0 ? 1 : 0;
+    }
+
+    bool intersect(const Ray &ray, Intersection &isc) const override {
+        Float t;
+        Vec2f bary;
+        if (!intersect_quad(position(0), position(1), position(2), position(3), ray, t, bary))
+            return false;
+        set_triangle_hit(this, t, bary, isc);
+        return true;
+    }
+
+    bool occluded(const Ray &ray) const override {
+        Float t;
+        Vec2f bary;
+        return intersect_quad(position(0), position(1), position(2), position(3), ray, t, bary);
+    }
+
+    void compute_surface_interaction(const Ray &ray, Intersection &isc) const override {
+        // decode the half of the hit (see set_quad_hit()) and shade it like a triangle
+        const Vec2f bary = isc.bary;
+        const bool second_half = bary.x < 0.0;
+        isc.bary = second_half ? Vec2f{bary.y, -bary.x} : bary;
+        half(second_half ? 1 : 0).compute_surface_interaction(ray, isc);
+        isc.bary = bary;
+    }
+
+    bool get_mesh_quad(const TriangleMesh *&mesh, uint32_t &first_triangle) const override {
+        mesh = this->mesh;
+        first_triangle = this->first_triangle;
+        return true;
+    }
+
+    AABB get_bbox() const override {
+        return half(0).get_bbox() + half(1).get_bbox();
+    }
+
+    AABB get_clipped_bbox(const AABB &clip) const override {
+        return half(0).get_clipped_bbox(clip) + half(1).get_clipped_bbox(clip);
+    }
+
+    Vec3f get_normal(const Vec3f &posn) const override {
+        return half(half_of(posn)).get_normal(posn);
+    }
+
+    Float area() const override {
+        return half(0).area() + half(1).area();
+    }
+
+    std::tuple<Vec3f, Vec3f, Float> sample_point_on_surface(const Vec2f &sample) const override {
+        // pick a half in proportion to its area, and reuse the sample within it
+        const Float area0 = half(0).area(), total_area = area0 + half(1).area();
+        const Float u = sample.x * total_area;
+        const int h = u < area0 ? 0 : 1;
+        const Float remapped = h == 0 ? u / area0 : (u - area0) / (total_area - area0);
+        auto [posn, normal, pdf] = half(h).sample_point_on_surface(Vec2f{std::min(remapped, Float(1.0)), sample.y});
+        return {posn, normal, Float(1.0) / total_area};
+    }
+
+    Vec2f get_uv(const Vec3f &posn) const override {
+        return half(half_of(posn)).get_uv(posn);
+    }
+
+    std::string to_string() const override {
+        std::ostringstream oss;
+        oss << "Geometry(Quad): [";
+        oss << " positions=" << std::format("[{}, {}, {}] - [{}, {}, {}] - [{}, {}, {}] - [{}, {}, {}]", position(0).x, position(0).y, position(0).z, position(1).x, position(1).y,
+                                            position(1).z, position(2).x, position(2).y, position(2).z, position(3).x, position(3).y, position(3).z);
         oss << "]";
         return oss.str();
     }
 };
 
-// --------------------------- Registry functions ---------------------------
-Geometry *createTriangle(const std::unordered_map<std::string, std::string> &properties, const Shape *parent_shape, const GeometryCreationContext *ctx) {
-    bool face_normals = false;
-    bool flip_normals = false;
+// --------------------------- Mesh functions ---------------------------
+namespace {
+
+/// call func(begin, end, chunk_index) on [0, n), split into chunks on the pool if one is given
+template <typename Func>
+void for_chunks(TaskPool *pool, size_t n, Func &&func) {
+    if (pool == nullptr)
+        func(0, n, 0);
+    else
+        pool->parallel_for_chunks(0, n, func);
+}
+
+}  // namespace
+
+void TriangleMesh::transform(const Mat4f &to_world, const Mat4f &inv_to_world, TaskPool *pool) {
+    // split into the 3x3 part and the translation, so the loops are plain 3x3 products that vectorize
+    const Mat3f linear{to_world};
+    const Vec3f translation{to_world[3]};
+    // use the inverse transpose of the upper-left 3x3 part of the matrix
+    const Mat3f tsp_inv_linear = glm::transpose(Mat3f{inv_to_world});
+    for_chunks(pool, std::max(positions.size(), normals.size()), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < std::min(end, positions.size()); i++)
+            positions[i] = linear * positions[i] + translation;
+        for (size_t i = begin; i < std::min(end, normals.size()); i++)
+            normals[i] = glm::normalize(tsp_inv_linear * normals[i]);
+    });
+}
+
+void TriangleMesh::compute_geometric_normals(TaskPool *pool) {
+    geometric_normals.resize(n_triangles());
+    for_chunks(pool, n_triangles(), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            const Vec3f &p0 = positions[indices[3 * i]], &p1 = positions[indices[3 * i + 1]], &p2 = positions[indices[3 * i + 2]];
+            Vec3f normal = glm::cross(p1 - p0, p2 - p0);
+            Float length = glm::length(normal);
+            geometric_normals[i] = length > 0.0 ? normal / length : Vec3f{0.0};
+        }
+    });
+}
+
+void TriangleMesh::compute_vertex_normals(Float crease_angle, TaskPool *pool) {
+    const size_t n_vertices = positions.size();
+    const size_t n_corners = indices.size();
+    if (geometric_normals.size() != n_triangles())
+        compute_geometric_normals(pool);
+
+    // angle of every triangle at each of its corners. Degenerate triangles have a zero normal, so their weight doesn't matter
+    std::vector<Float> angles(n_corners);
+    for_chunks(pool, n_triangles(), [&](size_t begin, size_t end, size_t) {
+        for (size_t i = begin; i < end; i++) {
+            for (size_t k = 0; k < 3; k++) {
+                const Vec3f &p = positions[indices[3 * i + k]];
+                Vec3f e1 = positions[indices[3 * i + (k + 1) % 3]] - p;
+                Vec3f e2 = positions[indices[3 * i + (k + 2) % 3]] - p;
+                angles[3 * i + k] = std::atan2(glm::length(glm::cross(e1, e2)), glm::dot(e1, e2));
+            }
+        }
+    });
+
+    // the corners of every vertex: vertex v has vertex_corners[corner_offsets[v]] to vertex_corners[corner_offsets[v + 1] - 1]
+    std::vector<size_t> corner_offsets(n_vertices + 1, 0);
+    for (uint32_t v : indices)
+        corner_offsets[v + 1]++;
+    for (size_t v = 0; v < n_vertices; v++)
+        corner_offsets[v + 1] += corner_offsets[v];
+    std::vector<size_t> vertex_corners(n_corners);
+    {
+        std::vector<size_t> next(corner_offsets.begin(), corner_offsets.end() - 1);
+        for (size_t c = 0; c < n_corners; c++)
+            vertex_corners[next[indices[c]]++] = c;
+    }
+    auto normalized = [](const Vec3f &sum) {
+        Float length = glm::length(sum);
+        return length > 0.0 ? sum / length : sum;
+    };
+
+    if (crease_angle >= 180.0) {
+        // one normal per vertex, gathered from its corners so the vertices can be processed in parallel
+        normals.resize(n_vertices);
+        for_chunks(pool, n_vertices, [&](size_t begin, size_t end, size_t) {
+            for (size_t v = begin; v < end; v++) {
+                Vec3f sum{0.0};
+                for (size_t j = corner_offsets[v]; j < corner_offsets[v + 1]; j++)
+                    sum += angles[vertex_corners[j]] * geometric_normals[vertex_corners[j] / 3];
+                normals[v] = normalized(sum);
+            }
+        });
+        return;
+    }
+
+    // with a crease angle, every corner averages only the triangles around its vertex that are within the angle of its own.
+    // Corners with the same normal share a vertex; the first normal of a vertex keeps it, and every other one gets a new vertex
+    const Float cos_crease = std::cos(glm::radians(std::max(crease_angle, Float(0.0))));
+    std::vector<Vec3f> corner_normals(n_corners);
+    // index of the normal of every corner among the distinct normals of its vertex
+    std::vector<uint32_t> corner_ranks(n_corners);
+    std::vector<size_t> n_extra(n_vertices + 1, 0);
+    for_chunks(pool, n_vertices, [&](size_t begin, size_t end, size_t) {
+        for (size_t v = begin; v < end; v++) {
+            const size_t first = corner_offsets[v], last = corner_offsets[v + 1];
+            uint32_t n_distinct = 0;
+            for (size_t j = first; j < last; j++) {
+                const Vec3f &face_normal = geometric_normals[vertex_corners[j] / 3];
+                const bool degenerate = face_normal == Vec3f{0.0};
+                Vec3f sum{0.0};
+                for (size_t l = first; l < last; l++) {
+                    const Vec3f &other = geometric_normals[vertex_corners[l] / 3];
+                    if (degenerate || glm::dot(face_normal, other) >= cos_crease)
+                        sum += angles[vertex_corners[l]] * other;
+                }
+                // the sums are taken in the same order, so corners on the same side of the creases get exactly the same normal
+                Vec3f normal = normalized(sum);
+                uint32_t rank = n_distinct;
+                for (size_t l = first; l < j; l++) {
+                    if (corner_normals[vertex_corners[l]] == normal) {
+                        rank = corner_ranks[vertex_corners[l]];
+                        break;
+                    }
+                }
+                if (rank == n_distinct)
+                    n_distinct++;
+                corner_normals[vertex_corners[j]] = normal;
+                corner_ranks[vertex_corners[j]] = rank;
+            }
+            n_extra[v + 1] = n_distinct > 1 ? n_distinct - 1 : 0;
+        }
+    });
+    for (size_t v = 0; v < n_vertices; v++)
+        n_extra[v + 1] += n_extra[v];
+    if (n_vertices + n_extra[n_vertices] > 0xFFFFFFFF)
+        throw std::runtime_error("Splitting the vertices on the creases makes more than 2^32 vertices");
+
+    // the new vertices of vertex v start at n_vertices + n_extra[v]. Every corner belongs to one vertex, so the vertices
+    // can write their corners in parallel
+    const size_t n_split = n_vertices + n_extra[n_vertices];
+    positions.resize(n_split);
+    if (!texcoords.empty())
+        texcoords.resize(n_split);
+    normals.assign(n_split, Vec3f{0.0});
+    for_chunks(pool, n_vertices, [&](size_t begin, size_t end, size_t) {
+        for (size_t v = begin; v < end; v++) {
+            for (size_t j = corner_offsets[v]; j < corner_offsets[v + 1]; j++) {
+                const size_t c = vertex_corners[j];
+                const size_t vertex = corner_ranks[c] == 0 ? v : n_vertices + n_extra[v] + corner_ranks[c] - 1;
+                if (vertex != v) {
+                    positions[vertex] = positions[v];
+                    if (!texcoords.empty())
+                        texcoords[vertex] = texcoords[v];
+                }
+                normals[vertex] = corner_normals[c];
+                indices[c] = static_cast<uint32_t>(vertex);
+            }
+        }
+    });
+}
+
+MeshCompressionError TriangleMesh::compress(TaskPool *pool) {
+    // the largest errors of every chunk, merged at the end
+    std::vector<MeshCompressionError> chunk_errors(pool != nullptr ? pool->size() : 1);
+    auto pack_normals = [&](std::vector<Vec3f> &unpacked, std::vector<uint32_t> &packed) {
+        if (unpacked.empty())
+            return;
+        packed.resize(unpacked.size());
+        for_chunks(pool, unpacked.size(), [&](size_t begin, size_t end, size_t chunk) {
+            Float min_cos = 1.0;
+            for (size_t i = begin; i < end; i++) {
+                packed[i] = encode_octahedral(unpacked[i]);
+                if (unpacked[i] != Vec3f{0.0})
+                    min_cos = std::min(min_cos, glm::dot(decode_octahedral(packed[i]), glm::normalize(unpacked[i])));
+            }
+            Float degrees = glm::degrees(std::acos(glm::clamp(min_cos, Float(-1.0), Float(1.0))));
+            chunk_errors[chunk].normal_degrees = std::max(chunk_errors[chunk].normal_degrees, degrees);
+        });
+        unpacked.clear();
+        unpacked.shrink_to_fit();
+    };
+    pack_normals(normals, packed_normals);
+    pack_normals(geometric_normals, packed_geometric_normals);
+
+    if (!texcoords.empty()) {
+        packed_texcoords.resize(texcoords.size());
+        for_chunks(pool, texcoords.size(), [&](size_t begin, size_t end, size_t chunk) {
+            for (size_t i = begin; i < end; i++) {
+                packed_texcoords[i] = float_to_half(static_cast<float>(texcoords[i].x)) | static_cast<uint32_t>(float_to_half(static_cast<float>(texcoords[i].y))) << 16;
+                const Vec2f error = glm::abs(texcoord(static_cast<uint32_t>(i)) - texcoords[i]);
+                chunk_errors[chunk].texcoord = std::max(chunk_errors[chunk].texcoord, std::max(error.x, error.y));
+            }
+        });
+        texcoords.clear();
+        texcoords.shrink_to_fit();
+    }
 
+    MeshCompressionError error;
+    for (const auto &chunk_error : chunk_errors) {
+        error.normal_degrees = std::max(error.normal_degrees, chunk_error.normal_degrees);
+        error.texcoord = std::max(error.texcoord, chunk_error.texcoord);
+    }
+    return error;
+}
+
+size_t TriangleMesh::memory_footprint() const {
+    return positions.capacity() * sizeof(Vec3f) + normals.capacity() * sizeof(Vec3f) + texcoords.capacity() * sizeof(Vec2f) +
+           indices.capacity() * sizeof(uint32_t) + geometric_normals.capacity() * sizeof(Vec3f) +
+           (packed_normals.capacity() + packed_texcoords.capacity() + packed_geometric_normals.capacity() + quads.capacity()) * sizeof(uint32_t) +
+           (n_triangles() - 2 * quads.size()) * sizeof(Triangle) + quads.size() * sizeof(Quad);
+}
+
+std::vector<TrianglePacket> make_triangle_packets(const std::vector<Geometry *> &primitives, bool watertight) {
+    std::vector<TrianglePacket> packets((primitives.size() + TRIANGLE_PACKET_WIDTH - 1) / TRIANGLE_PACKET_WIDTH, TrianglePacket{});
+    for (size_t i = 0; i < primitives.size(); i++) {
+        TrianglePacket &packet = packets[i / TRIANGLE_PACKET_WIDTH];
+        size_t lane = i % TRIANGLE_PACKET_WIDTH;
+        TriangleRecord record;
+        const TriangleMesh *mesh;
+        uint32_t first_triangle;
+        if (primitives[i]->get_mesh_quad(mesh, first_triangle)) {
+            // the first half of the quad, see QuadPacket for the rest
+            const std::array<uint32_t, 4> quad = mesh->quad_indices(first_triangle);
+            record = TriangleRecord{mesh->positions[quad[0]], mesh->positions[quad[1]], mesh->positions[quad[2]], true};
+            packet.quad_mask |= 1u << lane;
+        } else if (!primitives[i]->get_triangle_record(record)) {
+            continue;
+        }
+        Vec3f p1 = watertight ? record.v1 : record.v1 - record.v0;
+        Vec3f p2 = watertight ? record.v2 : record.v2 - record.v0;
+        for (int axis = 0; axis < 3; axis++) {
+            packet.p0[axis][lane] = record.v0[axis];
+            packet.p1[axis][lane] = p1[axis];
+            packet.p2[axis][lane] = p2[axis];
+        }
+        packet.triangle_mask |= 1u << lane;
+    }
+    return packets;
+}
+
+std::vector<QuadPacket> make_quad_packets(const std::vector<Geometry *> &primitives, bool watertight) {
+    std::vector<QuadPacket> packets;
+    for (size_t i = 0; i < primitives.size(); i++) {
+        const TriangleMesh *mesh;
+        uint32_t first_triangle;
+        if (!primitives[i]->get_mesh_quad(mesh, first_triangle))
+            continue;
+        if (packets.empty())
+            packets.resize((primitives.size() + TRIANGLE_PACKET_WIDTH - 1) / TRIANGLE_PACKET_WIDTH, QuadPacket{});
+        const std::array<uint32_t, 4> quad = mesh->quad_indices(first_triangle);
+        const Vec3f p3 = watertight ? mesh->positions[quad[3]] : mesh->positions[quad[3]] - mesh->positions[quad[0]];
+        for (int axis = 0; axis < 3; axis++)
+            packets[i / TRIANGLE_PACKET_WIDTH].p3[axis][i % TRIANGLE_PACKET_WIDTH] = p3[axis];
+    }
+    return packets;
+}
+
+LeafPrimitives make_leaf_primitives(const std::vector<Geometry *> &primitives, bool watertight, bool compact) {
+    LeafPrimitives leaf;
+    leaf.compact = compact;
+    if (compact) {
+        // only the type masks and the mesh triangle of every reference are kept; the vertices stay in the meshes
+        leaf.masks.resize((primitives.size() + TRIANGLE_PACKET_WIDTH - 1) / TRIANGLE_PACKET_WIDTH, PacketMasks{});
+        leaf.triangles.resize(primitives.size(), MeshTriangleRef{});
+        std::unordered_map<const TriangleMesh *, uint32_t> mesh_ids;
+        for (size_t i = 0; i < primitives.size(); i++) {
+            const TriangleMesh *mesh;
+            uint32_t index;
+            PacketMasks &masks = leaf.masks[i / TRIANGLE_PACKET_WIDTH];
+            const uint32_t lane_bit = 1u << (i % TRIANGLE_PACKET_WIDTH);
+            if (primitives[i]->get_mesh_quad(mesh, index))
+                masks.quad_mask |= lane_bit;
+            else if (!primitives[i]->get_mesh_triangle(mesh, index))
+                continue;
+            auto [it, inserted] = mesh_ids.try_emplace(mesh, static_cast<uint32_t>(leaf.meshes.size()));
+            if (inserted)
+                leaf.meshes.push_back(mesh);
+            leaf.triangles[i] = MeshTriangleRef{it->second, index};
+            masks.triangle_mask |= lane_bit;
+        }
+    } else {
+        leaf.packets = make_triangle_packets(primitives, watertight);
+        leaf.quad_packets = make_quad_packets(primitives, watertight);
+    }
+    for (size_t i = 0; i < primitives.size(); i++) {
+        const size_t k = i / TRIANGLE_PACKET_WIDTH;
+        uint32_t &triangle_mask = compact ? leaf.masks[k].triangle_mask : leaf.packets[k].triangle_mask;
+        uint32_t &sphere_mask = compact ? leaf.masks[k].sphere_mask : leaf.packets[k].sphere_mask;
+        uint32_t &disk_mask = compact ? leaf.masks[k].disk_mask : leaf.packets[k].disk_mask;
+        const uint32_t lane_bit = 1u << (i % TRIANGLE_PACKET_WIDTH);
+        if (triangle_mask & lane_bit)
+            continue;
+        SphereRecord sphere;
+        DiskRecord disk;
+        if (primitives[i]->get_sphere_record(sphere)) {
+            if (leaf.record_index.empty())
+                leaf.record_index.resize(primitives.size(), 0);
+            leaf.record_index[i] = static_cast<uint32_t>(leaf.spheres.size());
+            leaf.spheres.push_back(sphere);
+            sphere_mask |= lane_bit;
+        } else if (primitives[i]->get_disk_record(disk)) {
+            if (leaf.record_index.empty())
+                leaf.record_index.resize(primitives.size(), 0);
+            leaf.record_index[i] = static_cast<uint32_t>(leaf.disks.size());
+            leaf.disks.push_back(disk);
+            disk_mask |= lane_bit;
+        }
+    }
+    return leaf;
+}
+
+void create_mesh_triangles(TriangleMesh *mesh, const std::unordered_map<std::string, std::string> &properties, const Shape *parent_shape, std::vector<Geometry *> &geometries,
+                           TaskPool *pool) {
+    Float crease_angle = 180.0;
     for (const auto &[key, value] : properties) {
         if (key == "face_normals") {
-            face_normals = (value == "true" || value == "1");
+            mesh->face_normals = (value == "true" || value == "1");
         } else if (key == "flip_normals") {
-            flip_normals = (value == "true" || value == "1");
+            mesh->flip_normals = (value == "true" || value == "1");
+        } else if (key == "crease_angle") {
+            crease_angle = std::stod(value);
         } else if (key == "to_world" || key == "inv_to_world") {
             // ignore. handled in Shape
         } else if (key == "filename" || key == "shape_index") {
@@ -114,21 +578,32 @@ Geometry *createTriangle(const std::unordered_map<std::string, std::string> &pro
         }
     }
 
-    if (!face_normals && (ctx->vn[0] == nullptr || ctx->vn[1] == nullptr || ctx->vn[2] == nullptr)) {
-        // std::cerr << "Warning: No vertex normals provided for triangle, using face normals instead." << std::endl;
-        face_normals = true;
-    }
-
-    auto triangle = new Triangle{ctx->vp, ctx->vn, ctx->vt, parent_shape, face_normals, flip_normals};
-    return triangle;
-}
+    // computed once here, so shading never recomputes them per hit
+    mesh->compute_geometric_normals(pool);
+    if (mesh->normals.empty() && !mesh->face_normals)
+        mesh->compute_vertex_normals(crease_angle, pool);
 
-namespace {
-struct TriangleRegistrar {
-    TriangleRegistrar() {
-        GeometryRegistry::registerGeometry("triangle", createTriangle);
+    // the triangles and quads of a mesh are never freed separately, so they're allocated together, in the order of the triangles
+    const size_t n_triangles = mesh->n_triangles();
+    const size_t n_quads = mesh->quads.size();
+    auto triangles = new Triangle[n_triangles - 2 * n_quads];
+    auto quads = n_quads > 0 ? new Quad[n_quads] : nullptr;
+    geometries.reserve(geometries.size() + n_triangles - n_quads);
+    size_t next_triangle = 0, next_quad = 0;
+    for (size_t i = 0; i < n_triangles; i++) {
+        Geometry *geom;
+        if (next_quad < n_quads && mesh->quads[next_quad] == i) {
+            Quad &quad = quads[next_quad++];
+            quad.mesh = mesh;
+            quad.first_triangle = static_cast<uint32_t>(i++);
+            geom = &quad;
+        } else {
+            Triangle &triangle = triangles[next_triangle++];
+            triangle.mesh = mesh;
+            triangle.index = static_cast<uint32_t>(i);
+            geom = &triangle;
+        }
+        geom->parent_shape = parent_shape;
+        geometries.push_back(geom);
     }
-};
-
-static TriangleRegistrar registrar;
-}  // namespace
+}
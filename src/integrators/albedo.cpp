@@ -11,6 +11,12 @@ public:
     Vec3f sample_radiance(const Scene *scene, Sampler *sampler, const Ray &ray, int row, int col) const override {
         Intersection isc;
         bool is_hit = scene->ray_intersect(ray, isc);
+        return sample_radiance_primary(scene, sampler, ray, is_hit, isc, row, col);
+    }
+
+    bool trace_primary_packets() const override { return true; }
+
+    Vec3f sample_radiance_primary(const Scene *scene, Sampler *sampler, const Ray &ray, bool is_hit, const Intersection &isc, int row, int col) const override {
         if (is_hit) {
             // reflectance in diffuse BSDFs
             throw std::runtime_error("Albedo integrator not implemented yet.");
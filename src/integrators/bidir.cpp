@@ -318,9 +318,8 @@ bool BidirIntegrator::isConnValid(const std::vector<Vertex> &cam_path, const std
     // Check for occlusion
     Float dist = glm::length(lightVertex.isc.position - camVertex.isc.position);
     Ray occl_ray{camVertex.isc.position + sign(glm::dot(camVertex.isc.normal, dirn)) * Epsilon * dirn, dirn,
-                 1e-3, dist - 1e-3f, true};
-    Intersection tmp_isc;
-    if (scene->ray_intersect(occl_ray, tmp_isc))
+                 1e-3, dist - 1e-3f};
+    if (scene->occluded(occl_ray))
         return false;
 
     return true;
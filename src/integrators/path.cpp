@@ -13,6 +13,8 @@ public:
     PathTracerIntegrator(int max_depth, int rr_depth, bool hide_emitters) : MonteCarloIntegrator(max_depth, rr_depth), hide_emitters(hide_emitters) {}
 
     Vec3f sample_radiance(const Scene *scene, Sampler *sampler, const Ray &ray, int row, int col) const override;
+    bool trace_primary_packets() const override { return true; }
+    Vec3f sample_radiance_primary(const Scene *scene, Sampler *sampler, const Ray &ray, bool is_hit, const Intersection &isc, int row, int col) const override;
 
     std::string to_string() const override {
         std::ostringstream oss;
@@ -24,6 +26,12 @@ public:
 // ------------------ PathTracer function definitions ----------------------------
 
 Vec3f PathTracerIntegrator::sample_radiance(const Scene *scene, Sampler *sampler, const Ray &ray, int row, int col) const {
+    Intersection isc;
+    bool is_hit = scene->ray_intersect(ray, isc);
+    return sample_radiance_primary(scene, sampler, ray, is_hit, isc, row, col);
+}
+
+Vec3f PathTracerIntegrator::sample_radiance_primary(const Scene *scene, Sampler *sampler, const Ray &ray, bool is_hit, const Intersection &isc, int row, int col) const {
     if (max_depth == 0)
         return Vec3f{0.0};
     if (max_depth < -1)
@@ -33,8 +41,7 @@ Vec3f PathTracerIntegrator::sample_radiance(const Scene *scene, Sampler *sampler
     Vec3f radiance{0.0};
 
     Ray curr_ray = ray;
-    Intersection curr_isc;
-    bool is_hit = scene->ray_intersect(curr_ray, curr_isc);
+    Intersection curr_isc = isc;
 
     // ----------------------- Visible emitters -----------------------
     if (!hide_emitters) {
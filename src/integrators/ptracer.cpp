@@ -115,8 +115,7 @@ void ParticleTracerIntegrator::sample_particle(int samples_per_thread, const Sce
 
             Float sensor_dist = glm::length(scene->sensor->origin_world - posn);
             // check if camera is visible
-            Intersection tmp_isc;
-            bool is_camera_occluded = scene->ray_intersect(Ray{posn + normal * Epsilon, sensor_dirn, 1e-4, sensor_dist, true}, tmp_isc);
+            bool is_camera_occluded = scene->occluded(Ray{posn + normal * Epsilon, sensor_dirn, 1e-4, sensor_dist});
             if (!is_camera_occluded) {
                 // TODO: should I add a factor of 2Pi?
                 Vec3f camT = T / std::abs(glm::dot(normal, dirn)) * std::abs(glm::dot(normal, sensor_dirn));
@@ -142,8 +141,7 @@ void ParticleTracerIntegrator::sample_particle(int samples_per_thread, const Sce
             Vec3f sensor_dirn = glm::normalize(scene->sensor->origin_world - isc.position);
             Float sensor_dist = glm::length(scene->sensor->origin_world - isc.position);
             // check if camera is visible
-            Intersection tmp_isc;
-            bool is_camera_occluded = scene->ray_intersect(Ray{isc.position + sign(glm::dot(sensor_dirn, isc.normal)) * isc.normal * Epsilon, sensor_dirn, 1e-4, sensor_dist, true}, tmp_isc);
+            bool is_camera_occluded = scene->occluded(Ray{isc.position + sign(glm::dot(sensor_dirn, isc.normal)) * isc.normal * Epsilon, sensor_dirn, 1e-4, sensor_dist});
             if (!is_camera_occluded) {
                 Vec3f w_sensor;
                 Vec2f p_film;
@@ -30,7 +30,8 @@ public:
     }
 
     EmitterSample sampleLi(const Scene *scene, const Intersection &isc, const Vec3f &sample) const override {
-        auto [position, normal, pdf] = shape->sample_point_on_surface(sample.x, Vec2f{sample.y, sample.z});
+        const Geometry *geom = nullptr;
+        auto [position, normal, pdf] = shape->sample_point_on_surface(sample.x, Vec2f{sample.y, sample.z}, &geom);
         Vec3f dirn = position - isc.position;
         Float distance = glm::length(dirn);
         dirn = glm::normalize(dirn);
@@ -39,17 +40,23 @@ public:
         bool is_valid = glm::dot(normal, dirn) < 0.0;
         if (is_valid) {
             // check for occlusion
-            Ray shadow_ray{isc.position + sign(glm::dot(isc.normal, dirn)) * isc.normal * Epsilon, dirn, Epsilon, distance - 2 * Epsilon};
-            Intersection light_isc;
-            bool is_hit = scene->ray_intersect(shadow_ray, light_isc);
-            if (is_hit) {
-                // might be a false positive
-                // TODO: make this more robust
-                if (light_isc.shape != shape || glm::length(light_isc.position - position) >= 1e-2)
-                    is_valid = false;
-            }
-            if (is_valid)
+            // stop short of the sampled point (relative to the distance, to absorb the rounding error of the hit distance),
+            // so the light itself isn't reported as an occluder there
+            Float shadow_tmax = distance - std::max(Float(2 * Epsilon), Float(1e-4) * distance);
+            Ray shadow_ray{isc.position + sign(glm::dot(isc.normal, dirn)) * isc.normal * Epsilon, dirn, Epsilon, shadow_tmax};
+            is_valid = !scene->occluded(shadow_ray);
+            if (is_valid) {
+                Intersection light_isc{};
+                light_isc.distance = distance;
+                light_isc.position = position;
+                light_isc.normal = normal;
+                light_isc.dirn = -dirn;
+                light_isc.shape = shape;
+                // textured emitters are evaluated at the sampled point
+                light_isc.geom = geom;
+                light_isc.uv = geom->get_uv(position);
                 radiance_val = radiance->eval(light_isc);
+            }
         }
         pdf *= Sqr(distance) / std::abs(glm::dot(normal, dirn));
         return EmitterSample{pdf, -dirn, is_valid, radiance_val, EmitterFlags::AREA};
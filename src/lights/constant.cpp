@@ -19,9 +19,9 @@ public:
     EmitterSample sampleLi(const Scene *scene, const Intersection &isc, const Vec3f &sample) const override {
         Vec3f w = uniformSphereSample(Vec2f{sample.y, sample.z});
         // check for occlusion
-        Ray shadow_ray{isc.position + sign(glm::dot(isc.normal, w)) * isc.normal * Epsilon, w, Epsilon, 1e4, true};
+        Ray shadow_ray{isc.position + sign(glm::dot(isc.normal, w)) * isc.normal * Epsilon, w, Epsilon, 1e4};
+        bool is_valid = !scene->occluded(shadow_ray);
         Intersection tmp_isc{};
-        bool is_valid = !scene->ray_intersect(shadow_ray, tmp_isc);
         tmp_isc.dirn = w;
 
         return EmitterSample{Inv4Pi, -w, is_valid, eval(tmp_isc), EmitterFlags::NONE};
@@ -23,9 +23,8 @@ public:
         bool is_valid = true;
         if (is_valid) {
             // check for occlusion
-            Ray shadow_ray{isc.position + sign(glm::dot(isc.normal, dirn)) * isc.normal * Epsilon, dirn, Epsilon, distance - 2 * Epsilon, true};
-            Intersection tmp_isc{};
-            is_valid = !scene->ray_intersect(shadow_ray, tmp_isc);
+            Ray shadow_ray{isc.position + sign(glm::dot(isc.normal, dirn)) * isc.normal * Epsilon, dirn, Epsilon, distance - 2 * Epsilon};
+            is_valid = !scene->occluded(shadow_ray);
         }
 
         return EmitterSample{1.0, -dirn, is_valid, intensity / Sqr(distance), EmitterFlags::DELTA_POSITION};
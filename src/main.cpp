@@ -1,3 +1,4 @@
+#include <chrono>
 #include <iostream>
 
 #include "core/Integrator.h"
@@ -26,16 +27,43 @@ int run(int argc, char** argv) {
     if (scene_desc.props.contains("accel_type")) {
         if (scene_desc.props.at("accel_type") == "bvh")
             scene.accel_type = AccelerationType::BVH;
+        else if (scene_desc.props.at("accel_type") == "sah")
+            scene.accel_type = AccelerationType::BVH_SAH;
+        else if (scene_desc.props.at("accel_type") == "sbvh")
+            scene.accel_type = AccelerationType::SBVH;
+        else if (scene_desc.props.at("accel_type") == "lbvh")
+            scene.accel_type = AccelerationType::LBVH;
+        else if (scene_desc.props.at("accel_type") == "bvh4")
+            scene.accel_type = AccelerationType::BVH4;
+        else if (scene_desc.props.at("accel_type") == "bvh8")
+            scene.accel_type = AccelerationType::BVH8;
         else if (scene_desc.props.at("accel_type") == "none")
             scene.accel_type = AccelerationType::NONE;
         else
             throw std::runtime_error("unsupported acceleration type: " + scene_desc.props.at("accel_type"));
     }
+    scene.n_build_threads = std::stoi(props["n_build_threads"]);
+    scene.compare_builders = props["compare_builders"] == "true";
+    scene.test_edges = props["test_edges"] == "true";
+    if (props["no_cache"] != "true") {
+        std::filesystem::path cache_dir = props["cache_dir"].empty() ? scene_file_path.parent_path() : std::filesystem::path{props["cache_dir"]};
+        scene.cache_path = cache_dir / (scene_file_path.stem().string() + ".pcache");
+        scene.rebuild_cache = props["rebuild_cache"] == "true";
+    }
+    auto load_start = std::chrono::high_resolution_clock::now();
     scene.load_scene(scene_desc);
+    std::chrono::duration<double> load_time = std::chrono::high_resolution_clock::now() - load_start;
+    LOG_INFO("Scene loaded in {:.3f} seconds", load_time.count());
 
     Integrator* integrator = IntegratorRegistry::createIntegrator(scene_desc.integrator->type, scene_desc.integrator->properties);
 
+    auto render_start = std::chrono::high_resolution_clock::now();
     integrator->render(&scene, scene.sensor, std::stoi(props["n_threads"]), props["show_progress"] == "true");
+    std::chrono::duration<double> render_time = std::chrono::high_resolution_clock::now() - render_start;
+    LOG_INFO("Rendered in {:.3f} seconds", render_time.count());
+#ifdef BVH_STATS
+    LOG_INFO("{}", bvh_traversal_stats.to_string());
+#endif
 
     scene.sensor->film.output_image(props["output_file"], false);
 
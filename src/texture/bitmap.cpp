@@ -33,7 +33,7 @@ public:
     }
 
     Vec3f eval(const Intersection &isc) const override {
-        Vec2f uv = isc.geom->get_uv(isc.position);
+        Vec2f uv = isc.uv;
         uv = Vec2f{to_uv * Vec4f{uv, 0.0, 1.0}};
         
         if (wrap_mode == "repeat") {
@@ -12,7 +12,7 @@ public:
     CheckerboardTexture(const Vec3f &c0, const Vec3f &c1, const Mat4f &to_uv) : color0(c0), color1(c1), to_uv(to_uv) {}
 
     Vec3f eval(const Intersection &isc) const override {
-        Vec2f uv = isc.geom->get_uv(isc.position);
+        Vec2f uv = isc.uv;
         uv = Vec2f{to_uv * Vec4f{uv, 0.0, 1.0}};
         bool u_mask = uv.x - std::floor(uv.x) > 0.5;
         bool v_mask = uv.y - std::floor(uv.y) > 0.5;